@@ -41,6 +41,7 @@
 #include "debug.h"
 #include "alloc-inl.h"
 #include "hash.h"
+#include "maxafl-info.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -57,6 +58,7 @@
 #include <sched.h>
 #include <math.h>
 #include <assert.h>
+#include <poll.h>
 
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -140,6 +142,7 @@ EXP_ST u8 skip_deterministic, /* Skip deterministic stages?       */
     run_over10m,              /* Run time over 10 minutes?        */
     persistent_mode,          /* Running in persistent mode?      */
     deferred_mode,            /* Deferred forkserver mode?        */
+    shm_input_mode,           /* Test cases delivered via SHM?    */
     fast_cal;                 /* Try to calibrate faster?         */
 
 static s32 out_fd,       /* Persistent fd for out_file       */
@@ -148,6 +151,8 @@ static s32 out_fd,       /* Persistent fd for out_file       */
     fsrv_ctl_fd,         /* Fork server control pipe (write) */
     fsrv_st_fd;          /* Fork server status pipe (read)   */
 
+static u32 prev_timed_out; /* Last child was killed on timeout */
+
 static s32 forksrv_pid, /* PID of the fork server           */
     child_pid = -1,     /* PID of the fuzzed program        */
     out_dir_fd = -1;    /* FD of the lock file              */
@@ -158,14 +163,21 @@ EXP_ST u8 *trace_bits; /* SHM with instrumentation bitmap  */
 // EXP_ST maxafl_info_t *mx_info;
 // EXP_ST u32 *mx_info_ptr;
 
-EXP_ST br_info_t *br_info;
+EXP_ST maxafl_shm_hdr_t *maxafl_state; /* SHM with per-site MaxAFL state */
+EXP_ST u8 *maxafl_shared;              /* SHM shared by every fork server */
+EXP_ST br_static_t *br_static;
+EXP_ST double *br_real;
+EXP_ST br_adapt_t *br_adapt;
+EXP_ST double *cmp_real;
 EXP_ST u32 *br_info_ptr;
 EXP_ST u32 *br_hit;
-EXP_ST cmp_info_t *cmp_info;
 EXP_ST u32 *cmp_info_ptr;
 EXP_ST u32 *cmp_hit;
 EXP_ST s16 *cmpvec;
+EXP_ST u8 *br_done, *cmp_done;
+EXP_ST u32 *cmp_users;
 EXP_ST u32 *exit_penalty;
+EXP_ST u32 *shm_input; /* SHM test case: length, then data */
 
 EXP_ST u8 virgin_bits[MAP_SIZE], /* Regions yet untouched by fuzzing */
     virgin_tmout[MAP_SIZE],      /* Bits we haven't seen in tmouts   */
@@ -177,20 +189,107 @@ static s32 shm_id; /* ID of the SHM region             */
 // static s32 shm_id_max; /* ID of the SHM region             */
 // static s32 shm_id_ptr; /* ID of the SHM region             */
 
-static s32 shm_id_br_info;  /* ID of the SHM region             */
-static s32 shm_id_br_ptr;   /* ID of the SHM region             */
-static s32 shm_id_br_hit;   /* ID of the SHM region             */
-static s32 shm_id_cmp_info; /* ID of the SHM region             */
-static s32 shm_id_cmp_ptr;  /* ID of the SHM region             */
-static s32 shm_id_cmp_hit;  /* ID of the SHM region             */
-static s32 shm_id_cmpvec;
+static s32 shm_id_state;    /* ID of the SHM region             */
+static s32 shm_id_shared;
 static s32 shm_id_exit_penalty;
+static s32 shm_id_input;
+
+#define POOL_SHM_CNT 4 /* trace_bits, state, exit_penalty, input */
+
+/* Extra fork servers for the gradient stage (-j). Each worker owns the
+   per-exec SHM regions and its own test case file. swap_worker() exchanges
+   them with the globals above, so the regular helpers work on a worker.
+   The shared state segment (static branch data, adaptive multipliers,
+   retired sites) is common to all of them. */
+
+struct pool_worker
+{
+
+  u8 *trace_bits;        /* Worker copies of the SHM globals */
+  maxafl_shm_hdr_t *maxafl_state;
+  double *br_real, *cmp_real;
+  u32 *br_hit, *cmp_hit;
+  u32 *exit_penalty;
+  u32 *shm_input;
+  s32 shm_id[POOL_SHM_CNT];
+
+  u8 *out_file, *last_tc; /* Test case file and its delta cache */
+  u32 last_tc_len;
+  s32 out_fd, fsrv_ctl_fd, fsrv_st_fd, forksrv_pid, child_pid;
+  char **argv;            /* argv with @@ pointing at out_file */
+
+  u8 busy,                /* Probe in flight?                  */
+      timed_out;          /* Child killed for running too long */
+  u32 prev_timed_out,     /* Passed to the fork server         */
+      probe;              /* Index of the probe in flight      */
+  u64 start_ms;           /* When the probe was dispatched     */
+};
+
+static struct pool_worker *pool; /* Gradient worker pool              */
+static u32 pool_size;            /* Number of workers, 0 = disabled   */
 
 // MAXAFL
 static u64 cmp_cnt = 0; /* count of instrumented cmp instruction */
 static u64 br_cnt = 0;  /* count of instrumented cmp instruction */
 static u64 vec_cnt = 0;
 static double obj_func;
+
+static br_meta_t *br_meta;   /* Cold branch metadata, by branch id */
+static cmp_meta_t *cmp_meta; /* Cold cmp metadata, by cmp id       */
+
+/* Fuzzer-private branch state. br_list/br_list_state hold the branches of
+   the last exec evaluated by calculate_obj_func(), br_saved holds the state
+   per branch id at the last save_branch_hit(). */
+
+#define BR_STATE_NONE 0
+#define BR_STATE_FAIL 1
+#define BR_STATE_SUCC 2
+#define BR_STATE_FINISH 3
+
+static u32 *br_list,  /* Branches of the last evaluated exec  */
+    *br_saved_list;   /* Branches in the saved snapshot       */
+static s8 *br_list_state, /* State of each br_list entry      */
+    *br_saved;            /* Saved state, by branch id        */
+static u32 br_list_cnt, br_saved_cnt;
+static u8 br_status; /* check_branch_hit() of the last exec   */
+
+/* Frontier of the lbfgs stage: branches that have been hit but only ever
+   went one way. Sides are numbered by the sign bit of br_real, 1 being
+   the left side. Each entry remembers the queue entry that came closest to
+   flipping the branch, the distance being scaled down by the MEIC of the
+   side not taken yet. */
+
+typedef struct br_front
+{
+  double dist,           /* Best weighted distance to the flip    */
+      remote;            /* Best distance another instance works on */
+  struct queue_entry *q; /* Queue entry it was measured with      */
+  u8 seen,               /* Sides taken so far, one bit each      */
+      tries;             /* Solves spent on it from q             */
+} br_front_t;
+
+/* On-disk branch registry (REGISTRY_NAME): a header, then one record per
+   branch id. The checksum covers br_static, so registries of other builds
+   are left alone. */
+
+typedef struct maxafl_reg_hdr
+{
+  u32 magic, version, br_cnt, cksum;
+} maxafl_reg_hdr_t;
+
+typedef struct maxafl_reg_rec
+{
+  double dist; /* As in br_front_t                          */
+  u32 q_id;    /* Queue entry id, ~0 if there is none       */
+  u8 seen,     /* As in br_front_t                          */
+      tries,   /* As in br_front_t                          */
+      pad[2];
+} maxafl_reg_rec_t;
+
+static br_front_t *br_front; /* Frontier state, by branch id          */
+static double *br_list_dist; /* Weighted distance of br_list entries  */
+static s32 target_br = -1;   /* Branch the objective is reduced to    */
+static u8 target_side;       /* Side of target_br to reach            */
 // MAXAFL
 
 static volatile u8 stop_soon, /* Ctrl-C pressed?                  */
@@ -292,7 +391,8 @@ struct queue_entry
       fs_redundant; /* Marked as redundant in the fs?   */
 
   u32 bitmap_size, /* Number of bits set in bitmap     */
-      exec_cksum;  /* Checksum of the execution trace  */
+      exec_cksum,  /* Checksum of the execution trace  */
+      id;          /* Position in the queue            */
 
   u64 exec_us,  /* Execution time (us)              */
       handicap, /* Number of queue cycles behind    */
@@ -301,6 +401,9 @@ struct queue_entry
   u8 *trace_mini; /* Trace bytes, if kept             */
   u32 tc_ref;     /* Trace bytes ref count            */
 
+  u8 *grad_map; /* Byte sensitivity, if measured    */
+  u32 grad_len; /* Entries in grad_map              */
+
   struct queue_entry *next, /* Next element, if any             */
       *next_100;            /* 100 elements ahead               */
 };
@@ -340,6 +443,32 @@ u8 lbfgs_mode_cur = LBFGS_MODE_CURRENT;
 u8 obj_mode_cur = OBJ_MODE_DEFAULT;
 u8 cost_mode_cur = COST_MODE_DEFAULT;
 u8 prob_mode_cur = OBJ_MODE_DEFAULT;
+u8 grad_mode_cur = GRAD_MODE_DEFAULT;
+u8 line_search_cur = LINE_SEARCH_DEFAULT;
+u8 solver_cur = SOLVER_DEFAULT;
+u8 sched_mode_cur = SCHED_MODE_DEFAULT;
+u32 lbfgs_budget = LBFGS_EXEC_BUDGET;
+
+static u32 solver_turn;                  /* Next solver for SOLVER_ROTATE    */
+static u64 solver_execs[SOLVER_CNT + 1], /* Execs spent per lbfgs solver     */
+    solver_finds[SOLVER_CNT + 1];        /* Paths found per lbfgs solver     */
+
+static u8 *solver_names[SOLVER_CNT + 1] = {"rotate", "gd", "lbfgsb", "cmaes", "nm"};
+
+/* Stage groups weighed against each other by the stage bandit */
+
+#define ARM_GRAD 0
+#define ARM_DET 1
+#define ARM_HAVOC 2
+#define ARM_CNT 3
+
+u8 stage_sched_cur = STAGE_SCHED_DEFAULT;
+
+static double bandit_finds[ARM_CNT], /* Finds per stage group, decayed    */
+    bandit_execs[ARM_CNT];           /* Execs per stage group, decayed    */
+
+static u32 *grad_cdf, /* Running sum of havoc weights per block */
+    grad_cdf_len;     /* Blocks in grad_cdf, 0 if unweighted    */
 
 /* Fuzzing stages */
 
@@ -887,7 +1016,7 @@ static void add_to_queue(u8 *fname, u32 len, u8 passed_det)
   else
     q_prev100 = queue = queue_top = q;
 
-  queued_paths++;
+  q->id = queued_paths++;
   pending_not_fuzzed++;
 
   cycles_wo_finds = 0;
@@ -915,6 +1044,7 @@ EXP_ST void destroy_queue(void)
     n = q->next;
     ck_free(q->fname);
     ck_free(q->trace_mini);
+    ck_free(q->grad_map);
     ck_free(q);
     q = n;
   }
@@ -1312,14 +1442,23 @@ static void remove_shm(void)
   // shmctl(shm_id_max, IPC_RMID, NULL);
   // shmctl(shm_id_ptr, IPC_RMID, NULL);
 
-  shmctl(shm_id_br_info, IPC_RMID, NULL);
-  shmctl(shm_id_br_ptr, IPC_RMID, NULL);
-  shmctl(shm_id_br_hit, IPC_RMID, NULL);
-  shmctl(shm_id_cmp_info, IPC_RMID, NULL);
-  shmctl(shm_id_cmp_ptr, IPC_RMID, NULL);
-  shmctl(shm_id_cmp_hit, IPC_RMID, NULL);
-  shmctl(shm_id_cmpvec, IPC_RMID, NULL);
+  shmctl(shm_id_state, IPC_RMID, NULL);
+  shmctl(shm_id_shared, IPC_RMID, NULL);
   shmctl(shm_id_exit_penalty, IPC_RMID, NULL);
+
+  if (shm_input_mode)
+    shmctl(shm_id_input, IPC_RMID, NULL);
+
+  if (pool)
+  {
+
+    u32 i, j;
+
+    for (i = 0; i < pool_size; i++)
+      for (j = 0; j < POOL_SHM_CNT; j++)
+        if (pool[i].shm_id[j] > 0)
+          shmctl(pool[i].shm_id[j], IPC_RMID, NULL);
+  }
 }
 
 /* Compact trace bytes into a smaller bitmap. We effectively just drop the
@@ -1464,7 +1603,7 @@ static void cull_queue(void)
 EXP_ST void setup_shm(void)
 {
 
-  u8 *shm_str, /**shm_str_max, *shm_str_ptr,*/ *shm_str_br_info, *shm_str_br_ptr, *shm_str_br_hit, *shm_str_cmp_info, *shm_str_cmp_ptr, *shm_str_cmp_hit, *shm_str_cmpvec, *shm_str_exit_penalty;
+  u8 *shm_str, /**shm_str_max, *shm_str_ptr,*/ *shm_str_exit_penalty;
 
   if (!in_bitmap)
     memset(virgin_bits, 255, MAP_SIZE);
@@ -1476,26 +1615,14 @@ EXP_ST void setup_shm(void)
   // shm_id_max = shmget(IPC_PRIVATE, INFO_SIZE, IPC_CREAT | IPC_EXCL | 0600);
   // shm_id_ptr = shmget(IPC_PRIVATE, PTR_SIZE, IPC_CREAT | IPC_EXCL | 0600);
 
-  shm_id_br_info = shmget(IPC_PRIVATE, MAXAFL_BR_INFO_SIZE, IPC_CREAT | IPC_EXCL | 0600);
-  shm_id_br_ptr = shmget(IPC_PRIVATE, PTR_SIZE, IPC_CREAT | IPC_EXCL | 0600);
-  shm_id_br_hit = shmget(IPC_PRIVATE, HIT_SIZE, IPC_CREAT | IPC_EXCL | 0600);
-  shm_id_cmp_info = shmget(IPC_PRIVATE, MAXAFL_CMP_INFO_SIZE, IPC_CREAT | IPC_EXCL | 0600);
-  shm_id_cmp_ptr = shmget(IPC_PRIVATE, PTR_SIZE, IPC_CREAT | IPC_EXCL | 0600);
-  shm_id_cmp_hit = shmget(IPC_PRIVATE, HIT_SIZE, IPC_CREAT | IPC_EXCL | 0600);
-  shm_id_cmpvec = shmget(IPC_PRIVATE, MAXAFL_CMPVEC_SIZE, IPC_CREAT | IPC_EXCL | 0600);
   shm_id_exit_penalty = shmget(IPC_PRIVATE, sizeof(u32), IPC_CREAT | IPC_EXCL | 0600);
 
-  // ACTF("shm_id_br_info : %d", shm_id_br_info);
-  // ACTF("shm_id_br_ptr : %d", shm_id_br_ptr);
-  // ACTF("shm_id_cmp_info : %d", shm_id_cmp_info);
-  // ACTF("shm_id_cmp_ptr : %d", shm_id_cmp_ptr);
-  // ACTF("shm_id_cmpvec : %d", shm_id_cmpvec);
   // ACTF("shm_id_exit_penalty : %d", shm_id_exit_penalty);
 
   // if (shm_id < 0 || shm_id_max < 0 || shm_id_ptr < 0)
   //   PFATAL("shmget() failed");
 
-  if (shm_id < 0 || shm_id_br_info < 0 || shm_id_br_ptr < 0 || shm_id_br_hit < 0 || shm_id_cmp_info < 0 || shm_id_cmp_ptr < 0 || shm_id_cmp_hit < 0 || shm_id_cmpvec < 0 || shm_id_exit_penalty < 0)
+  if (shm_id < 0 || shm_id_exit_penalty < 0)
     PFATAL("shmget() failed");
 
   atexit(remove_shm);
@@ -1504,13 +1631,6 @@ EXP_ST void setup_shm(void)
   // shm_str_max = alloc_printf("%d", shm_id_max);
   // shm_str_ptr = alloc_printf("%d", shm_id_ptr);
 
-  shm_str_br_info = alloc_printf("%d", shm_id_br_info);
-  shm_str_br_ptr = alloc_printf("%d", shm_id_br_ptr);
-  shm_str_br_hit = alloc_printf("%d", shm_id_br_hit);
-  shm_str_cmp_info = alloc_printf("%d", shm_id_cmp_info);
-  shm_str_cmp_ptr = alloc_printf("%d", shm_id_cmp_ptr);
-  shm_str_cmp_hit = alloc_printf("%d", shm_id_cmp_hit);
-  shm_str_cmpvec = alloc_printf("%d", shm_id_cmpvec);
   shm_str_exit_penalty = alloc_printf("%d", shm_id_exit_penalty);
 
   /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
@@ -1523,48 +1643,174 @@ EXP_ST void setup_shm(void)
     setenv(SHM_ENV_VAR, shm_str, 1);
     // setenv(SHM_ENV_VAR_MAX, shm_str_max, 1);
     // setenv(SHM_ENV_VAR_PTR, shm_str_ptr, 1);
-    setenv(SHM_ENV_VAR_BR_INFO, shm_str_br_info, 1);
-    setenv(SHM_ENV_VAR_BR_PTR, shm_str_br_ptr, 1);
-    setenv(SHM_ENV_VAR_BR_HIT, shm_str_br_hit, 1);
-    setenv(SHM_ENV_VAR_CMP_INFO, shm_str_cmp_info, 1);
-    setenv(SHM_ENV_VAR_CMP_PTR, shm_str_cmp_ptr, 1);
-    setenv(SHM_ENV_VAR_CMP_HIT, shm_str_cmp_hit, 1);
-    setenv(SHM_ENV_VAR_CMPVEC, shm_str_cmpvec, 1);
     setenv(SHM_ENV_VAR_EXIT_PENALTY, shm_str_exit_penalty, 1);
   }
 
   ck_free(shm_str);
   // ck_free(shm_str_max);
   // ck_free(shm_str_ptr);
-  ck_free(shm_str_br_info);
-  ck_free(shm_str_br_ptr);
-  ck_free(shm_str_br_hit);
-  ck_free(shm_str_cmp_info);
-  ck_free(shm_str_cmp_ptr);
-  ck_free(shm_str_cmp_hit);
-  ck_free(shm_str_cmpvec);
   ck_free(shm_str_exit_penalty);
 
   trace_bits = shmat(shm_id, NULL, 0);
   // mx_info = shmat(shm_id_max, NULL, 0);
   // mx_info_ptr = shmat(shm_id_ptr, NULL, 0);
-  br_info = shmat(shm_id_br_info, NULL, 0);
-  br_info_ptr = shmat(shm_id_br_ptr, NULL, 0);
-  br_hit = shmat(shm_id_br_hit, NULL, 0);
-  cmp_info = shmat(shm_id_cmp_info, NULL, 0);
-  cmp_info_ptr = shmat(shm_id_cmp_ptr, NULL, 0);
-  cmp_hit = shmat(shm_id_cmp_hit, NULL, 0);
-  cmpvec = shmat(shm_id_cmpvec, NULL, 0);
   exit_penalty = shmat(shm_id_exit_penalty, NULL, 0);
 
   // if (!trace_bits || !mx_info || !mx_info_ptr)
   //   PFATAL("shmat() failed");
 
-  if (!trace_bits || !br_info || !br_info_ptr || !br_hit || !cmp_info || !cmp_info_ptr || !cmp_hit || !cmpvec || !exit_penalty)
+  if (!trace_bits || !exit_penalty)
     PFATAL("shmat() failed");
 }
 
-/* Load info file to shared memory */
+/* Set up the test case channel for binaries built with
+   __AFL_FUZZ_TESTCASE_BUF. Test cases are then copied into the segment
+   instead of out_file or .cur_input. */
+
+static void setup_shm_input(void)
+{
+
+  u8 *shm_str;
+
+  shm_id_input = shmget(IPC_PRIVATE, sizeof(u32) + MAX_FILE, IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_id_input < 0)
+    PFATAL("shmget() failed");
+
+  shm_input = shmat(shm_id_input, NULL, 0);
+
+  if (shm_input == (void *)-1)
+    PFATAL("shmat() failed");
+
+  shm_str = alloc_printf("%d", shm_id_input);
+  setenv(SHM_ENV_VAR_INPUT, shm_str, 1);
+  ck_free(shm_str);
+}
+
+/* Load info file. Everything is collected here until setup_state_shm() can
+   size the state segment from the final counts. */
+
+static br_static_t *br_static_init; /* Staged br_static, freed after setup */
+static u32 *br_ptr_init,            /* Staged first branch per module     */
+    *cmp_ptr_init;                  /* Staged first cmp per module        */
+static s16 *cmpvec_init;            /* Staged cmp vector triples          */
+static u64 cmpvec_cap;              /* Triples cmpvec_init has room for   */
+static u8 *mod_seen;                /* Modules that already had a record  */
+static u32 mod_cnt;                 /* Highest module id + 1              */
+
+/* Modules may show up in any order (parallel builds append whenever they
+   finish), but each one exactly once. A second record means the info file
+   outlived a rebuild or was written without the pass's locking. */
+
+static void stage_module(u32 moduleId)
+{
+  if (moduleId >= mod_cnt)
+  {
+    br_ptr_init = ck_realloc(br_ptr_init, (moduleId + 1) * sizeof(u32));
+    cmp_ptr_init = ck_realloc(cmp_ptr_init, (moduleId + 1) * sizeof(u32));
+    mod_seen = ck_realloc(mod_seen, moduleId + 1);
+    mod_cnt = moduleId + 1;
+  }
+
+  if (mod_seen[moduleId])
+    FATAL("Module %u appears twice in '%s' (stale info file?)", moduleId, info_file);
+
+  mod_seen[moduleId] = 1;
+}
+
+static void stage_cmpvec(u64 need)
+{
+  if (need <= cmpvec_cap)
+    return;
+
+  cmpvec_cap = MAX(need, cmpvec_cap * 2);
+  cmpvec_init = ck_realloc(cmpvec_init, cmpvec_cap * 3 * sizeof(s16));
+}
+
+/* Load a binary info image (see maxafl-info.h). Records are validated one
+   by one before anything is copied out of the mapping. */
+
+static void load_info_image(s32 fd, u64 len)
+{
+  u8 *img, *pos, *end;
+  u32 i;
+
+  img = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (img == MAP_FAILED)
+    PFATAL("Unable to mmap '%s'", info_file);
+
+  pos = img;
+  end = img + len;
+
+  while (pos < end)
+  {
+
+    maxafl_info_rec_t *rec = (maxafl_info_rec_t *)pos;
+    maxafl_info_cmp_t *cmps;
+    maxafl_info_br_t *brs;
+    s16 *vec;
+    u64 vec_base = vec_cnt;
+
+    if (end - pos < sizeof(maxafl_info_rec_t) || rec->magic != MAXAFL_INFO_MAGIC)
+      FATAL("Corrupted info image '%s' at offset %lu", info_file, (unsigned long)(pos - img));
+
+    if (rec->version != MAXAFL_INFO_VERSION)
+      FATAL("Info image '%s' has version %u, expected %u (rebuild the target)",
+            info_file, rec->version, MAXAFL_INFO_VERSION);
+
+    pos += sizeof(maxafl_info_rec_t);
+
+    if (rec->payload_len > end - pos ||
+        rec->payload_len != MAXAFL_INFO_PAYLOAD((u64)rec->cmp_cnt, (u64)rec->br_cnt, (u64)rec->vec_cnt))
+      FATAL("Truncated info image '%s' (module %u)", info_file, rec->module_id);
+
+    if (hash32(pos, rec->payload_len, MAXAFL_INFO_MAGIC) != rec->checksum)
+      FATAL("Checksum mismatch in info image '%s' (module %u)", info_file, rec->module_id);
+
+    stage_module(rec->module_id);
+    stage_cmpvec(vec_cnt + rec->vec_cnt);
+
+    cmps = (maxafl_info_cmp_t *)pos;
+    brs = (maxafl_info_br_t *)(cmps + rec->cmp_cnt);
+    vec = (s16 *)(brs + rec->br_cnt);
+
+    cmp_ptr_init[rec->module_id] = cmp_cnt;
+    cmp_meta = ck_realloc(cmp_meta, (cmp_cnt + rec->cmp_cnt) * sizeof(cmp_meta_t));
+    for (i = 0; i < rec->cmp_cnt; i++)
+    {
+      cmp_meta[cmp_cnt].moduleId = rec->module_id;
+      cmp_meta[cmp_cnt].cmpId = cmps[i].id;
+      cmp_meta[cmp_cnt].cmpType = cmps[i].cmpType;
+      cmp_cnt++;
+    }
+
+    /* The triples are already in cmpvec layout. */
+
+    memcpy(cmpvec_init + vec_cnt * 3, vec, rec->vec_cnt * 3 * sizeof(s16));
+
+    br_ptr_init[rec->module_id] = br_cnt;
+    br_meta = ck_realloc(br_meta, (br_cnt + rec->br_cnt) * sizeof(br_meta_t));
+    br_static_init = ck_realloc(br_static_init, (br_cnt + rec->br_cnt) * sizeof(br_static_t));
+    for (i = 0; i < rec->br_cnt; i++)
+    {
+      br_meta[br_cnt].moduleId = rec->module_id;
+      br_meta[br_cnt].brId = brs[i].id;
+      br_static_init[br_cnt].left = brs[i].left;
+      br_static_init[br_cnt].right = brs[i].right;
+      br_static_init[br_cnt].cmpSize = brs[i].cmpSize;
+      br_static_init[br_cnt].cmpVec = vec_cnt * 3;
+      vec_cnt += brs[i].cmpSize;
+      br_cnt++;
+    }
+
+    if (vec_cnt != vec_base + rec->vec_cnt)
+      FATAL("Inconsistent cmp vector sizes in '%s' (module %u)", info_file, rec->module_id);
+
+    pos += rec->payload_len;
+  }
+
+  munmap(img, len);
+}
 
 static void setup_info(void)
 {
@@ -1573,66 +1819,81 @@ static void setup_info(void)
   if (!info_file)
     FATAL("you must set info_file name using -e option.\n");
 
-  // memset(mx_info, 0, INFO_SIZE);
+  u32 moduleId, cmpId, cmpType, cmpNo, brId, left, right, cmpSize, infoType, size, i, j;
+  u32 magic = 0;
+  struct stat st;
+  s32 fd = open(info_file, O_RDONLY);
 
-  FILE *info = fopen(info_file, "r");
+  if (fd < 0 || fstat(fd, &st))
+    PFATAL("Unable to open '%s'", info_file);
 
-  u32 moduleId, cmpId, cmpType, cmpNo, brId, left, right, cmpSize, infoType, size, i, j;
+  /* Binary images are told apart by their leading magic; anything else is
+     parsed as the text export. */
+
+  if (read(fd, &magic, sizeof(magic)) == sizeof(magic) && magic == MAXAFL_INFO_MAGIC)
+  {
+    load_info_image(fd, st.st_size);
+    close(fd);
+    goto info_loaded;
+  }
+
+  lseek(fd, 0, SEEK_SET);
+
+  FILE *info = fdopen(fd, "r");
+
+  if (!info)
+    PFATAL("fdopen() failed");
 
   while (fscanf(info, "%d\t%d\t%d\n", &moduleId, &infoType, &size) != EOF)
   {
 
     if (infoType == 0)
     {
-      cmp_info_ptr[moduleId] = cmp_cnt;
+      stage_module(moduleId);
+      cmp_ptr_init[moduleId] = cmp_cnt;
+      cmp_meta = ck_realloc(cmp_meta, (cmp_cnt + size) * sizeof(cmp_meta_t));
       for (i = 0; i < size; i++)
       {
         if (fscanf(info, "%d\t%d\t%d\n", &moduleId, &cmpId, &cmpType) == -1)
         {
           assert(0);
         }
-        cmp_info[cmp_cnt].moduleId = moduleId;
-        cmp_info[cmp_cnt].cmpId = cmpId;
-        cmp_info[cmp_cnt].cmpType = cmpType;
+        cmp_meta[cmp_cnt].moduleId = moduleId;
+        cmp_meta[cmp_cnt].cmpId = cmpId;
+        cmp_meta[cmp_cnt].cmpType = cmpType;
         cmp_cnt++;
       }
     }
     else
     {
-      br_info_ptr[moduleId] = br_cnt;
+      /* Branch records always follow their module's cmp records. */
+      if (moduleId >= mod_cnt || !mod_seen[moduleId])
+        FATAL("Branch info for module %d precedes its cmp info in '%s'", moduleId, info_file);
+      br_ptr_init[moduleId] = br_cnt;
+      br_meta = ck_realloc(br_meta, (br_cnt + size) * sizeof(br_meta_t));
+      br_static_init = ck_realloc(br_static_init, (br_cnt + size) * sizeof(br_static_t));
       for (i = 0; i < size; i++)
       {
         if (fscanf(info, "%d\t%d\t%d\t%d\t%d\t", &moduleId, &brId, &left, &right, &cmpSize) == -1)
         {
           assert(0);
         }
-        br_info[br_cnt].moduleId = moduleId;
-        br_info[br_cnt].brId = brId;
-        br_info[br_cnt].left = left;
-        br_info[br_cnt].right = right;
-        br_info[br_cnt].leftHit = 0;
-        br_info[br_cnt].rightHit = 0;
-        br_info[br_cnt].leftMul = 1;
-        br_info[br_cnt].rightMul = 1;
-        br_info[br_cnt].cmpSize = cmpSize;
-        br_info[br_cnt].cmpVec = (vec_cnt * 3);
-        // if (moduleId == 0 && brId < 10)
-        // {
-        //   OKF("cmpVec value : %p, %ld", br_info[br_cnt].cmpVec, sizeof(s16));
-        // }
+        br_meta[br_cnt].moduleId = moduleId;
+        br_meta[br_cnt].brId = brId;
+        br_static_init[br_cnt].left = left;
+        br_static_init[br_cnt].right = right;
+        br_static_init[br_cnt].cmpSize = cmpSize;
+        br_static_init[br_cnt].cmpVec = (vec_cnt * 3);
+        stage_cmpvec(vec_cnt + cmpSize);
         for (j = 0; j < cmpSize; j++)
         {
           if (fscanf(info, "%d\t%d\t%d\t", &cmpId, &cmpType, &cmpNo) == -1)
           {
             assert(0);
           }
-          // if (moduleId == 0 && brId < 10)
-          // {
-          //   OKF("cmpvec scanf res : %d\t%d", cmpId, cmpType);
-          // }
-          cmpvec[br_info[br_cnt].cmpVec + j * 3] = (s16)cmpId;
-          cmpvec[br_info[br_cnt].cmpVec + j * 3 + 1] = (s16)cmpType;
-          cmpvec[br_info[br_cnt].cmpVec + j * 3 + 2] = (s16)cmpNo;
+          cmpvec_init[br_static_init[br_cnt].cmpVec + j * 3] = (s16)cmpId;
+          cmpvec_init[br_static_init[br_cnt].cmpVec + j * 3 + 1] = (s16)cmpType;
+          cmpvec_init[br_static_init[br_cnt].cmpVec + j * 3 + 2] = (s16)cmpNo;
         }
         br_cnt++;
         vec_cnt += cmpSize;
@@ -1642,19 +1903,179 @@ static void setup_info(void)
 
   fclose(info);
 
+info_loaded:
+
+  br_list = ck_alloc((br_cnt + 1) * sizeof(u32));
+  br_list_state = ck_alloc(br_cnt + 1);
+  br_list_dist = ck_alloc((br_cnt + 1) * sizeof(double));
+  br_front = ck_alloc((br_cnt + 1) * sizeof(br_front_t));
+
+  for (i = 0; i <= br_cnt; i++)
+    br_front[i].remote = HUGE_VAL;
+  br_saved_list = ck_alloc((br_cnt + 1) * sizeof(u32));
+  br_saved = ck_alloc(br_cnt + 1);
+
+  OKF("setting info file is finished...");
+
+  return;
+}
+
+/* Point the state array globals into a per-exec state segment. The shared
+   arrays are the same for every segment of the run. */
+
+static void map_state_arrays(maxafl_shm_hdr_t *hdr)
+{
+  maxafl_state = hdr;
+  br_real = MAXAFL_SHM_ARR(hdr, br_real_off);
+  cmp_real = MAXAFL_SHM_ARR(hdr, cmp_real_off);
+  br_hit = MAXAFL_SHM_ARR(hdr, br_hit_off);
+  cmp_hit = MAXAFL_SHM_ARR(hdr, cmp_hit_off);
+  br_static = MAXAFL_SHM_SHARED(hdr, maxafl_shared, br_static_off);
+  br_adapt = MAXAFL_SHM_SHARED(hdr, maxafl_shared, br_adapt_off);
+  br_info_ptr = MAXAFL_SHM_SHARED(hdr, maxafl_shared, br_ptr_off);
+  cmp_info_ptr = MAXAFL_SHM_SHARED(hdr, maxafl_shared, cmp_ptr_off);
+  cmpvec = MAXAFL_SHM_SHARED(hdr, maxafl_shared, cmpvec_off);
+  br_done = MAXAFL_SHM_SHARED(hdr, maxafl_shared, br_done_off);
+  cmp_done = MAXAFL_SHM_SHARED(hdr, maxafl_shared, cmp_done_off);
+  cmp_users = MAXAFL_SHM_SHARED(hdr, maxafl_shared, cmp_users_off);
+}
+
+/* Reset the per-exec arrays of a state segment to "nothing hit". */
+
+static void clear_state_arrays(void)
+{
+  u32 i;
+
+  br_hit[0] = 1;
+  cmp_hit[0] = 1;
+
+  for (i = 0; i < br_cnt; i++)
+    br_real[i] = BR_NOHIT;
+  for (i = 0; i < cmp_cnt; i++)
+    cmp_real[i] = BR_NOHIT;
+}
+
+/* Create the MaxAFL state segment and the shared segment behind it, sized
+   to what setup_info() loaded, and fill them in. The hot per-exec fields
+   get arrays of their own so that the runtime touches as few cache lines
+   per visited site as possible. */
+
+static void setup_state_shm(void)
+{
+  maxafl_shm_hdr_t hdr;
+  u8 *shm_str;
+  u32 i;
+
+  memset(&hdr, 0, sizeof(hdr));
+
+  hdr.magic = MAXAFL_SHM_MAGIC;
+  hdr.version = MAXAFL_SHM_VERSION;
+  hdr.br_cnt = br_cnt;
+  hdr.cmp_cnt = cmp_cnt;
+  hdr.mod_cnt = mod_cnt;
+  hdr.vec_cnt = vec_cnt;
+  hdr.obj_mode = obj_mode_cur;
+
+  /* Keep every array 64-byte aligned. */
+
+  hdr.br_real_off = MAXAFL_ALIGN64(sizeof(hdr));
+  hdr.cmp_real_off = hdr.br_real_off + MAXAFL_ALIGN64(br_cnt * sizeof(double));
+  hdr.br_hit_off = hdr.cmp_real_off + MAXAFL_ALIGN64(cmp_cnt * sizeof(double));
+  hdr.cmp_hit_off = hdr.br_hit_off + MAXAFL_ALIGN64((br_cnt + 1) * sizeof(u32));
+  hdr.size = hdr.cmp_hit_off + MAXAFL_ALIGN64((cmp_cnt + 1) * sizeof(u32));
+
+  hdr.br_static_off = 0;
+  hdr.br_adapt_off = hdr.br_static_off + MAXAFL_ALIGN64(br_cnt * sizeof(br_static_t));
+  hdr.br_ptr_off = hdr.br_adapt_off + MAXAFL_ALIGN64(br_cnt * sizeof(br_adapt_t));
+  hdr.cmp_ptr_off = hdr.br_ptr_off + MAXAFL_ALIGN64(mod_cnt * sizeof(u32));
+  hdr.cmpvec_off = hdr.cmp_ptr_off + MAXAFL_ALIGN64(mod_cnt * sizeof(u32));
+  hdr.br_done_off = hdr.cmpvec_off + MAXAFL_ALIGN64(vec_cnt * 3 * sizeof(s16));
+  hdr.cmp_done_off = hdr.br_done_off + MAXAFL_ALIGN64((br_cnt + 7) / 8);
+  hdr.cmp_users_off = hdr.cmp_done_off + MAXAFL_ALIGN64((cmp_cnt + 7) / 8);
+  hdr.shared_size = hdr.cmp_users_off + MAXAFL_ALIGN64(cmp_cnt * sizeof(u32));
+
+  /* shmget() refuses zero-sized segments. */
+
+  shm_id_shared = shmget(IPC_PRIVATE, MAX(hdr.shared_size, 64),
+                         IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_id_shared < 0)
+    PFATAL("shmget() failed");
+
+  maxafl_shared = shmat(shm_id_shared, NULL, 0);
+
+  if (maxafl_shared == (void *)-1)
+    PFATAL("shmat() failed");
+
+  hdr.shared_id = shm_id_shared;
+
+  shm_id_state = shmget(IPC_PRIVATE, hdr.size, IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_id_state < 0)
+    PFATAL("shmget() failed");
+
+  maxafl_state = shmat(shm_id_state, NULL, 0);
+
+  if (maxafl_state == (void *)-1)
+    PFATAL("shmat() failed");
+
+  memcpy(maxafl_state, &hdr, sizeof(hdr));
+  map_state_arrays(maxafl_state);
+
+  if (br_cnt)
+    memcpy(br_static, br_static_init, br_cnt * sizeof(br_static_t));
+  if (mod_cnt)
+  {
+    memcpy(br_info_ptr, br_ptr_init, mod_cnt * sizeof(u32));
+    memcpy(cmp_info_ptr, cmp_ptr_init, mod_cnt * sizeof(u32));
+  }
+  if (vec_cnt)
+    memcpy(cmpvec, cmpvec_init, vec_cnt * 3 * sizeof(s16));
+
+  ck_free(br_static_init);
+  ck_free(br_ptr_init);
+  ck_free(cmp_ptr_init);
+  ck_free(mod_seen);
+  ck_free(cmpvec_init);
+  br_static_init = NULL;
+  br_ptr_init = cmp_ptr_init = NULL;
+  cmpvec_init = NULL;
+  mod_seen = NULL;
+
+  clear_state_arrays();
+
   for (i = 0; i < br_cnt; i++)
   {
-    br_info[i].real = BR_NOHIT;
-    br_info[i].hit = BR_NOHIT;
+    br_adapt[i].leftHit = 0;
+    br_adapt[i].rightHit = 0;
+    br_adapt[i].leftMul = 1;
+    br_adapt[i].rightMul = 1;
   }
-  for (i = 0; i < cmp_cnt; i++)
+
+  /* Nothing is retired yet (shmget() hands out zeroed memory); count the
+     branches whose condition reads each cmp. */
+
+  for (i = 0; i < br_cnt; i++)
   {
-    cmp_info[i].real = BR_NOHIT;
+    u32 j, base = cmp_info_ptr[br_meta[i].moduleId];
+
+    for (j = 0; j < br_static[i].cmpSize; j++)
+    {
+      s16 id = cmpvec[br_static[i].cmpVec + j * 3];
+
+      if (id >= 0 && base + id < cmp_cnt)
+        cmp_users[base + id]++;
+    }
   }
 
-  OKF("setting info file is finished...");
+  if (!dumb_mode)
+  {
+    shm_str = alloc_printf("%d", shm_id_state);
+    setenv(SHM_ENV_VAR_STATE, shm_str, 1);
+    ck_free(shm_str);
+  }
 
-  return;
+  OKF("State segment: %llu branches, %llu cmps, %u modules, %s + %s shared.", br_cnt, cmp_cnt, mod_cnt, DMS(hdr.size), DMS(hdr.shared_size));
 }
 
 static void test_info(void)
@@ -1662,22 +2083,18 @@ static void test_info(void)
   int i, j;
 
   ACTF("...TEST LODING INFO FILES...");
-  for (i = 0; i < 10; i++)
+  for (i = 0; i < 10 && i < br_cnt; i++)
   {
-    OKF("[BR_INFO] %u : left :\t%u, right :\t%u", br_info[i].brId, br_info[i].left, br_info[i].right);
-    for (j = 0; j < br_info[i].cmpSize; j++)
+    OKF("[BR_INFO] %u : left :\t%u, right :\t%u", br_meta[i].brId, br_static[i].left, br_static[i].right);
+    for (j = 0; j < br_static[i].cmpSize; j++)
     {
-      OKF("\t[CMP_VEC] %u : %d, %d, %d, %d", j, br_info[i].cmpVec, cmpvec[br_info[i].cmpVec + j * 3], cmpvec[br_info[i].cmpVec + j * 3 + 1], cmpvec[br_info[i].cmpVec + j * 3 + 2]);
+      OKF("\t[CMP_VEC] %u : %d, %d, %d, %d", j, br_static[i].cmpVec, cmpvec[br_static[i].cmpVec + j * 3], cmpvec[br_static[i].cmpVec + j * 3 + 1], cmpvec[br_static[i].cmpVec + j * 3 + 2]);
     }
   }
-  for (i = 0; i < 10; i++)
+  for (i = 0; i < 10 && i < cmp_cnt; i++)
   {
-    OKF("[CMP_INFO] %u : cmpType :\t%u", cmp_info[i].cmpId, cmp_info[i].cmpType);
+    OKF("[CMP_INFO] %u : cmpType :\t%u", cmp_meta[i].cmpId, cmp_meta[i].cmpType);
   }
-  // for (i = 0; i < 10; i++)
-  // {
-  //   OKF("[CMPVEC] %u : CmpId : %d, CmpType : %d", i, cmpvec[i * 2], cmpvec[i * 2 + 1]);
-  // }
   ACTF("...TEST FINISHED...\n");
 
   return;
@@ -2481,6 +2898,14 @@ EXP_ST void init_forkserver(char **argv)
 
   if (rlen == 4)
   {
+
+    /* The runtime acknowledges the state segment layout before the
+       handshake; a stale runtime would leave ack alone. */
+
+    if (maxafl_state && maxafl_state->ack != MAXAFL_SHM_VERSION)
+      FATAL("Target runtime does not support MaxAFL state layout v%u (rebuild it with this afl-clang-fast)",
+            MAXAFL_SHM_VERSION);
+
     OKF("All right - fork server is up.");
     return;
   }
@@ -2619,72 +3044,48 @@ EXP_ST void init_forkserver(char **argv)
   FATAL("Fork server handshake failed");
 }
 
-u8 check_branch_hit()
+/* MEIC distance of a branch as used by check_branch_hit(), with the adaptive
+   multipliers clamped. */
+
+static int branch_check_diff(u32 id)
 {
-  int i, sum = 0, diff, left = 0, right = 0;
+  int left = 0, right = 0, diff;
   u16 leftMul, rightMul;
-  u8 is_changed;
-  br_info_t *br_cur;
-
-  for (i = 1; i < br_hit[0]; i++)
-  {
-    br_cur = &br_info[br_hit[i]];
-    if (br_cur->real == BR_NOHIT)
-    {
-      // fprintf(stderr, "[WARN] Cannot be BR_NOHIT!!! %d, %d\n", i, br_hit[i]);
-      continue;
-    }
-    switch (obj_mode_cur)
-    {
-    case OBJ_MODE_ORIGIN:
-      left = br_cur->left;
-      right = br_cur->right;
-      break;
-    case OBJ_MODE_ADP1:
-      leftMul = br_cur->leftMul > MAX_MUL ? MAX_MUL : br_cur->leftMul, rightMul = br_cur->rightMul > MAX_MUL ? MAX_MUL : br_cur->rightMul;
-      left = br_cur->left * (1 + rightMul * 0.1);
-      right = br_cur->right * (1 + leftMul * 0.1);
-      break;
-    case OBJ_MODE_ADP2:
-      leftMul = br_cur->leftMul > br_cur->left ? br_cur->left : br_cur->leftMul, rightMul = br_cur->rightMul > br_cur->right ? br_cur->right : br_cur->rightMul;
-      left = br_cur->left - (leftMul - rightMul);
-      right = br_cur->right - (rightMul - leftMul);
-      break;
-    }
+  br_static_t *st = &br_static[id];
+  br_adapt_t *ad = &br_adapt[id];
 
-    if (br_info[br_hit[i]].real >= 0 && br_info[br_hit[i]].hit == BR_SUCC)
-    {
-      diff = left - right;
-      sum += diff > 0 ? -diff : diff;
-#ifdef MAXAFL_DEBUG
-      fprintf(stderr, "[DBG]\tBR_WRONG at %d!\treal : %lf, hit : %d, meic_diff : %d\n", i, br_info[i].real, br_info[i].hit, diff);
-#endif
-    }
-    if (br_info[br_hit[i]].real == BR_SUCC && br_info[br_hit[i]].hit == BR_FAIL)
-    {
-      diff = left - right;
-      sum += diff > 0 ? diff : -diff;
-#ifdef MAXAFL_DEBUG
-      fprintf(stderr, "[DBG]\tBR_CHANGED at %d!\treal : %lf, hit : %d, meic_diff : %d\n", i, br_info[i].real, br_info[i].hit, diff);
-#endif
-    }
-  }
-  if (sum > 0)
-  {
-    is_changed = BR_CHANGED;
-  }
-  else if (sum < 0)
-  {
-    is_changed = BR_WRONG;
-  }
-  else
+  switch (obj_mode_cur)
   {
-    is_changed = BR_UNCHANGED;
+  case OBJ_MODE_ORIGIN:
+    left = st->left;
+    right = st->right;
+    break;
+  case OBJ_MODE_ADP1:
+    leftMul = ad->leftMul > MAX_MUL ? MAX_MUL : ad->leftMul, rightMul = ad->rightMul > MAX_MUL ? MAX_MUL : ad->rightMul;
+    left = st->left * (1 + rightMul * 0.1);
+    right = st->right * (1 + leftMul * 0.1);
+    break;
+  case OBJ_MODE_ADP2:
+    leftMul = ad->leftMul > st->left ? st->left : ad->leftMul, rightMul = ad->rightMul > st->right ? st->right : ad->rightMul;
+    left = st->left - (leftMul - rightMul);
+    right = st->right - (rightMul - leftMul);
+    break;
   }
+
+  diff = left - right;
+  return diff > 0 ? diff : -diff;
+}
+
+/* Result of comparing the last evaluated exec against the snapshot taken by
+   save_branch_hit(). calculate_obj_func() computes it in the same pass as
+   the objective; this only hands it out. */
+
+u8 check_branch_hit()
+{
 #ifdef MAXAFL_DEBUG
-  fprintf(stderr, "[DBG]\tFinal is_changed is %d with sum : %d!\n\n", is_changed, sum);
+  fprintf(stderr, "[DBG]\tFinal is_changed is %d!\n\n", br_status);
 #endif
-  return is_changed;
+  return br_status;
 }
 
 float sigmoid(double x, double a, double b, double k)
@@ -2701,21 +3102,17 @@ float sigmoid(double x, double a, double b, double k)
   return return_value;
 }
 
-static double calculate_cost(br_info_t *br_info, double diff)
+static double calculate_cost(double real, double diff)
 {
   double res = 0;
-  // * br_info->real(-1 : wrong, -2 : hit and branch is passed, -3 : no hit, -4 : uncontrollable, >0 : hit and branch isn't passed)
-  if (br_info->real < 0)
+  // * real(-1 : wrong, -2 : hit and branch is passed, -3 : no hit, -4 : uncontrollable, >0 : hit and branch isn't passed)
+  if (real < 0)
   {
     return 0;
   }
-  // double left = br_info->left * (1 + br_info->rightMul * 0.1), right = br_info->right * (1 + br_info->leftMul * 0.1);
-  // double diff = left > right ? left - right : right - left;
-
-  // fprintf(stderr, "%d\t%d\t%d\t%lf\t%lf\n", cmp_info->moduleId, cmp_info->left, cmp_info->right, diff, sqrt(cmp_info->real));
 
   // * 0인데 통과 못한경우는 그냥 1로 계산해서 diff만 더 해줌.
-  if (br_info->real == 0)
+  if (real == 0)
   {
     res = diff;
   }
@@ -2724,163 +3121,434 @@ static double calculate_cost(br_info_t *br_info, double diff)
     switch (cost_mode_cur)
     {
     case COST_MODE_SIGMOID:
-      res = diff * sigmoid(br_info->real, 6, -0.05, 256);
+      res = diff * sigmoid(real, 6, -0.05, 256);
       break;
     case COST_MODE_LOG:
-      res = diff * log(br_info->real + 1);
+      res = diff * log(real + 1);
       break;
     case COST_MODE_ROOT:
-      res = diff * sqrt(br_info->real);
+      res = diff * sqrt(real);
       break;
     case COST_MODE_ORIGIN:
-      res = diff * br_info->real;
+      res = diff * real;
       break;
     default:
-      res = diff * sigmoid(br_info->real, 6, -0.05, 256);
+      res = diff * sigmoid(real, 6, -0.05, 256);
       break;
     }
   }
-  // #ifdef _MAXAFL_DEBUG
-  //   fprintf(stderr, "[DBG]\tBranch Cost (%d, %d) = %d(real = %lf, left = %d, rightMul = %d,  right = %d, leftMul = %d, cost = %f)\n", br_info->moduleId, br_info->brId, br_info->hit, br_info->real, br_info->left, br_info->rightMul, br_info->right, br_info->leftMul, res);
-  // #endif
 
   return res;
 }
 
-double calculate_obj_func()
+/* Retire a branch whose adaptive weights have saturated: it can no longer
+   add to the objective, so its probe is switched off. A cmp is switched
+   off with the last open branch that reads it. */
+
+static void retire_branch(u32 id)
 {
-  u32 i;
-  double cost, diff, left = 0, right = 0;
-  br_info_t *br_cur;
+  br_static_t *st = &br_static[id];
+  u32 i, base = cmp_info_ptr[br_meta[id].moduleId];
+
+  if (MAXAFL_BIT_IS_SET(br_done, id))
+    return;
+
+  MAXAFL_BIT_SET(br_done, id);
+
+  for (i = 0; i < st->cmpSize; i++)
+  {
+    s16 cmp = cmpvec[st->cmpVec + i * 3];
+
+    if (cmp < 0 || base + cmp >= cmp_cnt || !cmp_users[base + cmp])
+      continue;
+
+    if (!--cmp_users[base + cmp])
+      MAXAFL_BIT_SET(cmp_done, base + cmp);
+  }
+}
+
+/* Single pass over the branches hit by the last exec. Computes the
+   objective, records the state of every branch into br_list/br_list_state,
+   compares it with the saved snapshot for check_branch_hit(), retires
+   finished branches and resets the SHM entries for the next exec. br_hit[0] is left at 0 to mark the
+   list as consumed, so repeated calls return the cached result until
+   reset_branch_state() runs. With target_br set, the objective is the
+   distance of that branch to target_side, and the status tells whether it
+   got there. */
 
+double calculate_obj_func()
+{
+  u32 i, n, id;
+  s32 sum = 0;
+  s8 state;
+  u8 side, target_hit = 0;
+  double real, diff, target_cost = FRONTIER_MISS_COST, left = 0, right = 0;
+  br_static_t *st;
+  br_adapt_t *ad;
+
+  if (!br_hit[0])
+    return obj_func;
+
+  n = br_hit[0];
   obj_func = 0;
+  br_list_cnt = 0;
 
-  for (i = 1; i < br_hit[0]; i++)
+  for (i = 1; i < n; i++)
   {
-    br_cur = &br_info[br_hit[i]];
-    if (br_cur->real == BR_NOHIT)
-    {
-      // fprintf(stderr, "[WARN] Cannot be BR_NOHIT!!! %d, %d\n", i, br_hit[i]);
+    id = br_hit[i];
+    real = br_real[id];
+    br_real[id] = BR_NOHIT;
+
+    if (real == BR_NOHIT)
       continue;
+
+    state = BR_STATE_FAIL;
+    st = &br_static[id];
+    ad = &br_adapt[id];
+
+    side = !!signbit(real);
+    br_front[id].seen |= 1 << side;
+    br_list_dist[br_list_cnt] = fabs(real) / (1 + (side ? st->right : st->left));
+
+    if ((s32)id == target_br)
+    {
+      target_hit = side == target_side;
+      target_cost = target_hit ? 0 : calculate_cost(fabs(real), 1);
     }
+
     switch (obj_mode_cur)
     {
     case OBJ_MODE_ORIGIN:
-      left = br_cur->left;
-      right = br_cur->right;
+      left = st->left;
+      right = st->right;
       break;
     case OBJ_MODE_ADP1:
-      if (br_cur->rightMul == MAX_MUL && br_cur->leftMul == MAX_MUL)
-      {
-        br_cur->real = BR_FINISH;
-        continue;
-      }
-      left = br_cur->left * (1 + br_cur->rightMul * 0.1);
-      right = br_cur->right * (1 + br_cur->leftMul * 0.1);
+      if (ad->rightMul == MAX_MUL && ad->leftMul == MAX_MUL)
+        state = BR_STATE_FINISH;
+      left = st->left * (1 + ad->rightMul * 0.1);
+      right = st->right * (1 + ad->leftMul * 0.1);
       break;
     case OBJ_MODE_ADP2:
-      if (br_cur->rightMul == br_cur->right && br_cur->leftMul == br_cur->left)
-      {
-        br_cur->real = BR_FINISH;
-        continue;
-      }
-      left = br_cur->left - (br_cur->leftMul - br_cur->rightMul);
-      right = br_cur->right - (br_cur->rightMul - br_cur->leftMul);
+      if (ad->rightMul == st->right && ad->leftMul == st->left)
+        state = BR_STATE_FINISH;
+      left = st->left - (ad->leftMul - ad->rightMul);
+      right = st->right - (ad->rightMul - ad->leftMul);
       break;
     }
 
-    if (left < right)
-    {
-      br_cur->real = -br_cur->real;
-      diff = right - left;
-    }
+    /* Both sides taken, here or by another instance (see load_registry()):
+       nothing is left to solve, whatever the schedule mode. */
+
+    if (br_front[id].seen == 3)
+      state = BR_STATE_FINISH;
+
+    if (state == BR_STATE_FINISH)
+      retire_branch(id);
     else
     {
-      diff = left - right;
-    }
+      if (left < right)
+      {
+        real = -real;
+        diff = right - left;
+      }
+      else
+      {
+        diff = left - right;
+      }
 
-    if (signbit(br_cur->real))
-    {
-      br_cur->real = BR_SUCC;
-      continue;
+      if (signbit(real))
+        state = BR_STATE_SUCC;
+      else
+        obj_func += calculate_cost(real, diff);
     }
-    // else if (br_info[i].real >= 0 && br_info[i].hit == BR_SUCC)
-    // {
-    //   return BR_WRONG;
-    // }
-    // fprintf(stderr, "%d\t%d\t", mx_info[i].moduleId, cmp_cnt);
-    cost = calculate_cost(&br_info[br_hit[i]], diff);
 
-#ifdef MAXAFL_DEBUG
-    // fprintf(stderr, "calculate cost : %d\t %d\t %lf\t %lf\t %lf\n", i, mx_info[i].cmpType, mx_info[i].real, mx_info[i].range, cost);
+    br_list[br_list_cnt] = id;
+    br_list_state[br_list_cnt++] = state;
+
+    if (state == BR_STATE_FAIL && br_saved[id] == BR_STATE_SUCC)
+    {
+      sum -= branch_check_diff(id);
+#ifdef MAXAFL_DEBUG
+      fprintf(stderr, "[DBG]\tBR_WRONG at %u!\treal : %lf\n", id, real);
 #endif
-    obj_func += cost;
-  }
+    }
+    else if (state == BR_STATE_SUCC && br_saved[id] == BR_STATE_FAIL)
+    {
+      sum += branch_check_diff(id);
 #ifdef MAXAFL_DEBUG
-  // fprintf(stderr, "total cost : %lf\n", obj_func);
+      fprintf(stderr, "[DBG]\tBR_CHANGED at %u!\treal : %lf\n", id, real);
 #endif
-  // fprintf(stderr, "total cost : %lf\n", obj_func);
+    }
+  }
 
-  // fprintf(stderr, "[DBG]\tExitPenalty : %d\n", *exit_penalty);
+  br_hit[0] = 0;
 
-  obj_func += *exit_penalty;
+  if (target_br >= 0)
+    br_status = target_hit ? BR_CHANGED : BR_UNCHANGED;
+  else if (sum > 0)
+    br_status = BR_CHANGED;
+  else if (sum < 0)
+    br_status = BR_WRONG;
+  else
+    br_status = BR_UNCHANGED;
 
-  // if (obj_func == 0)
-  // {
-  //   fprintf(stderr, "branch real : ");
-  //   for (i = 0; i < br_cnt; i++)
-  //   {
-  //     fprintf(stderr, "(%d)%lf\t", i, br_info[i].real);
-  //   }
-  //   fprintf(stderr, "\n");
-  // }
+  /* Calls left without their exit update (exit(), a crash) add their
+     penalty; a negative total can only come from unbalanced updates. */
 
-  if (cost_mode_cur != 5)
-    obj_func = obj_func / br_hit[0];
+  if (target_br >= 0)
+    obj_func = target_cost;
 
-  // fprintf(stderr, "br_hit[0] = %u\t", br_hit[0]);
-  // fprintf(stderr, "%lf\n", obj_func);
+  if ((s32)*exit_penalty > 0)
+    obj_func += *exit_penalty;
+
+  if (target_br < 0 && cost_mode_cur != 5)
+    obj_func = obj_func / n;
 
   return obj_func;
 }
 
+/* Take the branch states of the last exec as the snapshot that later execs
+   are compared against. Returns 0 if the snapshot did not change, so that
+   statuses measured against it are still valid. */
+
 u8 save_branch_hit()
 {
-  int i;
+  u32 i;
+  u8 changed;
+
   calculate_obj_func();
 
-  for (i = 1; i < br_hit[0]; i++)
-  {
-    // if (br_info[i].real == BR_NOHIT)
-    // {
-    //   br_info[i].hit = BR_NOHIT;
-    // }
-    if (br_info[br_hit[i]].real == BR_SUCC)
-    {
-      br_info[br_hit[i]].hit = BR_SUCC;
-#ifdef MAXAFL_DEBUG
-      fprintf(stderr, "[DBG]\tSave Branch #%d = %d\n", i, br_info[i].hit);
+  changed = br_list_cnt != br_saved_cnt ||
+            memcmp(br_saved_list, br_list, br_list_cnt * sizeof(u32));
+
+  for (i = 0; !changed && i < br_list_cnt; i++)
+    if (br_saved[br_list[i]] != br_list_state[i])
+      changed = 1;
+
+  if (!changed)
+    return 0;
+
+  for (i = 0; i < br_saved_cnt; i++)
+    br_saved[br_saved_list[i]] = BR_STATE_NONE;
+
+  for (i = 0; i < br_list_cnt; i++)
+    br_saved[br_list[i]] = br_list_state[i];
+
+  memcpy(br_saved_list, br_list, br_list_cnt * sizeof(u32));
+  br_saved_cnt = br_list_cnt;
+
+#ifdef _MAXAFL_DEBUG
+  fprintf(stderr, "[DBG]\tSaved %u branches\n\n", br_saved_cnt);
 #endif
-    }
-    else if (br_info[br_hit[i]].real == BR_FINISH)
+  return 1;
+}
+
+/* Fold the branches of the last exec, run with queue entry q, into the
+   frontier: q becomes the seed of every one-way branch it got closer to
+   flipping than any entry before it. */
+
+static void update_frontier(struct queue_entry *q)
+{
+  u32 i, id;
+  br_front_t *fr;
+
+  calculate_obj_func();
+
+  for (i = 0; i < br_list_cnt; i++)
+  {
+    id = br_list[i];
+    fr = &br_front[id];
+
+    if (fr->seen == 3 || (fr->q && br_list_dist[i] >= fr->dist))
+      continue;
+
+    fr->dist = br_list_dist[i];
+    fr->q = q;
+    fr->tries = 0;
+  }
+}
+
+/* Pick the frontier branches seeded by q that are closest to flipping,
+   at most FRONTIER_PICK of them, nearest first. Returns their count. */
+
+static u32 pick_frontier(struct queue_entry *q, u32 *picked)
+{
+  u32 i, j, cnt = 0;
+  br_front_t *fr;
+
+  for (i = 0; i < br_cnt; i++)
+  {
+    fr = &br_front[i];
+
+    if (fr->q != q || fr->tries >= FRONTIER_MAX_TRIES || fr->seen == 3 ||
+        fr->remote < fr->dist || MAXAFL_BIT_IS_SET(br_done, i))
+      continue;
+
+    for (j = cnt; j && br_front[picked[j - 1]].dist > fr->dist; j--)
+      if (j < FRONTIER_PICK)
+        picked[j] = picked[j - 1];
+
+    if (j < FRONTIER_PICK)
     {
-      br_info[br_hit[i]].hit = BR_FINISH;
+      picked[j] = i;
+      if (cnt < FRONTIER_PICK)
+        cnt++;
     }
-    else
+  }
+
+  return cnt;
+}
+
+static u32 registry_cksum(void)
+{
+  return hash32(br_static, br_cnt * sizeof(br_static_t), REGISTRY_MAGIC);
+}
+
+/* Write the branch registry: the sides every branch has taken so far and,
+   for the one-way ones, the queue entry that came closest to flipping
+   them. Written under a temporary name, so readers never see half a file. */
+
+static void write_registry(void)
+{
+  maxafl_reg_hdr_t hdr;
+  maxafl_reg_rec_t *rec;
+  br_front_t *fr;
+  u8 *fname, *tmp;
+  s32 fd;
+  u32 i;
+
+  hdr.magic = REGISTRY_MAGIC;
+  hdr.version = REGISTRY_VERSION;
+  hdr.br_cnt = br_cnt;
+  hdr.cksum = registry_cksum();
+
+  rec = ck_alloc(br_cnt * sizeof(maxafl_reg_rec_t));
+
+  for (i = 0; i < br_cnt; i++)
+  {
+    fr = &br_front[i];
+    rec[i].dist = fr->dist;
+    rec[i].q_id = fr->q ? fr->q->id : ~0U;
+    rec[i].seen = fr->seen;
+    rec[i].tries = fr->tries;
+  }
+
+  fname = alloc_printf("%s/" REGISTRY_NAME, out_dir);
+  tmp = alloc_printf("%s/." REGISTRY_NAME ".tmp", out_dir);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0)
+    PFATAL("Unable to create '%s'", tmp);
+
+  ck_write(fd, &hdr, sizeof(hdr), tmp);
+  ck_write(fd, rec, br_cnt * sizeof(maxafl_reg_rec_t), tmp);
+  close(fd);
+
+  if (rename(tmp, fname))
+    PFATAL("Unable to rename '%s'", tmp);
+
+  ck_free(rec);
+  ck_free(tmp);
+  ck_free(fname);
+}
+
+/* Merge a branch registry into the frontier. Sides taken anywhere take a
+   branch off it, and a branch taken both ways is retired, so the runtime
+   stops probing it in every schedule mode. Registries of other instances (own = 0) also tell how
+   close their seeds are; a branch is left to them while they have a closer
+   seed and have not given up on it. Our own registry (own = 1, read on
+   in-place resume after the queue is back) restores the seed, distance and
+   tries of every one-way branch; queue ids only match while the queue is
+   read back in order, so AFL_SHUFFLE_QUEUE skips that. Missing, partial or
+   foreign files are skipped. */
+
+static void load_registry(u8 *fname, u8 own)
+{
+  maxafl_reg_hdr_t hdr;
+  maxafl_reg_rec_t *rec;
+  br_front_t *fr;
+  struct queue_entry **by_id = NULL, *q;
+  s32 fd, len = br_cnt * sizeof(maxafl_reg_rec_t);
+  u32 i;
+
+  fd = open(fname, O_RDONLY);
+
+  if (fd < 0)
+    return;
+
+  if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != REGISTRY_MAGIC ||
+      hdr.version != REGISTRY_VERSION || hdr.br_cnt != br_cnt ||
+      hdr.cksum != registry_cksum())
+  {
+    close(fd);
+    return;
+  }
+
+  rec = ck_alloc(len);
+
+  if (own && !shuffle_queue && queued_paths)
+  {
+    by_id = ck_alloc(queued_paths * sizeof(struct queue_entry *));
+
+    for (q = queue; q; q = q->next)
+      by_id[q->id] = q;
+  }
+
+  if (read(fd, rec, len) == len)
+  {
+    for (i = 0; i < br_cnt; i++)
     {
-      br_info[br_hit[i]].hit = BR_FAIL;
-#ifdef _MAXAFL_DEBUG
-      fprintf(stderr, "[DBG]\tSave Branch (%d, %d) = %d(real = %lf, left = %d, rightMul = %d,  right = %d, leftMul = %d)\n", br_info[i].moduleId, br_info[i].brId, br_info[i].hit, br_info[i].real, br_info[i].left, br_info[i].rightMul, br_info[i].right, br_info[i].leftMul);
-#endif
-#ifdef MAXAFL_DEBUG
-      fprintf(stderr, "[DBG]\tSave Branch #%d = %d(real = %lf, left = %d, right = %d)\n", i, br_info[i].hit, br_info[i].real, br_info[i].left, br_info[i].right);
-#endif
+      fr = &br_front[i];
+      fr->seen |= rec[i].seen;
+
+      if (fr->seen == 3)
+        retire_branch(i);
+
+      if (!own && rec[i].q_id != ~0U && rec[i].tries < FRONTIER_MAX_TRIES &&
+          rec[i].dist < fr->remote)
+        fr->remote = rec[i].dist;
+
+      if (by_id && fr->seen != 3 && rec[i].q_id < queued_paths)
+      {
+        fr->q = by_id[rec[i].q_id];
+        fr->dist = rec[i].dist;
+        fr->tries = rec[i].tries;
+      }
     }
   }
-#ifdef _MAXAFL_DEBUG
-  fprintf(stderr, "\n\n");
-#endif
-  return 1;
+
+  ck_free(by_id);
+  ck_free(rec);
+  close(fd);
+}
+
+/* Clear the branch and cmp state left behind by the previous exec. Only
+   the entries on the hit lists can have been touched, and the branch list
+   is already empty if calculate_obj_func() consumed it. Persistent mode
+   targets do the same in __afl_persistent_loop(), so we stay out of the
+   segment while the child is running. */
+
+static void reset_branch_state(void)
+{
+
+  u32 i;
+
+  if (persistent_mode)
+    return;
+
+  for (i = 1; i < br_hit[0]; i++)
+  {
+    br_real[br_hit[i]] = BR_NOHIT;
+  }
+  for (i = 1; i < cmp_hit[0]; i++)
+  {
+    cmp_real[cmp_hit[i]] = BR_NOHIT;
+  }
+
+  br_hit[0] = 1;
+  cmp_hit[0] = 1;
+
+  *exit_penalty = 0;
 }
 
 /* Execute target application, monitoring for timeouts. Return status
@@ -2890,11 +3558,10 @@ static u8 run_target(char **argv, u32 timeout)
 {
 
   static struct itimerval it;
-  static u32 prev_timed_out = 0;
   static u64 exec_ms = 0;
 
   int status = 0;
-  u32 tb4, i;
+  u32 tb4;
 
   child_timed_out = 0;
 
@@ -2908,30 +3575,15 @@ static u8 run_target(char **argv, u32 timeout)
   // set mx_info->real to BR_NOHIT to check whether hit or not.
   // for (i = 0; i < cmp_cnt; i++)
   // {
-  //   cmp_info[i].real = BR_NOHIT;
+  //   cmp_real[i] = BR_NOHIT;
   // }
   // for (i = 0; i < br_cnt; i++)
   // {
-  //   br_info[i].real = BR_NOHIT;
+  //   br_real[i] = BR_NOHIT;
   // }
 
-  for (i = 1; i < br_hit[0]; i++)
-  {
-    br_info[br_hit[i]].real = BR_NOHIT;
-    br_info[br_hit[i]].hit = BR_NOHIT;
-  }
-  for (i = 1; i < cmp_hit[0]; i++)
-  {
-    cmp_info[cmp_hit[i]].real = BR_NOHIT;
-  }
-
-  br_hit[0] = 1;
-  cmp_hit[0] = 1;
-
-  // save adaptive objective function setting in exit_penalty shm_memory
-  *exit_penalty = obj_mode_cur;
+  reset_branch_state();
 
-  // *exit_penalty = 0;
   // memset(mx_info, 0, INFO_SIZE);
   // MEM_BARRIER();
 
@@ -3149,15 +3801,31 @@ static u8 run_target(char **argv, u32 timeout)
   return FAULT_NONE;
 }
 
+/* Copy of what the last write_delta_to_testcase() left in out_fd. Any other
+   writer clears last_tc_len, which forces the next delta write to be full. */
+
+static u8 *last_tc;
+static u32 last_tc_len;
+
 /* Write modified data to file for testing. If out_file is set, the old file
    is unlinked and a new one is created. Otherwise, out_fd is rewound and
-   truncated. */
+   truncated. Targets reading from shared memory just get a copy. */
 
 static void write_to_testcase(void *mem, u32 len)
 {
 
   s32 fd = out_fd;
 
+  last_tc_len = 0;
+
+  if (shm_input_mode)
+  {
+
+    *shm_input = MIN(len, MAX_FILE);
+    memcpy(shm_input + 1, mem, *shm_input);
+    return;
+  }
+
   if (out_file)
   {
 
@@ -3184,6 +3852,50 @@ static void write_to_testcase(void *mem, u32 len)
     close(fd);
 }
 
+/* The same, but only rewrites the span that differs from the previous delta
+   write. Used for the back-to-back probes of common_fuzz_batch(), which mostly
+   differ from each other in a byte or two. Falls back to write_to_testcase()
+   when out_file is in use or the length changes. The SHM channel always gets
+   a full copy: the target maps it writable, and a harness that edits
+   __AFL_FUZZ_TESTCASE_BUF in place would leave it out of step with last_tc. */
+
+static void write_delta_to_testcase(u8 *mem, u32 len)
+{
+
+  u32 first, last;
+
+  if (out_file || shm_input_mode || !len || len != last_tc_len)
+  {
+
+    write_to_testcase(mem, len);
+
+    if (out_file || shm_input_mode)
+      return;
+
+    last_tc = ck_realloc(last_tc, len);
+    memcpy(last_tc, mem, len);
+    last_tc_len = len;
+    return;
+  }
+
+  for (first = 0; first < len && mem[first] == last_tc[first]; first++)
+    ;
+
+  if (first < len)
+  {
+
+    for (last = len - 1; mem[last] == last_tc[last]; last--)
+      ;
+
+    if (pwrite(out_fd, mem + first, last - first + 1, first) != last - first + 1)
+      PFATAL("Short write to testcase");
+
+    memcpy(last_tc + first, mem + first, last - first + 1);
+  }
+
+  lseek(out_fd, 0, SEEK_SET);
+}
+
 /* The same, but with an adjustable gap. Used for trimming. */
 
 static void write_with_gap(void *mem, u32 len, u32 skip_at, u32 skip_len)
@@ -3192,6 +3904,17 @@ static void write_with_gap(void *mem, u32 len, u32 skip_at, u32 skip_len)
   s32 fd = out_fd;
   u32 tail_len = len - skip_at - skip_len;
 
+  last_tc_len = 0;
+
+  if (shm_input_mode)
+  {
+
+    memcpy(shm_input + 1, mem, skip_at);
+    memcpy((u8 *)(shm_input + 1) + skip_at, mem + skip_at + skip_len, tail_len);
+    *shm_input = len - skip_len;
+    return;
+  }
+
   if (out_file)
   {
 
@@ -3291,6 +4014,9 @@ static u8 calibrate_case(char **argv, struct queue_entry *q, u8 *use_mem,
       goto abort_calibration;
     }
 
+    if (!stage_cur)
+      update_frontier(q);
+
     cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
 
     if (q->exec_cksum != cksum)
@@ -4141,6 +4867,7 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps)
 
   static double last_bcvg, last_stab, last_eps;
   static struct rusage usage;
+  u32 i;
 
   u8 *fn = alloc_printf("%s/fuzzer_stats", out_dir);
   s32 fd;
@@ -4221,6 +4948,23 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps)
           orig_cmdline, slowest_exec_ms);
   /* ignore errors */
 
+  /* Cost of the lbfgs stage per solver, in target execs per new path. */
+
+  for (i = 1; i <= SOLVER_CNT; i++)
+  {
+    u8 key[24];
+
+    sprintf(key, "%s_execs", solver_names[i]);
+    fprintf(f, "%-18s: %llu\n", key, solver_execs[i]);
+    sprintf(key, "%s_paths", solver_names[i]);
+    fprintf(f, "%-18s: %llu\n", key, solver_finds[i]);
+    sprintf(key, "%s_epp", solver_names[i]);
+    if (solver_finds[i])
+      fprintf(f, "%-18s: %0.02f\n", key, (double)solver_execs[i] / solver_finds[i]);
+    else
+      fprintf(f, "%-18s: n/a\n", key);
+  }
+
   /* Get rss value from the children
      We must have killed the forkserver process and called waitpid
      before calling getrusage */
@@ -4653,6 +5397,11 @@ static void maybe_delete_out_dir(void)
     if (unlink(fn) && errno != ENOENT)
       goto dir_cleanup_failed;
     ck_free(fn);
+
+    fn = alloc_printf("%s/" REGISTRY_NAME, out_dir);
+    if (unlink(fn) && errno != ENOENT)
+      goto dir_cleanup_failed;
+    ck_free(fn);
   }
 
   fn = alloc_printf("%s/plot_data", out_dir);
@@ -4772,6 +5521,7 @@ static void show_stats(void)
     write_stats_file(t_byte_ratio, stab_ratio, avg_exec);
     save_auto();
     write_bitmap();
+    write_registry();
   }
 
   // Write plot file per total execution
@@ -5393,139 +6143,642 @@ static u8 trim_case(char **argv, struct queue_entry *q, u8 *in_buf)
 
       write_with_gap(in_buf, q->len, remove_pos, trim_avail);
 
-      fault = run_target(argv, exec_tmout);
-      trim_execs++;
+      fault = run_target(argv, exec_tmout);
+      trim_execs++;
+
+      if (stop_soon || fault == FAULT_ERROR)
+        goto abort_trimming;
+
+      /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
+
+      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+
+      /* If the deletion had no impact on the trace, make it permanent. This
+         isn't perfect for variable-path inputs, but we're just making a
+         best-effort pass, so it's not a big deal if we end up with false
+         negatives every now and then. */
+
+      if (cksum == q->exec_cksum)
+      {
+
+        u32 move_tail = q->len - remove_pos - trim_avail;
+
+        q->len -= trim_avail;
+        len_p2 = next_p2(q->len);
+
+        memmove(in_buf + remove_pos, in_buf + remove_pos + trim_avail,
+                move_tail);
+
+        /* Let's save a clean trace, which will be needed by
+           update_bitmap_score once we're done with the trimming stuff. */
+
+        if (!needs_write)
+        {
+
+          needs_write = 1;
+          memcpy(clean_trace, trace_bits, MAP_SIZE);
+        }
+      }
+      else
+        remove_pos += remove_len;
+
+      /* Since this can be slow, update the screen every now and then. */
+
+      if (!(trim_exec++ % stats_update_freq))
+        show_stats();
+      stage_cur++;
+    }
+
+    remove_len >>= 1;
+  }
+
+  /* If we have made changes to in_buf, we also need to update the on-disk
+     version of the test case. */
+
+  if (needs_write)
+  {
+
+    s32 fd;
+
+    unlink(q->fname); /* ignore errors */
+
+    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0)
+      PFATAL("Unable to create '%s'", q->fname);
+
+    ck_write(fd, in_buf, q->len, q->fname);
+    close(fd);
+
+    memcpy(trace_bits, clean_trace, MAP_SIZE);
+    update_bitmap_score(q);
+  }
+
+abort_trimming:
+
+  bytes_trim_out += q->len;
+  return fault;
+}
+
+/* Second half of common_fuzz_stuff(): timeout and skip accounting, then
+   save_if_interesting(). Returns 1 if it's time to bail out. */
+
+static u8 handle_fuzz_fault(char **argv, u8 *out_buf, u32 len, u8 fault)
+{
+
+  if (stop_soon)
+    return 1;
+
+  if (fault == FAULT_TMOUT)
+  {
+
+    if (subseq_tmouts++ > TMOUT_LIMIT)
+    {
+      cur_skipped_paths++;
+      return 1;
+    }
+  }
+  else
+    subseq_tmouts = 0;
+
+  /* Users can hit us with SIGUSR1 to request the current input
+     to be abandoned. */
+
+  if (skip_requested)
+  {
+
+    skip_requested = 0;
+    cur_skipped_paths++;
+    return 1;
+  }
+
+  /* This handles FAULT_ERROR for us: */
+
+  queued_discovered += save_if_interesting(argv, out_buf, len, fault);
+
+  return 0;
+}
+
+/* Write a modified test case, run program, process results. Handle
+   error conditions, returning 1 if it's time to bail out. This is
+   a helper function for fuzz_one(). */
+
+static u8 run_fuzz_stuff(char **argv, u8 *out_buf, u32 len, u8 delta)
+{
+
+  u8 fault;
+
+  if (post_handler)
+  {
+
+    out_buf = post_handler(out_buf, &len);
+    if (!out_buf || !len)
+      return 0;
+  }
+
+  if (delta)
+    write_delta_to_testcase(out_buf, len);
+  else
+    write_to_testcase(out_buf, len);
+
+  fault = run_target(argv, exec_tmout);
+
+  return handle_fuzz_fault(argv, out_buf, len, fault);
+}
+
+// EXP_ST u8 common_fuzz_stuff(char **argv, u8 *out_buf, u32 len)
+u8 common_fuzz_stuff(char **argv, u8 *out_buf, u32 len)
+{
+
+  if (run_fuzz_stuff(argv, out_buf, len, 0))
+    return 1;
+
+  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
+    show_stats();
+
+  return 0;
+}
+
+/* Exchange the SHM, fork server and test case globals with those of a pool
+   worker. Calling it twice restores the primary state. */
+
+#define SWAP_FIELD(_a, _b)   \
+  do                         \
+  {                          \
+    __typeof__(_a) _t = (_a); \
+    (_a) = (_b);             \
+    (_b) = _t;               \
+  } while (0)
+
+static void swap_worker(struct pool_worker *w)
+{
+
+  SWAP_FIELD(trace_bits, w->trace_bits);
+  SWAP_FIELD(maxafl_state, w->maxafl_state);
+  SWAP_FIELD(br_real, w->br_real);
+  SWAP_FIELD(cmp_real, w->cmp_real);
+  SWAP_FIELD(br_hit, w->br_hit);
+  SWAP_FIELD(cmp_hit, w->cmp_hit);
+  SWAP_FIELD(exit_penalty, w->exit_penalty);
+  SWAP_FIELD(shm_input, w->shm_input);
+
+  SWAP_FIELD(out_file, w->out_file);
+  SWAP_FIELD(last_tc, w->last_tc);
+  SWAP_FIELD(last_tc_len, w->last_tc_len);
+  SWAP_FIELD(out_fd, w->out_fd);
+  SWAP_FIELD(fsrv_ctl_fd, w->fsrv_ctl_fd);
+  SWAP_FIELD(fsrv_st_fd, w->fsrv_st_fd);
+  SWAP_FIELD(forksrv_pid, w->forksrv_pid);
+  SWAP_FIELD(child_pid, w->child_pid);
+  SWAP_FIELD(prev_timed_out, w->prev_timed_out);
+}
+
+#undef SWAP_FIELD
+
+/* Start the gradient worker pool. Every worker gets its own per-exec state
+   segment, whose header points at the shared one, and its own fork server,
+   spawned with the SHM env vars pointing at the worker's regions. Called
+   once the primary fork server is up. */
+
+static void init_pool(char **argv)
+{
+
+  static u8 *shm_env[POOL_SHM_CNT] = {
+      SHM_ENV_VAR, SHM_ENV_VAR_STATE, SHM_ENV_VAR_EXIT_PENALTY, SHM_ENV_VAR_INPUT};
+  u64 shm_size[POOL_SHM_CNT] = {MAP_SIZE, maxafl_state->size, sizeof(u32),
+                                shm_input_mode ? sizeof(u32) + MAX_FILE : 0};
+
+  u8 *saved_env[POOL_SHM_CNT], *fn;
+  u32 i, j, argc = 0;
+
+  if (dumb_mode || no_forkserver || post_handler)
+  {
+    WARNF("Gradient pool needs a fork server and no postprocessor, disabling.");
+    pool_size = 0;
+    return;
+  }
+
+  while (argv[argc])
+    argc++;
+
+  if (out_file)
+  {
+
+    for (i = 0; i < argc && !strstr(argv[i], out_file); i++)
+      ;
+
+    if (i == argc)
+    {
+      WARNF("-f without @@ pins the test case path, disabling gradient pool.");
+      pool_size = 0;
+      return;
+    }
+  }
+
+  ACTF("Spinning up %u gradient workers...", pool_size);
+
+  pool = ck_alloc(pool_size * sizeof(struct pool_worker));
+
+  for (j = 0; j < POOL_SHM_CNT; j++)
+    saved_env[j] = getenv(shm_env[j]) ? ck_strdup(getenv(shm_env[j])) : NULL;
+
+  /* Workers inherit our fds unless told otherwise; keep the primary fork
+     server pipes and test case out of their way. */
+
+  fcntl(fsrv_ctl_fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fsrv_st_fd, F_SETFD, FD_CLOEXEC);
+  if (!out_file)
+    fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+
+#ifdef HAVE_AFFINITY
+
+  /* The fork servers would otherwise inherit our single-core binding. */
+
+  if (cpu_aff >= 0)
+  {
+
+    cpu_set_t c;
+
+    CPU_ZERO(&c);
+    for (j = 0; j < cpu_core_count; j++)
+      CPU_SET(j, &c);
+
+    sched_setaffinity(0, sizeof(c), &c);
+  }
+
+#endif /* HAVE_AFFINITY */
+
+  for (i = 0; i < pool_size; i++)
+  {
+
+    struct pool_worker *w = &pool[i];
+    void *mem[POOL_SHM_CNT];
+
+    for (j = 0; j < POOL_SHM_CNT; j++)
+    {
+
+      u8 *shm_str;
+
+      if (!shm_size[j])
+      {
+        w->shm_id[j] = -1;
+        mem[j] = NULL;
+        continue;
+      }
+
+      w->shm_id[j] = shmget(IPC_PRIVATE, shm_size[j], IPC_CREAT | IPC_EXCL | 0600);
+      if (w->shm_id[j] < 0)
+        PFATAL("shmget() failed");
+
+      mem[j] = shmat(w->shm_id[j], NULL, 0);
+      if (mem[j] == (void *)-1)
+        PFATAL("shmat() failed");
+
+      shm_str = alloc_printf("%d", w->shm_id[j]);
+      setenv(shm_env[j], shm_str, 1);
+      ck_free(shm_str);
+    }
+
+    w->trace_bits = mem[0];
+    w->exit_penalty = mem[2];
+    w->shm_input = mem[3];
+
+    memcpy(mem[1], maxafl_state, sizeof(maxafl_shm_hdr_t));
+    ((maxafl_shm_hdr_t *)mem[1])->ack = 0;
+
+    swap_worker(w);
+    map_state_arrays(mem[1]);
+    clear_state_arrays();
+    swap_worker(w);
+
+    if (out_file)
+    {
+
+      /* Keep the original file name, since targets may look at the
+         extension. */
+
+      u8 *base = strrchr(out_file, '/');
+      u8 *dir = alloc_printf("%s/.pool_%u", out_dir, i);
+
+      if (mkdir(dir, 0700) && errno != EEXIST)
+        PFATAL("Unable to create '%s'", dir);
+
+      w->out_file = alloc_printf("%s/%s", dir, base ? base + 1 : out_file);
+      w->out_fd = -1;
+      ck_free(dir);
+
+      w->argv = ck_alloc((argc + 1) * sizeof(char *));
+
+      for (j = 0; j < argc; j++)
+      {
+
+        u8 *aa_loc = strstr(argv[j], out_file);
+
+        if (!aa_loc)
+        {
+          w->argv[j] = argv[j];
+          continue;
+        }
+
+        *aa_loc = 0;
+        w->argv[j] = alloc_printf("%s%s%s", argv[j], w->out_file, aa_loc + strlen(out_file));
+        *aa_loc = out_file[0];
+      }
+    }
+    else
+    {
+
+      fn = alloc_printf("%s/.cur_input_%u", out_dir, i);
+
+      unlink(fn); /* Ignore errors */
+
+      w->out_fd = open(fn, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+      if (w->out_fd < 0)
+        PFATAL("Unable to create '%s'", fn);
+
+      ck_free(fn);
+
+      w->argv = argv;
+    }
+
+    w->child_pid = -1;
+
+    swap_worker(w);
+    init_forkserver(w->argv);
+    swap_worker(w);
+
+    fcntl(w->fsrv_ctl_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(w->fsrv_st_fd, F_SETFD, FD_CLOEXEC);
+    if (w->out_fd >= 0)
+      fcntl(w->out_fd, F_SETFD, FD_CLOEXEC);
+  }
+
+#ifdef HAVE_AFFINITY
+
+  if (cpu_aff >= 0)
+  {
+
+    cpu_set_t c;
+
+    CPU_ZERO(&c);
+    CPU_SET(cpu_aff, &c);
+
+    sched_setaffinity(0, sizeof(c), &c);
+  }
+
+#endif /* HAVE_AFFINITY */
+
+  for (j = 0; j < POOL_SHM_CNT; j++)
+  {
+
+    if (saved_env[j])
+      setenv(shm_env[j], saved_env[j], 1);
+    else
+      unsetenv(shm_env[j]);
+
+    ck_free(saved_env[j]);
+  }
+
+  OKF("Gradient pool is up with %u workers.", pool_size);
+}
+
+/* Reset a worker's state, hand it a test case and ask its fork server for
+   a child, without waiting for the child to finish. */
+
+static void pool_dispatch(struct pool_worker *w, u8 *mem, u32 len, u32 probe)
+{
+
+  s32 res;
+
+  swap_worker(w);
+
+  memset(trace_bits, 0, MAP_SIZE);
+  MEM_BARRIER();
+
+  reset_branch_state();
+  write_delta_to_testcase(mem, len);
+
+  if ((res = write(fsrv_ctl_fd, &prev_timed_out, 4)) != 4)
+  {
+
+    swap_worker(w);
+    if (stop_soon)
+      return;
+    RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+  }
+
+  if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4)
+  {
+
+    swap_worker(w);
+    if (stop_soon)
+      return;
+    RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+  }
+
+  if (child_pid <= 0)
+    FATAL("Fork server is misbehaving (OOM?)");
+
+  swap_worker(w);
+
+  w->busy = 1;
+  w->timed_out = 0;
+  w->probe = probe;
+  w->start_ms = get_cur_time();
+}
+
+/* Read back the status of a finished worker child. This is the tail of
+   run_target(), done against the worker's trace_bits. */
+
+static u8 pool_collect(struct pool_worker *w)
+{
+
+  s32 res;
+  int status;
+  u64 exec_ms = get_cur_time() - w->start_ms;
+
+  w->busy = 0;
+
+  if ((res = read(w->fsrv_st_fd, &status, 4)) != 4)
+  {
+
+    if (stop_soon)
+      return FAULT_NONE;
+    RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+  }
+
+  if (!WIFSTOPPED(status))
+    w->child_pid = 0;
+
+  total_execs++;
+
+  MEM_BARRIER();
+
+#ifdef __x86_64__
+  classify_counts((u64 *)w->trace_bits);
+#else
+  classify_counts((u32 *)w->trace_bits);
+#endif /* ^__x86_64__ */
+
+  w->prev_timed_out = w->timed_out;
+
+  if (WIFSIGNALED(status) && !stop_soon)
+  {
+
+    kill_signal = WTERMSIG(status);
+
+    if (w->timed_out && kill_signal == SIGKILL)
+      return FAULT_TMOUT;
+
+    return FAULT_CRASH;
+  }
+
+  if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR)
+  {
+    kill_signal = 0;
+    return FAULT_CRASH;
+  }
+
+  if (slowest_exec_ms < exec_ms)
+    slowest_exec_ms = exec_ms;
+
+  return FAULT_NONE;
+}
+
+/* common_fuzz_batch() over the worker pool: keep every worker busy, and
+   process results in completion order. Each result is handled with the
+   worker swapped in, so save_if_interesting() sees its trace_bits and any
+   calibration runs on the now idle worker. */
+
+static u8 pool_fuzz_batch(u8 **bufs, u32 len, u32 n, double *vals, s8 *status)
+{
+
+  static struct pollfd *pfd;
+  static struct pool_worker **pfd_w;
+
+  u32 next = 0, i, cnt;
+  u8 ret = 0, fault;
+
+  if (!pfd)
+  {
+    pfd = ck_alloc(pool_size * sizeof(struct pollfd));
+    pfd_w = ck_alloc(pool_size * sizeof(struct pool_worker *));
+  }
+
+  while (1)
+  {
 
-      if (stop_soon || fault == FAULT_ERROR)
-        goto abort_trimming;
+    u64 now = get_cur_time(), elapsed;
+    s32 wait_ms = exec_tmout;
 
-      /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
+    cnt = 0;
 
-      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    for (i = 0; i < pool_size; i++)
+    {
 
-      /* If the deletion had no impact on the trace, make it permanent. This
-         isn't perfect for variable-path inputs, but we're just making a
-         best-effort pass, so it's not a big deal if we end up with false
-         negatives every now and then. */
+      struct pool_worker *w = &pool[i];
 
-      if (cksum == q->exec_cksum)
+      if (!w->busy && next < n && !stop_soon)
       {
+        pool_dispatch(w, bufs[next], len, next);
+        next++;
+      }
 
-        u32 move_tail = q->len - remove_pos - trim_avail;
+      if (!w->busy)
+        continue;
 
-        q->len -= trim_avail;
-        len_p2 = next_p2(q->len);
+      /* A worker dispatched just now may have start_ms past now. */
 
-        memmove(in_buf + remove_pos, in_buf + remove_pos + trim_avail,
-                move_tail);
+      elapsed = now > w->start_ms ? now - w->start_ms : 0;
 
-        /* Let's save a clean trace, which will be needed by
-           update_bitmap_score once we're done with the trimming stuff. */
+      if (elapsed >= exec_tmout)
+      {
 
-        if (!needs_write)
+        if (!w->timed_out)
         {
-
-          needs_write = 1;
-          memcpy(clean_trace, trace_bits, MAP_SIZE);
+          w->timed_out = 1;
+          kill(w->child_pid, SIGKILL);
         }
       }
-      else
-        remove_pos += remove_len;
+      else if (exec_tmout - elapsed < wait_ms)
+        wait_ms = exec_tmout - elapsed;
 
-      /* Since this can be slow, update the screen every now and then. */
+      pfd[cnt].fd = w->fsrv_st_fd;
+      pfd[cnt].events = POLLIN;
+      pfd_w[cnt++] = w;
+    }
 
-      if (!(trim_exec++ % stats_update_freq))
-        show_stats();
-      stage_cur++;
+    if (!cnt)
+      break;
+
+    if (poll(pfd, cnt, wait_ms) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      PFATAL("poll() failed");
     }
 
-    remove_len >>= 1;
-  }
+    for (i = 0; i < cnt; i++)
+    {
 
-  /* If we have made changes to in_buf, we also need to update the on-disk
-     version of the test case. */
+      struct pool_worker *w = pfd_w[i];
 
-  if (needs_write)
-  {
+      if (!pfd[i].revents)
+        continue;
 
-    s32 fd;
+      fault = pool_collect(w);
 
-    unlink(q->fname); /* ignore errors */
+      if (stop_soon)
+        continue;
 
-    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+      swap_worker(w);
 
-    if (fd < 0)
-      PFATAL("Unable to create '%s'", q->fname);
+      ret |= handle_fuzz_fault(w->argv, bufs[w->probe], len, fault);
 
-    ck_write(fd, in_buf, q->len, q->fname);
-    close(fd);
+      vals[w->probe] = calculate_obj_func();
+      status[w->probe] = (s8)check_branch_hit();
 
-    memcpy(trace_bits, clean_trace, MAP_SIZE);
-    update_bitmap_score(q);
+      swap_worker(w);
+    }
   }
 
-abort_trimming:
+  show_stats();
 
-  bytes_trim_out += q->len;
-  return fault;
+  return stop_soon ? 1 : ret;
 }
 
-/* Write a modified test case, run program, process results. Handle
-   error conditions, returning 1 if it's time to bail out. This is
-   a helper function for fuzz_one(). */
+/* Run n same-length test cases back to back for the gradient stage and
+   store the objective and check_branch_hit() result of each in vals[] and
+   status[]. Test cases are written as deltas against each other and the
+   stats screen is refreshed once per batch. Returns 1 if any exec asked to
+   bail out, like common_fuzz_stuff(); the batch stops early on stop_soon.
+   With a worker pool (-j), the test cases run in parallel instead. */
 
-// EXP_ST u8 common_fuzz_stuff(char **argv, u8 *out_buf, u32 len)
-u8 common_fuzz_stuff(char **argv, u8 *out_buf, u32 len)
+u8 common_fuzz_batch(char **argv, u8 **bufs, u32 len, u32 n, double *vals, s8 *status)
 {
 
-  u8 fault;
-
-  if (post_handler)
-  {
-
-    out_buf = post_handler(out_buf, &len);
-    if (!out_buf || !len)
-      return 0;
-  }
-
-  write_to_testcase(out_buf, len);
-
-  fault = run_target(argv, exec_tmout);
+  u32 i;
+  u8 ret = 0;
 
-  if (stop_soon)
-    return 1;
+  if (pool_size)
+    return pool_fuzz_batch(bufs, len, n, vals, status);
 
-  if (fault == FAULT_TMOUT)
+  for (i = 0; i < n; i++)
   {
 
-    if (subseq_tmouts++ > TMOUT_LIMIT)
-    {
-      cur_skipped_paths++;
-      return 1;
-    }
-  }
-  else
-    subseq_tmouts = 0;
-
-  /* Users can hit us with SIGUSR1 to request the current input
-     to be abandoned. */
+    ret |= run_fuzz_stuff(argv, bufs[i], len, 1);
 
-  if (skip_requested)
-  {
+    if (stop_soon)
+      return 1;
 
-    skip_requested = 0;
-    cur_skipped_paths++;
-    return 1;
+    vals[i] = calculate_obj_func();
+    status[i] = (s8)check_branch_hit();
   }
 
-  /* This handles FAULT_ERROR for us: */
-
-  queued_discovered += save_if_interesting(argv, out_buf, len, fault);
-
-  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
-    show_stats();
+  show_stats();
 
-  return 0;
+  return ret;
 }
 
 /* Helper to choose random block len for block operations in fuzz_one().
@@ -5890,6 +7143,143 @@ static u8 could_be_interest(u32 old_val, u32 new_val, u8 blen, u8 check_le)
 // {
 // }
 
+/* Executions one lbfgs solve of queue entry q may spend, when the stage
+   runs `solves` of them. The base budget is scaled by the perf score and by
+   the stage's finds per exec over those of the whole fuzzer, both
+   smoothed so a fresh run starts at the base. The result is then cut so
+   the stage fits in LBFGS_STAGE_MS at q's exec speed. */
+
+static u32 lbfgs_stage_budget(struct queue_entry *q, u32 base, u32 perf_score,
+                              u32 solves)
+{
+  u64 execs = 0, cap;
+  double budget, mine, all, mul;
+  u32 i;
+
+  for (i = 0; i <= SOLVER_CNT; i++)
+    execs += solver_execs[i];
+
+  mine = (stage_finds[STAGE_LBFGS1] + 1.0) / (execs + base);
+  all = (queued_discovered + unique_crashes + 1.0) / (total_execs + base);
+  mul = mine / all;
+
+  if (mul < LBFGS_BUDGET_MIN_MUL)
+    mul = LBFGS_BUDGET_MIN_MUL;
+  if (mul > LBFGS_BUDGET_MAX_MUL)
+    mul = LBFGS_BUDGET_MAX_MUL;
+
+  budget = (double)base * perf_score / 100 * mul;
+
+  cap = (u64)LBFGS_STAGE_MS * 1000 / MAX(q->exec_us, 1) / MAX(solves, 1);
+
+  if (pool_size)
+    cap *= pool_size;
+
+  if (budget > cap)
+    budget = cap;
+
+  return MAX(budget, LBFGS_BUDGET_MIN);
+}
+
+/* Stage bandit. Each stage group of fuzz_one() is an arm paid in finds
+   per exec. An arm's history is halved every BANDIT_WINDOW execs, so
+   it follows the current phase of the run. */
+
+static void bandit_update(s8 arm, u64 hit_cnt, u64 execs)
+{
+  if (arm < 0)
+    return;
+
+  bandit_finds[arm] += queued_paths + unique_crashes - hit_cnt;
+  bandit_execs[arm] += total_execs - execs;
+
+  if (bandit_execs[arm] > BANDIT_WINDOW)
+  {
+    bandit_finds[arm] /= 2;
+    bandit_execs[arm] /= 2;
+  }
+}
+
+/* Payoff of an arm relative to the best one, in (0, 1]. The deterministic
+   stages start from a pessimistic prior, as baseline skipped them. */
+
+static double bandit_share(u8 arm)
+{
+  double best = 0, pay[ARM_CNT];
+  u8 i;
+
+  for (i = 0; i < ARM_CNT; i++)
+  {
+    pay[i] = (bandit_finds[i] + 1) /
+             (bandit_execs[i] + (i == ARM_DET ? BANDIT_DET_PRIOR_EXECS : BANDIT_PRIOR_EXECS));
+    if (pay[i] > best)
+      best = pay[i];
+  }
+
+  return pay[arm] / best;
+}
+
+/* Draw whether an optional arm runs for the current entry. */
+
+static u8 bandit_pick(u8 arm)
+{
+  return UR(10000) < MAX(bandit_share(arm), BANDIT_MIN_PROB) * 10000;
+}
+
+/* Weigh the blocks of a len byte havoc buffer by the gradient maps of the
+   entries it came from: q before split, and s (when splicing) from there
+   on. Blocks no map covers weigh nothing; if none weighs anything, havoc
+   stays uniform. */
+
+static void build_grad_cdf(struct queue_entry *q, struct queue_entry *s,
+                           u32 split, u32 len)
+{
+  u32 i, n = (len + GRAD_MAP_BLOCK - 1) / GRAD_MAP_BLOCK, sum = 0;
+  struct queue_entry *e;
+
+  grad_cdf = ck_realloc(grad_cdf, MAX(n, 1) * sizeof(u32));
+
+  for (i = 0; i < n; i++)
+  {
+    e = s && i * GRAD_MAP_BLOCK >= split ? s : q;
+
+    if (i < e->grad_len)
+      sum += e->grad_map[i];
+
+    grad_cdf[i] = sum;
+  }
+
+  grad_cdf_len = sum ? n : 0;
+}
+
+/* Offset in [0, limit) for a havoc tweak. GRAD_HAVOC_PERC percent of the
+   time it is drawn by block weight, the rest uniformly, so bytes the
+   gradient never saw are still reached. Inserts and deletes shift the
+   buffer under the weights; offsets past limit fall back to uniform. */
+
+static u32 havoc_pos(u32 limit)
+{
+  u32 r, lo = 0, hi, mid, pos;
+
+  if (!grad_cdf_len || UR(100) >= GRAD_HAVOC_PERC)
+    return UR(limit);
+
+  r = UR(grad_cdf[grad_cdf_len - 1]);
+  hi = grad_cdf_len - 1;
+
+  while (lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    if (grad_cdf[mid] > r)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  pos = lo * GRAD_MAP_BLOCK + UR(GRAD_MAP_BLOCK);
+  return pos < limit ? pos : UR(limit);
+}
+
 /* Take the current entry from the queue, fuzz it for a while. This
    function is a tad too long... returns 0 if fuzzed successfully, 1 if
    skipped or bailed out. */
@@ -5899,11 +7289,14 @@ static u8 fuzz_one(char **argv)
 
   s32 len, /*ext_len,*/ fd, temp_len, i, j;
   u8 *in_buf, *out_buf, /**tmp_buf,*/ *orig_in, *ex_tmp, *eff_map = 0;
-  u64 havoc_queued, orig_hit_cnt, new_hit_cnt;
+  u64 havoc_queued, orig_hit_cnt, new_hit_cnt, orig_execs;
   u32 splice_cycle = 0, perf_score = 100, orig_perf, prev_cksum, eff_cnt = 1;
+  u32 targets[FRONTIER_PICK], target_cnt, target_cur;
+  u64 arm_hit_cnt = 0, arm_execs = 0;
+  s8 arm_cur = -1;
   // double origin_f, tmp_f;
 
-  u8 ret_val = 1, doing_det = 0;
+  u8 ret_val = 1, doing_det = 0, solver;
 
   u8 a_collect[MAX_AUTO_EXTRA];
   u32 a_len = 0;
@@ -6073,9 +7466,25 @@ static u8 fuzz_one(char **argv)
     _arf[(_bf) >> 3] ^= (128 >> ((_bf)&7)); \
   } while (0)
 
+  /* Move the stage bandit on to another arm, paying the one just left. */
+
+#define ENTER_ARM(_arm)                             \
+  do                                                \
+  {                                                 \
+    bandit_update(arm_cur, arm_hit_cnt, arm_execs); \
+    arm_cur = (_arm);                               \
+    arm_hit_cnt = queued_paths + unique_crashes;    \
+    arm_execs = total_execs;                        \
+  } while (0)
+
   // ? consider about goto abandon_entry in solve_lbfgs()
   // // ! LBFGS-B stage 1
 
+  if (stage_sched_cur == STAGE_SCHED_BANDIT && !bandit_pick(ARM_GRAD))
+    goto skip_lbfgs;
+
+  ENTER_ARM(ARM_GRAD);
+
   stage_short = "lbfgs1";
   stage_name = "L-BFGS 1";
 
@@ -6089,8 +7498,39 @@ static u8 fuzz_one(char **argv)
 
   prev_cksum = queue_cur->exec_cksum;
 
-  if (init_lbfgs(argv, out_buf, len, 1, LBFGS_ACC, lbfgs_mode_cur, prob_mode_cur) != -1)
+  solver = solver_cur == SOLVER_ROTATE ? 1 + solver_turn++ % SOLVER_CNT : solver_cur;
+  orig_execs = total_execs;
+
+  /* In frontier mode, every solve is aimed at a single frontier branch this
+     entry is the best seed for, on its own budget. Entries that seed none
+     leave their branches to better placed ones and skip the stage. */
+
+  /* Every solve runs on a budget sized from how well the stage has paid
+     off, and gives up early once its objective stops improving. */
+
+  if (sched_mode_cur == SCHED_MODE_FRONTIER)
+  {
+    target_cnt = pick_frontier(queue_cur, targets);
+    lbfgs_budget = lbfgs_stage_budget(queue_cur, FRONTIER_EXEC_BUDGET, perf_score, target_cnt);
+  }
+  else
+  {
+    target_cnt = 1;
+    lbfgs_budget = lbfgs_stage_budget(queue_cur, LBFGS_EXEC_BUDGET, perf_score, 1);
+  }
+
+  for (target_cur = 0; target_cur < target_cnt; target_cur++)
   {
+    if (sched_mode_cur == SCHED_MODE_FRONTIER)
+    {
+      target_br = targets[target_cur];
+      target_side = br_front[target_br].seen == 1;
+      br_front[target_br].tries++;
+    }
+
+    if (init_lbfgs(argv, out_buf, len, 1, LBFGS_ACC, lbfgs_mode_cur, prob_mode_cur, solver) == -1)
+      break;
+
     // init_normal_sampling(out_buf, len, NORMAL_STDDEV);
     for (stage_cur = 0; stage_cur < stage_max; stage_cur++)
     {
@@ -6102,10 +7542,15 @@ static u8 fuzz_one(char **argv)
       // sample_dist(out_buf, len);
     }
 
-    new_hit_cnt = queued_paths + unique_crashes;
+    /* Keep what the solve learned about the bytes for havoc. */
 
-    stage_finds[STAGE_LBFGS1] += new_hit_cnt - orig_hit_cnt;
-    stage_cycles[STAGE_LBFGS1] += stage_max;
+    if (!queue_cur->grad_map)
+    {
+      queue_cur->grad_len = (len + GRAD_MAP_BLOCK - 1) / GRAD_MAP_BLOCK;
+      queue_cur->grad_map = ck_alloc(queue_cur->grad_len);
+    }
+
+    export_sensitivity(queue_cur->grad_map, len);
 
     free_lbfgs();
     // free_normal_sampling(len);
@@ -6113,6 +7558,29 @@ static u8 fuzz_one(char **argv)
     memcpy(out_buf, in_buf, len);
   }
 
+  target_br = -1;
+  lbfgs_budget = LBFGS_EXEC_BUDGET;
+
+  if (target_cur)
+  {
+    new_hit_cnt = queued_paths + unique_crashes;
+
+    stage_finds[STAGE_LBFGS1] += new_hit_cnt - orig_hit_cnt;
+    stage_cycles[STAGE_LBFGS1] += stage_max * target_cur;
+
+    solver_finds[solver] += new_hit_cnt - orig_hit_cnt;
+    solver_execs[solver] += total_execs - orig_execs;
+  }
+
+skip_lbfgs:
+
+  /* The deterministic stages only run when the bandit picks them. */
+
+  if (stage_sched_cur != STAGE_SCHED_BANDIT || !bandit_pick(ARM_DET))
+    goto havoc_stage;
+
+  ENTER_ARM(ARM_DET);
+
   // stage_short = "lbfgs";
   // stage_name = "L-BFGS";
 
@@ -6202,7 +7670,6 @@ static u8 fuzz_one(char **argv)
   // stage_cycles[STAGE_FLIP2] += stage_max;
 
   // goto abandon_entry;
-  goto havoc_stage;
 
   /* Single walking bit. */
 
@@ -7361,6 +8828,8 @@ skip_extras:
 
 havoc_stage:
 
+  ENTER_ARM(ARM_HAVOC);
+
   stage_cur_byte = -1;
 
   /* The havoc stage mutation code is also invoked when splicing files; if the
@@ -7368,6 +8837,8 @@ havoc_stage:
 
   if (!splice_cycle)
   {
+    build_grad_cdf(queue_cur, NULL, 0, len);
+
     stage_name = "havoc";
     stage_short = "havoc";
     stage_max = (doing_det ? HAVOC_CYCLES_INIT : HAVOC_CYCLES) *
@@ -7385,6 +8856,9 @@ havoc_stage:
     stage_max = SPLICE_HAVOC * perf_score / havoc_div / 100;
   }
 
+  if (stage_sched_cur == STAGE_SCHED_BANDIT)
+    stage_max *= BANDIT_HAVOC_MIN_MUL + (1 - BANDIT_HAVOC_MIN_MUL) * bandit_share(ARM_HAVOC);
+
   if (stage_max < HAVOC_MIN)
     stage_max = HAVOC_MIN;
 
@@ -7413,14 +8887,14 @@ havoc_stage:
 
         /* Flip a single bit somewhere. Spooky! */
 
-        FLIP_BIT(out_buf, UR(temp_len << 3));
+        FLIP_BIT(out_buf, (havoc_pos(temp_len) << 3) + UR(8));
         break;
 
       case 1:
 
         /* Set byte to interesting value. */
 
-        out_buf[UR(temp_len)] = interesting_8[UR(sizeof(interesting_8))];
+        out_buf[havoc_pos(temp_len)] = interesting_8[UR(sizeof(interesting_8))];
         break;
 
       case 2:
@@ -7433,13 +8907,13 @@ havoc_stage:
         if (UR(2))
         {
 
-          *(u16 *)(out_buf + UR(temp_len - 1)) =
+          *(u16 *)(out_buf + havoc_pos(temp_len - 1)) =
               interesting_16[UR(sizeof(interesting_16) >> 1)];
         }
         else
         {
 
-          *(u16 *)(out_buf + UR(temp_len - 1)) = SWAP16(
+          *(u16 *)(out_buf + havoc_pos(temp_len - 1)) = SWAP16(
               interesting_16[UR(sizeof(interesting_16) >> 1)]);
         }
 
@@ -7455,13 +8929,13 @@ havoc_stage:
         if (UR(2))
         {
 
-          *(u32 *)(out_buf + UR(temp_len - 3)) =
+          *(u32 *)(out_buf + havoc_pos(temp_len - 3)) =
               interesting_32[UR(sizeof(interesting_32) >> 2)];
         }
         else
         {
 
-          *(u32 *)(out_buf + UR(temp_len - 3)) = SWAP32(
+          *(u32 *)(out_buf + havoc_pos(temp_len - 3)) = SWAP32(
               interesting_32[UR(sizeof(interesting_32) >> 2)]);
         }
 
@@ -7471,14 +8945,14 @@ havoc_stage:
 
         /* Randomly subtract from byte. */
 
-        out_buf[UR(temp_len)] -= 1 + UR(ARITH_MAX);
+        out_buf[havoc_pos(temp_len)] -= 1 + UR(ARITH_MAX);
         break;
 
       case 5:
 
         /* Randomly add to byte. */
 
-        out_buf[UR(temp_len)] += 1 + UR(ARITH_MAX);
+        out_buf[havoc_pos(temp_len)] += 1 + UR(ARITH_MAX);
         break;
 
       case 6:
@@ -7491,14 +8965,14 @@ havoc_stage:
         if (UR(2))
         {
 
-          u32 pos = UR(temp_len - 1);
+          u32 pos = havoc_pos(temp_len - 1);
 
           *(u16 *)(out_buf + pos) -= 1 + UR(ARITH_MAX);
         }
         else
         {
 
-          u32 pos = UR(temp_len - 1);
+          u32 pos = havoc_pos(temp_len - 1);
           u16 num = 1 + UR(ARITH_MAX);
 
           *(u16 *)(out_buf + pos) =
@@ -7517,14 +8991,14 @@ havoc_stage:
         if (UR(2))
         {
 
-          u32 pos = UR(temp_len - 1);
+          u32 pos = havoc_pos(temp_len - 1);
 
           *(u16 *)(out_buf + pos) += 1 + UR(ARITH_MAX);
         }
         else
         {
 
-          u32 pos = UR(temp_len - 1);
+          u32 pos = havoc_pos(temp_len - 1);
           u16 num = 1 + UR(ARITH_MAX);
 
           *(u16 *)(out_buf + pos) =
@@ -7543,14 +9017,14 @@ havoc_stage:
         if (UR(2))
         {
 
-          u32 pos = UR(temp_len - 3);
+          u32 pos = havoc_pos(temp_len - 3);
 
           *(u32 *)(out_buf + pos) -= 1 + UR(ARITH_MAX);
         }
         else
         {
 
-          u32 pos = UR(temp_len - 3);
+          u32 pos = havoc_pos(temp_len - 3);
           u32 num = 1 + UR(ARITH_MAX);
 
           *(u32 *)(out_buf + pos) =
@@ -7569,14 +9043,14 @@ havoc_stage:
         if (UR(2))
         {
 
-          u32 pos = UR(temp_len - 3);
+          u32 pos = havoc_pos(temp_len - 3);
 
           *(u32 *)(out_buf + pos) += 1 + UR(ARITH_MAX);
         }
         else
         {
 
-          u32 pos = UR(temp_len - 3);
+          u32 pos = havoc_pos(temp_len - 3);
           u32 num = 1 + UR(ARITH_MAX);
 
           *(u32 *)(out_buf + pos) =
@@ -7591,7 +9065,7 @@ havoc_stage:
              why not. We use XOR with 1-255 to eliminate the
              possibility of a no-op. */
 
-        out_buf[UR(temp_len)] ^= 1 + UR(255);
+        out_buf[havoc_pos(temp_len)] ^= 1 + UR(255);
         break;
 
       case 11 ... 12:
@@ -7935,6 +9409,8 @@ retry_splicing:
     memcpy(new_buf, in_buf, split_at);
     in_buf = new_buf;
 
+    build_grad_cdf(queue_cur, target, split_at, len);
+
     ck_free(out_buf);
     out_buf = ck_alloc_nozero(len);
     memcpy(out_buf, in_buf, len);
@@ -7949,6 +9425,8 @@ retry_splicing:
 // ! End of Mutation
 abandon_entry:
 
+  ENTER_ARM(-1);
+
   splicing_with = -1;
 
   /* Update pending_not_fuzzed count if we made it through the calibration
@@ -7971,6 +9449,7 @@ abandon_entry:
 
   return ret_val;
 
+#undef ENTER_ARM
 #undef FLIP_BIT
 }
 
@@ -7981,7 +9460,7 @@ static void sync_fuzzers(char **argv)
 
   DIR *sd;
   struct dirent *sd_ent;
-  u32 sync_cnt = 0;
+  u32 i, sync_cnt = 0;
 
   sd = opendir(sync_dir);
   if (!sd)
@@ -7990,6 +9469,9 @@ static void sync_fuzzers(char **argv)
   stage_max = stage_cur = 0;
   cur_depth = 0;
 
+  for (i = 0; i < br_cnt; i++)
+    br_front[i].remote = HUGE_VAL;
+
   /* Look at the entries created for every other fuzzer in the sync directory. */
 
   while ((sd_ent = readdir(sd)))
@@ -8116,6 +9598,13 @@ static void sync_fuzzers(char **argv)
     closedir(qd);
     ck_free(qd_path);
     ck_free(qd_synced_path);
+
+    /* Merge what it knows about the branches, now that its seeds have been
+       measured here too. */
+
+    qd_path = alloc_printf("%s/%s/" REGISTRY_NAME, sync_dir, sd_ent->d_name);
+    load_registry(qd_path, 0);
+    ck_free(qd_path);
   }
 
   closedir(sd);
@@ -8126,12 +9615,23 @@ static void sync_fuzzers(char **argv)
 static void handle_stop_sig(int sig)
 {
 
+  u32 i;
+
   stop_soon = 1;
 
   if (child_pid > 0)
     kill(child_pid, SIGKILL);
   if (forksrv_pid > 0)
     kill(forksrv_pid, SIGKILL);
+
+  for (i = 0; pool && i < pool_size; i++)
+  {
+
+    if (pool[i].child_pid > 0)
+      kill(pool[i].child_pid, SIGKILL);
+    if (pool[i].forksrv_pid > 0)
+      kill(pool[i].forksrv_pid, SIGKILL);
+  }
 }
 
 /* Handle skip request (SIGUSR1). */
@@ -8337,6 +9837,13 @@ EXP_ST void check_binary(u8 *fname)
     WARNF("AFL_DEFER_FORKSRV is no longer supported and may misbehave!");
   }
 
+  if (memmem(f_data, f_len, SHM_INPUT_SIG, strlen(SHM_INPUT_SIG) + 1) && !dumb_mode)
+  {
+
+    OKF(cPIN "Shared memory test case delivery detected.");
+    shm_input_mode = 1;
+  }
+
   if (munmap(f_data, f_len))
     PFATAL("unmap() failed");
 }
@@ -8428,7 +9935,7 @@ static void usage(u8 *argv0)
 
        "  -i dir        - input directory with test cases\n"
        "  -o dir        - output directory for fuzzer findings\n\n"
-       "  -e file       - info file for maxafl fuzzer\n\n"
+       "  -e file       - info file for maxafl fuzzer (infofile.info or infofile.bin)\n\n"
 
        "Execution control settings:\n\n"
 
@@ -8443,6 +9950,15 @@ static void usage(u8 *argv0)
        "  -n            - fuzz without instrumentation (dumb mode)\n"
        "  -x dir        - optional fuzzer dictionary (see README)\n\n"
 
+       "MaxAFL settings:\n\n"
+
+       "  -g mode       - gradient probes: 1 = every byte, 2 = sensitive bytes (%u)\n"
+       "  -l mode       - line search: 1 = fixed rate, 2 = byte steps (%u)\n"
+       "  -s solver     - 0 = rotate, 1 = gd, 2 = lbfgsb, 3 = cmaes, 4 = nm (%u)\n"
+       "  -j workers    - fork server pool for gradient probes, 1-%u (off)\n"
+       "  -r mode       - lbfgs target: 1 = all branches, 2 = frontier (%u)\n"
+       "  -k mode       - stage schedule: 1 = fixed, 2 = bandit (%u)\n\n"
+
        "Other stuff:\n\n"
 
        "  -T text       - text banner to show on the screen\n"
@@ -8451,7 +9967,9 @@ static void usage(u8 *argv0)
 
        "For additional tips, please consult %s/README.\n\n",
 
-       argv0, EXEC_TIMEOUT, MEM_LIMIT, doc_path);
+       argv0, EXEC_TIMEOUT, MEM_LIMIT, GRAD_MODE_DEFAULT, LINE_SEARCH_DEFAULT,
+       SOLVER_DEFAULT, MAXAFL_MX_POOL, SCHED_MODE_DEFAULT, STAGE_SCHED_DEFAULT,
+       doc_path);
 
   exit(1);
 }
@@ -9141,7 +10659,7 @@ static void save_cmdline(u32 argc, char **argv)
 int main(int argc, char **argv)
 {
 
-  s32 opt;
+  s32 opt, mode;
   u64 prev_queued = 0;
   u32 sync_interval_cnt = 0, seek_to;
   u8 *extras_dir = 0;
@@ -9159,7 +10677,7 @@ int main(int argc, char **argv)
   gettimeofday(&tv, &tz);
   srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
 
-  while ((opt = getopt(argc, argv, "+i:o:f:m:t:T:dnCB:S:M:x:Q:e:ba:c:p:")) > 0)
+  while ((opt = getopt(argc, argv, "+i:o:f:m:t:T:dnCB:S:M:x:Q:e:ba:c:p:g:l:s:r:k:j:")) > 0)
     switch (opt)
     {
     case 'i': /* input dir */
@@ -9400,6 +10918,63 @@ int main(int argc, char **argv)
 
       break;
 
+    case 'g':
+      if (sscanf(optarg, "%d", &mode) < 1 ||
+          mode < GRAD_MODE_DENSE || mode > GRAD_MODE_SPARSE)
+        FATAL("Gradient mode must be integer between 1~2");
+      grad_mode_cur = mode;
+
+      OKF("GRAD_MODE setting finished as %d", grad_mode_cur);
+
+      break;
+
+    case 's':
+      if (sscanf(optarg, "%d", &mode) < 1 || mode < 0 || mode > SOLVER_CNT)
+        FATAL("Solver must be integer between 0~%u", SOLVER_CNT);
+      solver_cur = mode;
+
+      OKF("SOLVER setting finished as %s", solver_names[solver_cur]);
+
+      break;
+
+    case 'l':
+      if (sscanf(optarg, "%d", &mode) < 1 ||
+          mode < LINE_SEARCH_FIXED || mode > LINE_SEARCH_BYTE)
+        FATAL("Line search mode must be integer between 1~2");
+      line_search_cur = mode;
+
+      OKF("LINE_SEARCH setting finished as %d", line_search_cur);
+
+      break;
+
+    case 'r':
+      if (sscanf(optarg, "%d", &mode) < 1 ||
+          mode < SCHED_MODE_ALL || mode > SCHED_MODE_FRONTIER)
+        FATAL("Schedule mode must be integer between 1~2");
+      sched_mode_cur = mode;
+
+      OKF("SCHED_MODE setting finished as %d", sched_mode_cur);
+
+      break;
+
+    case 'k':
+      if (sscanf(optarg, "%d", &mode) < 1 ||
+          mode < STAGE_SCHED_FIXED || mode > STAGE_SCHED_BANDIT)
+        FATAL("Stage schedule must be integer between 1~2");
+      stage_sched_cur = mode;
+
+      OKF("STAGE_SCHED setting finished as %d", stage_sched_cur);
+
+      break;
+
+    case 'j': // gradient worker pool
+      if (pool_size)
+        FATAL("Multiple -j options not supported");
+      if (sscanf(optarg, "%u", &pool_size) < 1 || !pool_size || pool_size > MAXAFL_MX_POOL)
+        FATAL("Bad syntax used for -j (1~%u)", MAXAFL_MX_POOL);
+
+      break;
+
     default:
 
       usage(argv[0]);
@@ -9474,6 +11049,7 @@ int main(int argc, char **argv)
   setup_post();
   setup_shm();
   setup_info();
+  setup_state_shm();
   test_info();
   init_count_class16();
 
@@ -9481,6 +11057,13 @@ int main(int argc, char **argv)
   read_testcases();
   load_auto();
 
+  if (in_place_resume)
+  {
+    u8 *fn = alloc_printf("%s/" REGISTRY_NAME, out_dir);
+    load_registry(fn, 1);
+    ck_free(fn);
+  }
+
   pivot_inputs();
 
   if (extras_dir)
@@ -9496,6 +11079,9 @@ int main(int argc, char **argv)
 
   check_binary(argv[optind]);
 
+  if (shm_input_mode)
+    setup_shm_input();
+
   start_time = get_cur_time();
 
   if (qemu_mode)
@@ -9505,6 +11091,9 @@ int main(int argc, char **argv)
 
   perform_dry_run(use_argv);
 
+  if (pool_size)
+    init_pool(use_argv);
+
   cull_queue();
 
   show_init_stats();
@@ -9617,6 +11206,7 @@ int main(int argc, char **argv)
   write_bitmap();
   write_stats_file(0, 0, 0);
   save_auto();
+  write_registry();
 
 stop_fuzzing:
 
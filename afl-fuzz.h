@@ -13,9 +13,14 @@ extern "C"
     u8 check_branch_hit();
     double calculate_obj_func();
     u8 common_fuzz_stuff(char **argv, u8 *out_buf, u32 len);
+    u8 common_fuzz_batch(char **argv, u8 **bufs, u32 len, u32 n, double *vals, s8 *status);
     static u8 run_target(char **argv, u32 timeout);
     u32 UR2(u32 limit);
 
+    extern u8 grad_mode_cur;
+    extern u8 line_search_cur;
+    extern u32 lbfgs_budget;
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,8 +1,11 @@
 #include "afl-fuzz.h"
 #include "afl-lbfgs.hpp"
+#include "hash.h"
 #include <iostream>
 #include <math.h>
 #include <random>
+#include <string.h>
+#include <unordered_map>
 #include <vector>
 
 using namespace cppoptlib;
@@ -52,13 +55,141 @@ public:
     // int maxIdx = -1;
     // double maxGrad = -1;
     bool firstMove = false;
-    int topK[TOPK] = {
-        0,
+    bool sparse = false;
+    int lsearch = LINE_SEARCH_FIXED;
+    int solver = SOLVER_GD;
+    // Target executions spent by the current solve and the most it may spend.
+    // Once spent is set, unmeasured points cost nothing and read as no
+    // better than anchorVal, the objective of the point the solver stands
+    // on, so the running line search or gradient winds down by itself.
+    u64 execs = 0;
+    u64 budget = LBFGS_EXEC_BUDGET;
+    bool spent = false;
+    double anchorVal = HUGE_VAL;
+    // Best objective measured by the current solve, whether it improved
+    // since the last iteration, and iterations without improvement
+    double bestVal = HUGE_VAL;
+    bool improved = false;
+    u32 stall = 0;
+    vector<u8> sens;
+    vector<u8> batch_mem;
+    vector<u8 *> batch_bufs;
+    vector<double> probe_vals;
+    vector<s8> probe_status;
+    // Gradient magnitude per byte, summed over the solve
+    vector<double> sensMag;
+
+    // Objective and branch status per input already run against the current
+    // branch snapshot, keyed by memoKey() of the bytes. stateKey is the input
+    // whose branch state the fuzzer holds right now, 0 if unknown.
+    struct MemoEntry
+    {
+        double val;
+        s8 status;
     };
+    unordered_map<u64, MemoEntry> memo;
+    u64 stateKey = 0;
+    s8 lastStatus = BR_UNCHANGED;
+
+    FuzzProb(int len) : Superclass(len), sensMag(len) {}
+
+    bool callback(const Criteria<Scalar> &, const TVector &)
+    {
+        return progressing();
+    }
+
+    // Objective measured anywhere in the solve; only a drop by more than
+    // LBFGS_STALL_EPS (relative) counts as an improvement.
+    void track(double v)
+    {
+        if (bestVal == HUGE_VAL || bestVal - v > LBFGS_STALL_EPS * fabs(bestVal))
+            improved = true;
+        if (v < bestVal)
+            bestVal = v;
+    }
+
+    // Called once per solver iteration: false once the budget is spent or
+    // the objective has stalled for LBFGS_STALL_ITERS iterations.
+    bool progressing()
+    {
+        stall = improved ? 0 : stall + 1;
+        improved = false;
+        return !spent && execs < budget && stall < LBFGS_STALL_ITERS;
+    }
+
+    static u64 memoKey(const u8 *buf, u32 len)
+    {
+        u64 tail = 0;
+
+        memcpy(&tail, buf + (len & ~7), len & 7);
+        return ((u64)hash32(buf, len, HASH_CONST) << 32 | hash32(buf, len, ~HASH_CONST)) ^
+               (tail * 0x9e3779b97f4a7c15ULL);
+    }
+
+    void memoPut(u64 key, double val, s8 status)
+    {
+        if (memo.size() >= LBFGS_MEMO_SIZE)
+            memo.clear();
+        memo[key] = {val, status};
+    }
+
+    // Called with the result of save_branch_hit(): statuses are relative to
+    // the snapshot, so a new one invalidates everything measured so far.
+    void snapshot(u8 changed)
+    {
+        if (changed)
+            memo.clear();
+    }
+
+    // Objective of out_buf, running the target only if these bytes have not
+    // been measured yet. withState forces a run unless the fuzzer still
+    // holds the branch state of exactly these bytes.
+    double evaluate(bool withState = false)
+    {
+        u64 key = memoKey(out_buf, len);
+        auto it = memo.find(key);
+
+        if (it != memo.end() && (!withState || key == stateKey))
+        {
+            lastStatus = it->second.status;
+            if (withState)
+                anchorVal = it->second.val;
+            return it->second.val;
+        }
+
+        if (execs >= budget)
+        {
+            spent = true;
+            lastStatus = BR_UNCHANGED;
+            return anchorVal;
+        }
 
-    FuzzProb(int len) : Superclass(len) {}
+        common_fuzz_stuff(argv, out_buf, len);
+        execs++;
+        double v = calculate_obj_func();
+        lastStatus = check_branch_hit();
+        stateKey = key;
+        memoPut(key, v, lastStatus);
+        track(v);
+        if (withState)
+            anchorVal = v;
+        return v;
+    }
 
     double value(const TVector &x)
+    {
+        materialize(x);
+        return evaluate();
+    }
+
+    // value() for a point whose branch state is about to be saved.
+    double valueWithState(const TVector &x)
+    {
+        materialize(x);
+        return evaluate(true);
+    }
+
+    void materialize(const TVector &x)
     {
 #ifdef MAXAFL_DEBUG
         // cerr << "current    " << x.transpose() << endl;
@@ -81,9 +212,106 @@ public:
             if (pIdx != -1)
                 out_buf[pIdx] = (u8)(s8)x[pIdx];
         }
+    }
 
-        common_fuzz_stuff(argv, out_buf, len);
-        return calculate_obj_func();
+    // Run x with x[d] shifted by each of steps for every d in dims, handing
+    // up to LBFGS_BATCH_SIZE unmeasured probes at a time to
+    // common_fuzz_batch(). Results for dims[k] land in
+    // probe_vals/probe_status[k * steps.size() + s]. Probes past the exec
+    // budget are not run and keep vx, i.e. a zero derivative.
+    // out_buf must hold x and is left untouched.
+    void probe(const TVector &x, double vx, const vector<TIndex> &dims, const std::vector<Scalar> &steps, Scalar eps)
+    {
+        size_t n = dims.size() * steps.size(), i, k = 0;
+        double vals[LBFGS_BATCH_SIZE];
+        s8 status[LBFGS_BATCH_SIZE];
+        size_t slot[LBFGS_BATCH_SIZE];
+        u64 keys[LBFGS_BATCH_SIZE];
+
+        probe_vals.assign(n, vx);
+        probe_status.assign(n, BR_UNCHANGED);
+
+        if (batch_bufs.empty())
+        {
+            batch_mem.resize((size_t)LBFGS_BATCH_SIZE * len);
+            for (k = 0; k < LBFGS_BATCH_SIZE; k++)
+                batch_bufs.push_back(&batch_mem[k * len]);
+            k = 0;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            TIndex d = dims[i / steps.size()];
+            u8 *buf = batch_bufs[k];
+
+            memcpy(buf, out_buf, len);
+            buf[d] = (u8)(s8)(x[d] + steps[i % steps.size()] * eps);
+
+            u64 key = memoKey(buf, len);
+            auto it = memo.find(key);
+
+            if (it != memo.end())
+            {
+                probe_vals[i] = it->second.val;
+                probe_status[i] = it->second.status;
+            }
+            else
+            {
+                slot[k] = i;
+                keys[k++] = key;
+            }
+
+            if (k == LBFGS_BATCH_SIZE || (i + 1 == n && k))
+            {
+                if (execs + k > budget)
+                {
+                    spent = true;
+                    k = execs < budget ? budget - execs : 0;
+                    if (!k)
+                        break;
+                }
+
+                common_fuzz_batch(argv, batch_bufs.data(), len, k, vals, status);
+                execs += k;
+                stateKey = 0;
+                while (k--)
+                {
+                    probe_vals[slot[k]] = vals[k];
+                    probe_status[slot[k]] = status[k];
+                    memoPut(keys[k], vals[k], status[k]);
+                    track(vals[k]);
+                }
+                k = 0;
+                if (spent)
+                    break;
+            }
+        }
+    }
+
+    // Invert each group of LBFGS_SPARSE_GROUP bytes at once and keep only the
+    // groups that move the objective or the branch status. The other bytes
+    // get a zero gradient and are never probed again during this solve.
+    // out_buf must hold x on entry and holds it again on return.
+    void detect_sensitivity(const TVector &x, double vx)
+    {
+        int i, g, end;
+
+        sens.assign(len, 0);
+        for (g = 0; g < len; g += LBFGS_SPARSE_GROUP)
+        {
+            end = g + LBFGS_SPARSE_GROUP < len ? g + LBFGS_SPARSE_GROUP : len;
+            for (i = g; i < end; i++)
+                out_buf[i] ^= 0xff;
+
+            double v = evaluate();
+
+            for (i = g; i < end; i++)
+                out_buf[i] = (u8)(s8)x[i];
+
+            if (v != vx || lastStatus != BR_UNCHANGED)
+                for (i = g; i < end; i++)
+                    sens[i] = 1;
+        }
     }
 
     void gradient(const TVector &x, TVector &grad)
@@ -101,48 +329,44 @@ public:
             static const std::array<Scalar, 4> dd = {2, 12, 60, 840};
 
             grad.resize(x.rows());
-            TVector &xx = const_cast<TVector &>(x);
 
             mIdx = pIdx = -1;
             // maxIdx = -1;
             // maxGrad = -1;
             double vx = value(x);
+            if (sparse && firstMove)
+                detect_sensitivity(x, vx);
 
             const int innerSteps = 2 * (accuracy + 1);
             const Scalar ddVal = dd[accuracy] * eps;
 
+            vector<TIndex> dims;
             for (TIndex d = 0; d < x.rows(); d++)
             {
                 if (grad[d] == 0 && !firstMove)
                 {
                     continue;
                 }
+                if (sparse && !sens[d])
+                {
+                    grad[d] = 0;
+                    continue;
+                }
+                dims.push_back(d);
+            }
+            probe(x, vx, dims, coeff2[accuracy], eps);
+
+            for (size_t k = 0; k < dims.size(); k++)
+            {
+                TIndex d = dims[k];
+                double *vxx = &probe_vals[k * innerSteps];
 
                 grad[d] = 0;
-                pIdx = mIdx;
-                mIdx = d;
-                double vxx[2] = {
-                    0,
-                };
                 for (int s = 0; s < innerSteps; ++s)
                 {
-                    Scalar tmp = xx[d];
-                    xx[d] += coeff2[accuracy][s] * eps;
-                    vxx[s] = value(xx);
-
-                    // #ifdef MAXAFL_DEBUG
-                    //                     cerr << "[DBG]\tcheck_branch_hit() is called from gradient() with d = " << d << ", s = " << s << endl;
-                    // #endif
-                    char chk = check_branch_hit();
+                    char chk = probe_status[k * innerSteps + s];
                     if (chk != BR_UNCHANGED)
                         vxx[s] = chk;
-                    // else
-                    // #ifdef MAXAFL_DEBUG
-                    //                         cerr << endl
-                    //                              << "[DBG]\toriginal f = " << vx << "\t, changed f = " << vxx[s] << endl;
-                    // #endif
-
-                    xx[d] = tmp;
                 }
 
                 // *Calculate gradient depends on case
@@ -235,37 +459,42 @@ public:
             static const std::array<Scalar, 4> dd = {2, 12, 60, 840};
 
             grad.resize(x.rows());
-            TVector &xx = const_cast<TVector &>(x);
 
             mIdx = pIdx = -1;
             // maxIdx = -1;
             // maxGrad = -1;
             double vx = value(x);
+            if (sparse && firstMove)
+                detect_sensitivity(x, vx);
 
             const int innerSteps = 2 * (accuracy + 1);
             const Scalar ddVal = dd[accuracy] * eps;
 
+            vector<TIndex> dims;
             for (TIndex d = 0; d < x.rows(); d++)
             {
                 if (grad[d] == 0 && !firstMove)
                 {
                     continue;
                 }
+                if (sparse && !sens[d])
+                {
+                    grad[d] = 0;
+                    continue;
+                }
+                dims.push_back(d);
+            }
+            probe(x, vx, dims, coeff2[accuracy], eps);
+
+            for (size_t k = 0; k < dims.size(); k++)
+            {
+                TIndex d = dims[k];
+                double *vxx = &probe_vals[k * innerSteps];
 
-                pIdx = mIdx;
-                mIdx = d;
-                double vxx[2] = {
-                    0,
-                };
                 for (int s = 0; s < innerSteps; ++s)
                 {
-                    Scalar tmp = xx[d];
-                    xx[d] += coeff2[accuracy][s] * eps;
-                    vxx[s] = value(xx);
-                    char chk = check_branch_hit();
-                    if (chk != BR_UNCHANGED)
+                    if (probe_status[k * innerSteps + s] != BR_UNCHANGED)
                         vxx[s] = vx;
-                    xx[d] = tmp;
                 }
 
                 grad[d] = (coeff[accuracy][0] * vxx[0] + coeff[accuracy][1] * vxx[1]) / ddVal;
@@ -310,8 +539,16 @@ public:
 
             if (firstMove)
             {
+                if (sparse)
+                    detect_sensitivity(x, value(x));
+
                 for (TIndex d = 0; d < x.rows(); d++)
                 {
+                    if (sparse && !sens[d])
+                    {
+                        grad[d] = 0;
+                        continue;
+                    }
                     pIdx = mIdx;
                     mIdx = d;
                     grad[d] = 0;
@@ -324,6 +561,7 @@ public:
                     }
                     grad[d] /= ddVal;
                 }
+                mIdx = pIdx = -1;
             }
             // else
             // {
@@ -335,6 +573,8 @@ public:
             << "Gradient : \n"
             << grad.transpose() << endl;
 #endif
+        for (TIndex d = 0; d < grad.rows() && d < (TIndex)sensMag.size(); d++)
+            sensMag[d] += fabs(grad[d]);
         firstMove = false;
     }
 };
@@ -346,6 +586,81 @@ class GradientDescentFuzzSolver : public GradientDescentSolver<ProblemType>
     using typename Superclass::Scalar;
     using typename Superclass::TVector;
 
+    // Bytes the steepest coordinate moved in the last accepted byte step
+    int byteStep = 1;
+
+    // Put x0 - (k / max|direction|) * direction, rounded and clamped to bytes,
+    // into cand, so that the steepest coordinate moves by exactly k.
+    void byteCandidate(const TVector &x0, const TVector &direction, Scalar maxAbs, int k, TVector &cand)
+    {
+        for (int i = 0; i < x0.rows(); i++)
+            cand[i] = maxd(0, mind(255, round(x0[i] - k * direction[i] / maxAbs)));
+    }
+
+    // Byte-delta line search. Starts from the step that was accepted last
+    // time, doubles it while the objective keeps dropping and halves it on
+    // overshoot (a worse value or a branch that went wrong). Candidates that
+    // round to a byte vector already measured are skipped without running
+    // the target. A step that flips a branch is taken at once. Returns
+    // false when no step of at least one byte improves on fx; otherwise x0
+    // and fx hold the accepted point.
+    bool byteLineSearch(ProblemType &objFunc, TVector &x0, const TVector &direction, double &fx)
+    {
+        Scalar maxAbs = direction.template lpNorm<Eigen::Infinity>();
+        TVector best = x0, cand(x0.rows()), last = x0;
+        double bestF = fx;
+        bool grow = true, moved = false;
+        int k = byteStep;
+
+        if (maxAbs == 0)
+            return false;
+
+        for (int tries = 0; tries < LBFGS_LS_MAX_TRY && k >= 1 && k <= 255;)
+        {
+            byteCandidate(x0, direction, maxAbs, k, cand);
+            if (cand == last || cand == x0 || (moved && cand == best))
+            {
+                k = grow ? k * 2 : k / 2;
+                continue;
+            }
+
+            objFunc.mIdx = objFunc.pIdx = -1;
+            double f2 = objFunc.value(cand);
+            char chk = objFunc.lastStatus;
+            last = cand;
+            tries++;
+
+            if (chk == BR_CHANGED)
+            {
+                best = cand, bestF = f2, moved = true, byteStep = k;
+                break;
+            }
+            if (chk == BR_WRONG || f2 >= bestF)
+            {
+                if (moved)
+                    break;
+                grow = false;
+                k /= 2;
+                continue;
+            }
+
+            best = cand, bestF = f2, moved = true, byteStep = k;
+            if (!grow)
+                break;
+            k *= 2;
+        }
+
+        if (!moved)
+        {
+            byteStep = 1;
+            return false;
+        }
+
+        x0 = best;
+        fx = bestF;
+        return true;
+    }
+
     // Override
 public:
     void minimize(ProblemType &objFunc, TVector &x0)
@@ -355,16 +670,17 @@ public:
         objFunc.firstMove = true;
         Scalar rate = LBFGS_INITIAL_RATE;
         s8 flag = 0;
+        byteStep = 1;
         do
         {
             objFunc.mIdx = objFunc.pIdx = -1;
-            double origin_f = objFunc.value(x0);
+            double origin_f = objFunc.valueWithState(x0);
 #ifdef _MAXAFL_DEBUG
             std::cerr << "Input : " << x0.transpose() << std::endl;
             std::cerr << "F\t:\t" << origin_f << std::endl;
 #endif
             std::cerr << "F : " << origin_f << std::endl;
-            save_branch_hit();
+            objFunc.snapshot(save_branch_hit());
             u32 r = UR2(100);
             if (objFunc.prob == PROB_MODE_EPSILON && this->m_current.iterations > 10 && r < EPSILON_BITFLIP + EPSILON_NORMAL)
             {
@@ -408,7 +724,17 @@ public:
                 objFunc.gradient(x0, direction);
                 // const Scalar rate = MoreThuente<ProblemType, 1>::linesearch(x0, -direction, objFunc);
 
-                if (objFunc.mode == LBFGS_MODE_BOUND)
+                if (objFunc.lsearch == LINE_SEARCH_BYTE)
+                {
+                    delta = x0;
+                    if (!byteLineSearch(objFunc, x0, direction, origin_f))
+                        break;
+                    if (objFunc.prob != PROB_MODE_NONE)
+                    {
+                        norm = norm + (delta - x0);
+                    }
+                }
+                else if (objFunc.mode == LBFGS_MODE_BOUND)
                 {
                     // // rate = MoreThuente<ProblemType, 1>::linesearch(x0, -direction, objFunc);
                     // // x0 = x0 - rate * direction;
@@ -437,7 +763,7 @@ public:
                             flag = -1;
                             x0 = x0 + rate * direction;
                         }
-                        else if (check_branch_hit() != BR_UNCHANGED)
+                        else if (objFunc.lastStatus != BR_UNCHANGED)
                         {
                             if (flag == -1)
                             {
@@ -499,16 +825,177 @@ public:
     }
 };
 
-Criteria<double> criteria;
+// Up to LBFGS_DF_MAX_DIM bytes of a FuzzProb point, for the derivative-free
+// solvers. Coordinates of y are byte values, rounded and clamped to [0, 255]
+// before the target runs. A point that sends a branch the wrong way costs
+// more than the starting point; one that flips the target branch ends the
+// solve. The best point seen is kept, as CMA-ES hands back its mean.
+class ByteSubspace : public Problem<double>
+{
+public:
+    FuzzProb &prob;
+    vector<int> dims;
+    FuzzProb::TVector x;
+    TVector best;
+    double bestF, penalty;
+    bool flipped = false;
+
+    ByteSubspace(FuzzProb &prob, const FuzzProb::TVector &x, double fx)
+        : prob(prob), x(x), bestF(fx), penalty(fx + LBFGS_GRAD_MAX) {}
+
+    TVector project() const
+    {
+        TVector y(dims.size());
+        for (size_t i = 0; i < dims.size(); i++)
+            y[i] = x[dims[i]];
+        return y;
+    }
+
+    void expand(const TVector &y)
+    {
+        for (size_t i = 0; i < dims.size(); i++)
+            x[dims[i]] = maxd(0, mind(255, round(y[i])));
+    }
+
+    double value(const TVector &y)
+    {
+        expand(y);
+        prob.mIdx = prob.pIdx = -1;
+        double v = prob.value(x);
+
+        if (prob.lastStatus == BR_WRONG)
+            return penalty;
+        if (prob.lastStatus == BR_CHANGED && !flipped)
+        {
+            flipped = true;
+            best = y, bestF = v;
+        }
+        else if (!flipped && v < bestF)
+            best = y, bestF = v;
+        return v;
+    }
+
+    bool callback(const Criteria<Scalar> &, const TVector &)
+    {
+        return !flipped && prob.progressing();
+    }
+};
+
+template <typename ProblemType>
+class CMAesFuzzSolver : public CMAesSolver<ProblemType>
+{
+public:
+    using typename CMAesSolver<ProblemType>::TVector;
+
+    // The stock step size of 0.5 never leaves the starting byte vector.
+    void minimize(ProblemType &objFunc, TVector &x0)
+    {
+        this->m_stepSize = LBFGS_CMAES_SIGMA;
+        CMAesSolver<ProblemType>::minimize(objFunc, x0);
+    }
+};
+
+template <typename ProblemType>
+class NelderMeadFuzzSolver : public NelderMeadSolver<ProblemType>
+{
+public:
+    using typename NelderMeadSolver<ProblemType>::TVector;
+
+    // The stock simplex only moves each vertex by 5%, mostly less than a
+    // byte. Step LBFGS_NM_STEP towards the middle of the byte range instead.
+    void minimize(ProblemType &objFunc, TVector &x)
+    {
+        int n = x.rows();
+
+        this->x0 = x.replicate(1, n + 1);
+        for (int i = 0; i < n; i++)
+            this->x0(i, i + 1) += x[i] < 128 ? LBFGS_NM_STEP : -LBFGS_NM_STEP;
+        this->initialSimplexCreated = true;
+        NelderMeadSolver<ProblemType>::minimize(objFunc, x);
+    }
+};
+
+Criteria<double> criteria, criteria_cmaes, criteria_nm;
 
 FuzzProb *f = NULL;
 LbfgsbSolver<FuzzProb> solver;
 LbfgsSolver<FuzzProb> solver2;
 GradientDescentFuzzSolver<FuzzProb> solver3;
+CMAesFuzzSolver<ByteSubspace> solver_cmaes;
+NelderMeadFuzzSolver<ByteSubspace> solver_nm;
+
+// Run CMA-ES or Nelder-Mead over the bytes of x that move the objective, at
+// most LBFGS_DF_MAX_DIM of them picked at random, and leave the best point
+// found in x.
+static void solve_subspace(FuzzProb::TVector &x)
+{
+    f->mIdx = f->pIdx = -1;
+    double fx = f->valueWithState(x);
+    f->snapshot(save_branch_hit());
+
+    ByteSubspace sub(*f, x, fx);
+
+    f->detect_sensitivity(x, fx);
+    for (int i = 0; i < f->len; i++)
+        if (f->sens[i])
+        {
+            sub.dims.push_back(i);
+            f->sensMag[i] += LBFGS_DEFAULT_GRAD;
+        }
+    if (sub.dims.empty())
+        for (int i = 0; i < f->len; i++)
+            sub.dims.push_back(i);
+    while (sub.dims.size() > LBFGS_DF_MAX_DIM)
+    {
+        u32 k = UR2(sub.dims.size());
+        sub.dims[k] = sub.dims.back();
+        sub.dims.pop_back();
+    }
+
+    ByteSubspace::TVector y = sub.project();
+    sub.best = y;
+
+    if (f->solver == SOLVER_CMAES)
+        solver_cmaes.minimize(sub, y);
+    else
+        solver_nm.minimize(sub, y);
+
+    sub.expand(sub.best);
+    x = sub.x;
+}
 
 vector<FuzzSampling *> fuzz_dist;
 
-extern "C" int init_lbfgs(char **argv, u8 *out_buf, s32 len, int stage, int accuracy, int mode, int prob)
+// Fold the byte sensitivity measured by the current solve into map, one
+// entry per GRAD_MAP_BLOCK bytes of a len byte input. Entries are
+// log-scaled so the most sensitive block of the solve maps to 255, and
+// keep the larger of the old and new value. Returns the number of entries.
+extern "C" u32 export_sensitivity(u8 *map, u32 len)
+{
+    u32 n = (len + GRAD_MAP_BLOCK - 1) / GRAD_MAP_BLOCK, i;
+    vector<double> block(n, 0);
+    double top = 0;
+
+    for (i = 0; i < len && i < f->sensMag.size(); i++)
+        block[i / GRAD_MAP_BLOCK] += f->sensMag[i];
+
+    for (i = 0; i < n; i++)
+        top = maxd(top, block[i]);
+
+    if (top == 0)
+        return n;
+
+    for (i = 0; i < n; i++)
+    {
+        u8 w = (u8)(255 * log1p(block[i]) / log1p(top));
+        if (w > map[i])
+            map[i] = w;
+    }
+
+    return n;
+}
+
+extern "C" int init_lbfgs(char **argv, u8 *out_buf, s32 len, int stage, int accuracy, int mode, int prob, int solver_id)
 {
 
     f = new FuzzProb(len);
@@ -532,13 +1019,27 @@ extern "C" int init_lbfgs(char **argv, u8 *out_buf, s32 len, int stage, int accu
     f->stage = stage;
     f->mode = mode;
     f->prob = prob;
+    f->sparse = grad_mode_cur == GRAD_MODE_SPARSE;
+    f->lsearch = line_search_cur;
+    f->solver = solver_id;
+    f->budget = lbfgs_budget;
 
     criteria.iterations = LBFGS_ITERATION_MAX;
     criteria.gradNorm = LBFGS_GRAD_NORM_MIN;
 
-    // solver1.setStopCriteria(criteria);
+    // Sub-byte moves change nothing, so the derivative-free solvers stop on
+    // iterations, budget or (Nelder-Mead) a simplex narrower than a byte.
+    criteria_cmaes = Criteria<double>::defaults();
+    criteria_cmaes.iterations = LBFGS_ITERATION_MAX;
+    criteria_cmaes.gradNorm = 0;
+    criteria_nm = criteria_cmaes;
+    criteria_nm.xDelta = 0.5;
+
+    solver.setStopCriteria(criteria);
     // solver2.setStopCriteria(criteria);
     solver3.setStopCriteria(criteria);
+    solver_cmaes.setStopCriteria(criteria_cmaes);
+    solver_nm.setStopCriteria(criteria_nm);
 
     // solver.setDebug(DebugLevel::High);
     // solver2.setDebug(DebugLevel::High);
@@ -566,14 +1067,30 @@ extern "C" double solve_lbfgs(u8 *in_buf, int len)
         }
     }
 
-    // f->value(x);
-    // save_branch_hit();
-
-    // solver.minimize(*f, x);
-    // solver2.minimize(*f, x);
-    // cerr << "m_status : " << solver2.status() << endl;
-    solver3.minimize(*f, x);
-    // cerr << "m_status : " << solver3.status() << endl;
+    f->execs = 0;
+    f->spent = false;
+    f->anchorVal = HUGE_VAL;
+    f->bestVal = HUGE_VAL;
+    f->improved = false;
+    f->stall = 0;
+    switch (f->solver)
+    {
+    case SOLVER_LBFGSB:
+        // GradientDescentFuzzSolver takes its own branch snapshots
+        f->firstMove = true;
+        f->mIdx = f->pIdx = -1;
+        f->valueWithState(x);
+        f->snapshot(save_branch_hit());
+        solver.minimize(*f, x);
+        break;
+    case SOLVER_CMAES:
+    case SOLVER_NM:
+        solve_subspace(x);
+        break;
+    default:
+        solver3.minimize(*f, x);
+        // cerr << "m_status : " << solver3.status() << endl;
+    }
     fx = (*f)(x);
 #ifdef MAXAFL_DEBUG
     cerr << "argmin    " << x.transpose() << endl;
@@ -10,15 +10,18 @@
 #include "cppoptlib/solver/lbfgsbsolver.h"
 #include "cppoptlib/solver/lbfgssolver.h"
 #include "cppoptlib/solver/gradientdescentsolver.h"
+#include "cppoptlib/solver/cmaessolver.h"
+#include "cppoptlib/solver/neldermeadsolver.h"
 #include "eigen3/Eigen/StdVector"
 
 extern "C"
 {
 #endif
 
-    int init_lbfgs(char **argv, u8 *out_buf, s32 len, int stage, int accuracy, int mode, int prob);
+    int init_lbfgs(char **argv, u8 *out_buf, s32 len, int stage, int accuracy, int mode, int prob, int solver_id);
     int free_lbfgs();
     double solve_lbfgs(u8 *in_buf, int len);
+    u32 export_sensitivity(u8 *map, u32 len);
     int init_normal_sampling(u8 *mean, int len, double stddev);
     int free_normal_sampling(int len);
     void modify_dist(u8 *mean, int len);
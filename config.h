@@ -276,15 +276,14 @@
 #define SHM_ENV_VAR "__AFL_SHM_ID"
 // #define SHM_ENV_VAR_MAX "__MAXAFL_SHM_ID"
 // #define SHM_ENV_VAR_PTR "__MAXAFL_SHM_PTR_ID"
-#define SHM_ENV_VAR_BR_INFO "__MAXAFL_SHM_BR_INFO"
-#define SHM_ENV_VAR_BR_PTR "__MAXAFL_SHM_BR_PTR"
-#define SHM_ENV_VAR_BR_HIT "__MAXAFL_SHM_BR_HIT"
-#define SHM_ENV_VAR_CMP_INFO "__MAXAFL_SHM_CMP_INFO"
-#define SHM_ENV_VAR_CMP_PTR "__MAXAFL_SHM_CMP_PTR"
-#define SHM_ENV_VAR_CMP_HIT "__MAXAFL_SHM_CMP_HIT"
-#define SHM_ENV_VAR_CMPVEC "__MAXAFL_SHM_CMPVEC"
+#define SHM_ENV_VAR_STATE "__MAXAFL_SHM_STATE"
 #define SHM_ENV_VAR_EXIT_PENALTY "__MAXAFL_SHM_EXIT_PENALTY"
 
+/* Test case channel for targets built with __AFL_FUZZ_TESTCASE_BUF: a u32
+   length followed by up to MAX_FILE bytes of data. */
+
+#define SHM_ENV_VAR_INPUT "__AFL_SHM_INPUT_ID"
+
 /* Other less interesting, internal-only variables. */
 
 #define CLANG_ENV_VAR "__AFL_CLANG_MODE"
@@ -296,6 +295,7 @@
 
 #define PERSIST_SIG "##SIG_AFL_PERSISTENT##"
 #define DEFER_SIG "##SIG_AFL_DEFER_FORKSRV##"
+#define SHM_INPUT_SIG "##SIG_AFL_SHM_INPUT##"
 
 /* Distinctive bitmap signature used to indicate failed execution: */
 
@@ -369,12 +369,8 @@
 // MAXAFL_CONFIG
 #define MAXAFL_VERSION "1.01"
 
-#define MAXAFL_MX_MODULE 300
-#define PTR_SIZE MAXAFL_MX_MODULE * sizeof(u32)
-// #define PTR_SIZE MAXAFL_MX_MODULE * sizeof(maxafl_info_t *)
-
-#define MAXAFL_MX_HIT 100000
-#define HIT_SIZE MAXAFL_MX_HIT * sizeof(u32)
+// Module tables, hit lists and cmp vectors are sized from the info file;
+// see maxafl_shm_hdr_t in types.h.
 
 // #define MAXAFL_MX_CMP 10000
 // // #define MAXAFL_INFO_SIZE 28
@@ -382,15 +378,6 @@
 // #define INFO_SIZE MAXAFL_MX_CMP *MAXAFL_INFO_SIZE
 // typedef u32 maxafl_mxexp_instr_t;
 
-#define MAXAFL_MX_BR 100000
-#define MAXAFL_BR_INFO_SIZE MAXAFL_MX_BR * sizeof(br_info_t)
-
-#define MAXAFL_MX_CMP 100000
-#define MAXAFL_CMP_INFO_SIZE MAXAFL_MX_CMP * sizeof(cmp_info_t)
-
-#define MAXAFL_MX_CMPVEC MAXAFL_MX_BR * 3 * 5
-#define MAXAFL_CMPVEC_SIZE MAXAFL_MX_CMPVEC * sizeof(s16)
-
 // Height in cost function
 #define MAXAFL_COST_H 20
 
@@ -419,9 +406,118 @@
 #define LBFGS_ITERATION_MAX 50
 #define LBFGS_GRAD_NORM_MIN 1e-3
 
+// gradient estimation: probe every byte, or only the bytes whose groups
+// were found to move the objective when the solve started
+#define GRAD_MODE_DENSE 1
+#define GRAD_MODE_SPARSE 2
+#define GRAD_MODE_DEFAULT GRAD_MODE_DENSE
+
+// bytes inverted together while probing sensitivity in GRAD_MODE_SPARSE
+#define LBFGS_SPARSE_GROUP 16
+
+// gradient probes handed to common_fuzz_batch() at once
+#define LBFGS_BATCH_SIZE 64
+
+// objective values remembered per solve, keyed by input hash; the cache is
+// flushed when full or when the branch snapshot changes
+#define LBFGS_MEMO_SIZE 4096
+
+// upper bound for the gradient worker pool (-j)
+#define MAXAFL_MX_POOL 64
+
 #define LBFGS_INITIAL_RATE 0.1
 #define LBFGS_GAMMA 0.7
 
+// line search: fixed LBFGS_INITIAL_RATE step (with backtracking in BOUND
+// mode), or steps measured in whole bytes moved by the steepest coordinate
+#define LINE_SEARCH_FIXED 1
+#define LINE_SEARCH_BYTE 2
+#define LINE_SEARCH_DEFAULT LINE_SEARCH_FIXED
+
+// executions the byte line search may spend per descent iteration
+#define LBFGS_LS_MAX_TRY 8
+
+// solver run by the lbfgs stage (-s); SOLVER_ROTATE takes them in turn,
+// one queue entry each
+#define SOLVER_ROTATE 0
+#define SOLVER_GD 1
+#define SOLVER_LBFGSB 2
+#define SOLVER_CMAES 3
+#define SOLVER_NM 4
+#define SOLVER_CNT 4
+#define SOLVER_DEFAULT SOLVER_GD
+
+// target executions a single solve may spend, whichever solver runs it
+#define LBFGS_EXEC_BUDGET 16384
+
+// the budget of a solve is scaled by the perf score of the queue entry and
+// by the stage's finds per exec against the whole fuzzer's, within these
+// bounds, then cut so the stage stays around LBFGS_STAGE_MS per entry
+#define LBFGS_BUDGET_MIN_MUL 0.125
+#define LBFGS_BUDGET_MAX_MUL 4.0
+#define LBFGS_BUDGET_MIN 64
+#define LBFGS_STAGE_MS 5000
+
+// a solve stops once its objective has not dropped by LBFGS_STALL_EPS
+// (relative) for LBFGS_STALL_ITERS solver iterations
+#define LBFGS_STALL_ITERS 3
+#define LBFGS_STALL_EPS 1e-3
+
+// what the lbfgs stage optimizes (-r): every branch the seed hits at once,
+// or one frontier branch at a time (hit, wanted side never taken, and
+// closest to flipping from this seed among all queue entries); frontier
+// mode skips the stage for entries that seed no frontier branch, so it is
+// opt-in
+#define SCHED_MODE_ALL 1
+#define SCHED_MODE_FRONTIER 2
+#define SCHED_MODE_DEFAULT SCHED_MODE_ALL
+
+// frontier branches solved per queue entry, the executions each solve may
+// spend, and how often a (branch, seed) pair is retried without progress
+#define FRONTIER_PICK 4
+#define FRONTIER_EXEC_BUDGET 2048
+#define FRONTIER_MAX_TRIES 2
+
+// objective of an exec that does not reach the targeted frontier branch
+#define FRONTIER_MISS_COST 1e9
+
+// branch registry written to out_dir with the stats, reloaded on in-place
+// resume and merged from the other instances by sync_fuzzers()
+#define REGISTRY_NAME "maxafl_registry"
+#define REGISTRY_MAGIC 0x4752584d /* "MXRG" */
+#define REGISTRY_VERSION 1
+
+// stage selection (-k): the fixed lbfgs + havoc order, or a bandit that
+// runs the lbfgs and deterministic stages of a new entry with a
+// probability following their finds per exec, and trims havoc likewise
+#define STAGE_SCHED_FIXED 1
+#define STAGE_SCHED_BANDIT 2
+#define STAGE_SCHED_DEFAULT STAGE_SCHED_FIXED
+
+// bandit: prior execs per stage (a hundred times more for the costly
+// deterministic stages, so they start at the BANDIT_MIN_PROB floor and have
+// to earn their runs), the floor on a stage's run probability, the smallest
+// share of havoc cycles kept, and the execs after which the history of a
+// stage is halved to follow the current phase of the run
+#define BANDIT_PRIOR_EXECS 10000
+#define BANDIT_DET_PRIOR_EXECS 1000000
+#define BANDIT_MIN_PROB 0.05
+#define BANDIT_HAVOC_MIN_MUL 0.25
+#define BANDIT_WINDOW 1000000
+
+// gradient maps kept per queue entry: input bytes per map entry, and how
+// often a havoc tweak lands on an offset drawn by gradient weight rather
+// than uniformly
+#define GRAD_MAP_BLOCK 4
+#define GRAD_HAVOC_PERC 50
+
+// bytes searched at once by the derivative-free solvers (CMA-ES, NM)
+#define LBFGS_DF_MAX_DIM 32
+
+// initial CMA-ES step size and Nelder-Mead simplex edge, in byte values
+#define LBFGS_CMAES_SIGMA 16.0
+#define LBFGS_NM_STEP 16
+
 #define OBJ_MODE_ORIGIN 1
 #define OBJ_MODE_ADP1 2
 #define OBJ_MODE_ADP2 3
@@ -449,8 +545,6 @@
 // #define _MAXAFL_DEBUG
 #define MAXAFL_RELEASE
 
-#define TOPK 100
-
 // count of Normal Distribution sampling in one stage
 // #define NORMAL_DIST_LOOP 1
 
@@ -39,11 +39,16 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+
+#include <sys/wait.h>
 
 static u8 *obj_path;       /* Path to runtime libraries         */
 static u8 **cc_params;     /* Parameters passed to the real CC  */
 static u32 cc_par_cnt = 1; /* Param count, including argv0      */
 
+static u8 lto_link;        /* Final link of a MAXAFL_LTO build  */
+
 /* Try to find the runtime libraries. If that fails, abort. */
 
 static void find_obj(u8 *argv0)
@@ -100,12 +105,177 @@ static void find_obj(u8 *argv0)
   FATAL("Unable to find 'afl-llvm-rt.o' or 'afl-llvm-pass.so'. Please set AFL_PATH");
 }
 
+/* Check for an LLVM bitcode file, raw or in its wrapper header. */
+
+static u8 is_bitcode(u8 *path)
+{
+
+  u8 magic[4];
+  s32 fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return 0;
+
+  if (read(fd, magic, 4) != 4)
+    magic[0] = 0;
+
+  close(fd);
+
+  return (magic[0] == 'B' && magic[1] == 'C' && magic[2] == 0xC0 &&
+          magic[3] == 0xDE) ||
+         (magic[0] == 0xDE && magic[1] == 0xC0 && magic[2] == 0x17 &&
+          magic[3] == 0x0B);
+}
+
+/* Check for a source file clang would compile on the link command line. */
+
+static u8 is_source(u8 *path)
+{
+
+  static const char *exts[] = {".c", ".cc", ".cpp", ".cxx", ".c++", ".C",
+                               ".m", ".mm", ".i", ".ii", NULL};
+  u8 *ext = strrchr(path, '.');
+  u32 i;
+
+  if (!ext || *path == '-')
+    return 0;
+
+  for (i = 0; exts[i]; i++)
+    if (!strcmp(ext, exts[i]))
+      return 1;
+
+  return 0;
+}
+
+/* Run a helper tool to completion, aborting the build if it fails. */
+
+static void run_tool(u8 **args)
+{
+
+  s32 status;
+  pid_t pid = fork();
+
+  if (pid < 0)
+    PFATAL("fork() failed");
+
+  if (!pid)
+  {
+    execvp(args[0], (char **)args);
+    PFATAL("Oops, failed to execute '%s' - check your PATH", args[0]);
+  }
+
+  if (waitpid(pid, &status, 0) <= 0)
+    PFATAL("waitpid() failed");
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    FATAL("'%s' failed, aborting the MAXAFL_LTO link", args[0]);
+}
+
+/* Whole-program link for MAXAFL_LTO. The objects were compiled to bitcode
+   with -flto; here they are merged with llvm-link, instrumented once by
+   "opt -lowerswitch -maxafl_pass" and handed back to clang as a single .bc
+   in place of the originals. This uses the legacy pass registered for opt,
+   so it works on every LLVM the pass builds with. Returns the edited argv
+   and updates argc to match. */
+
+static char **lto_prelink(int *argc_p, char **argv)
+{
+
+  u8 *link_tool = getenv("MAXAFL_LLVM_LINK");
+  u8 *opt_tool = getenv("MAXAFL_OPT");
+  u8 *out_file = "a.out", *linked, *instr;
+  u8 **link_args, **opt_args;
+  char **new_argv;
+  u32 i, link_cnt = 0, new_cnt = 0;
+  u32 argc = *argc_p;
+  u8 bc_placed = 0;
+
+  link_args = ck_alloc((argc + 8) * sizeof(u8 *));
+  new_argv = ck_alloc((argc + 1) * sizeof(char *));
+
+  link_args[link_cnt++] = link_tool ? link_tool : (u8 *)"llvm-link";
+
+  for (i = 1; i < argc; i++)
+    if (!strcmp(argv[i], "-o") && i + 1 < argc)
+      out_file = argv[i + 1];
+
+  linked = alloc_printf("%s.lto.bc", out_file);
+  instr = alloc_printf("%s.maxafl.bc", out_file);
+
+  new_argv[new_cnt++] = argv[0];
+
+  for (i = 1; i < argc; i++)
+  {
+
+    u8 *cur = argv[i];
+
+    if (!strcmp(cur, "-o") && i + 1 < argc)
+    {
+      new_argv[new_cnt++] = argv[i++];
+      new_argv[new_cnt++] = argv[i];
+      continue;
+    }
+
+    if (is_source(cur))
+      FATAL("MAXAFL_LTO needs separate compile (-c) and link steps, got '%s'",
+            cur);
+
+    if (*cur != '-' && is_bitcode(cur))
+    {
+
+      link_args[link_cnt++] = cur;
+
+      if (!bc_placed)
+      {
+        new_argv[new_cnt++] = instr;
+        bc_placed = 1;
+      }
+
+      continue;
+    }
+
+    new_argv[new_cnt++] = cur;
+  }
+
+  new_argv[new_cnt] = NULL;
+
+  if (!bc_placed)
+    FATAL("MAXAFL_LTO is set, but no bitcode objects were passed to the link");
+
+  link_args[link_cnt++] = "-o";
+  link_args[link_cnt++] = linked;
+  link_args[link_cnt] = NULL;
+
+  run_tool(link_args);
+
+  opt_args = ck_alloc(10 * sizeof(u8 *));
+  opt_args[0] = opt_tool ? opt_tool : (u8 *)"opt";
+  opt_args[1] = "-load";
+  opt_args[2] = alloc_printf("%s/maxafl-pass.so", obj_path);
+  opt_args[3] = "-lowerswitch";
+  opt_args[4] = "-maxafl_pass";
+  opt_args[5] = linked;
+  opt_args[6] = "-o";
+  opt_args[7] = instr;
+  opt_args[8] = NULL;
+
+  run_tool(opt_args);
+
+  unlink(linked);
+
+  lto_link = 1;
+  *argc_p = new_cnt;
+
+  return new_argv;
+}
+
 /* Copy argv to cc_params, making the necessary edits. */
 
 static void edit_params(u32 argc, char **argv)
 {
 
   u8 fortify_set = 0, asan_set = 0, x_set = 0, maybe_linking = 1, bit_mode = 0;
+  u8 lto_mode = !!getenv("MAXAFL_LTO");
   u8 *name;
 
   cc_params = ck_alloc((argc + 128) * sizeof(u8 *));
@@ -134,6 +304,12 @@ static void edit_params(u32 argc, char **argv)
 
      http://clang.llvm.org/docs/SanitizerCoverage.html#tracing-pcs-with-guards */
 
+  /* The final MAXAFL_LTO link gets the already instrumented program, so
+     none of the passes below may run on it again. */
+
+  if (lto_link)
+    goto skip_passes;
+
   // laf
   if (getenv("LAF_SPLIT_SWITCHES"))
   {
@@ -185,12 +361,24 @@ static void edit_params(u32 argc, char **argv)
   cc_params[cc_par_cnt++] = "-Xclang";
   cc_params[cc_par_cnt++] = alloc_printf("%s/afl-llvm-pass.so", obj_path);
 
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = "-load";
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = alloc_printf("%s/maxafl-pass.so", obj_path);
+  /* In MAXAFL_LTO mode the objects are left as bitcode and maxafl-pass runs
+     once on the whole program at link time (see lto_prelink()). */
+
+  if (lto_mode)
+  {
+    cc_params[cc_par_cnt++] = "-flto";
+  }
+  else
+  {
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = "-load";
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = alloc_printf("%s/maxafl-pass.so", obj_path);
+  }
 #endif /* ^USE_TRACE_PC */
 
+skip_passes:
+
   cc_params[cc_par_cnt++] = "-Qunused-arguments";
 
   /* Detect stray -v calls from ./configure scripts. */
@@ -347,6 +535,32 @@ static void edit_params(u32 argc, char **argv)
 #endif /* ^__APPLE__ */
                             "_I(); } while (0)";
 
+  /* Shared memory test case delivery. __AFL_FUZZ_TESTCASE_LEN carries the
+     signature afl-fuzz looks for; without afl-fuzz, the runtime reads the
+     test case from stdin. __AFL_FUZZ_INIT() is accepted for harnesses
+     written against other AFL flavors and expands to nothing. */
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_INIT()=";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_LEN="
+                            "({ static volatile char *_S __attribute__((used)); "
+                            " _S = (char*)\"" SHM_INPUT_SIG "\"; "
+#ifdef __APPLE__
+                            "__attribute__((visibility(\"default\"))) "
+                            "unsigned int _F(void) __asm__(\"___afl_fuzz_testcase_len\"); "
+#else
+                            "__attribute__((visibility(\"default\"))) "
+                            "unsigned int _F(void) __asm__(\"__afl_fuzz_testcase_len\"); "
+#endif /* ^__APPLE__ */
+                            "_F(); })";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_BUF="
+#ifdef __APPLE__
+                            "({ extern unsigned char *_P __asm__(\"___afl_fuzz_ptr\"); _P; })";
+#else
+                            "({ extern unsigned char *_P __asm__(\"__afl_fuzz_ptr\"); _P; })";
+#endif /* ^__APPLE__ */
+
   if (maybe_linking)
   {
 
@@ -425,6 +639,31 @@ int main(int argc, char **argv)
 
   find_obj(argv[0]);
 
+#ifndef USE_TRACE_PC
+
+  if (getenv("MAXAFL_LTO"))
+  {
+
+    u8 linking = !(argc == 2 && !strcmp(argv[1], "-v"));
+    u32 i;
+
+    for (i = 1; i < argc; i++)
+    {
+
+      if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "-S") ||
+          !strcmp(argv[i], "-E"))
+        linking = 0;
+
+      if (!strcmp(argv[i], "-shared"))
+        FATAL("MAXAFL_LTO instruments whole programs only, not -shared objects");
+    }
+
+    if (linking)
+      argv = lto_prelink(&argc, argv);
+  }
+
+#endif /* !USE_TRACE_PC */
+
   edit_params(argc, argv);
 
   for (int i = 0; i < cc_par_cnt; i++)
@@ -66,23 +66,29 @@ u8 *__afl_area_ptr = __afl_area_initial;
 // u32 __maxafl_ptr_initial[MAXAFL_MX_MODULE];
 // u32 *__maxafl_ptr_ptr = __maxafl_ptr_initial;
 
-br_info_t __maxafl_br_info[MAXAFL_MX_BR];
-br_info_t *__maxafl_br_info_ptr = __maxafl_br_info;
-
-// u8 __maxafl_br_info[MAXAFL_BR_INFO_SIZE];
-// u8 *__maxafl_br_info_ptr = __maxafl_br_info;
-u32 __maxafl_br_ptr[MAXAFL_MX_MODULE];
-u32 *__maxafl_br_ptr_ptr = __maxafl_br_ptr;
-u32 __maxafl_br_hit[MAXAFL_MX_HIT];
-u32 *__maxafl_br_hit_ptr = __maxafl_br_hit;
-cmp_info_t __maxafl_cmp_info[MAXAFL_MX_CMP];
-cmp_info_t *__maxafl_cmp_info_ptr = __maxafl_cmp_info;
-u32 __maxafl_cmp_ptr[MAXAFL_MX_MODULE];
-u32 *__maxafl_cmp_ptr_ptr = __maxafl_cmp_ptr;
-u32 __maxafl_cmp_hit[MAXAFL_MX_HIT];
-u32 *__maxafl_cmp_hit_ptr = __maxafl_cmp_hit;
-s16 __maxafl_cmpvec[MAXAFL_MX_CMPVEC];
-s16 *__maxafl_cmpvec_ptr = __maxafl_cmpvec;
+/* Views into the versioned state segment. They stay NULL until
+   __afl_map_shm() has validated the header, which is what the visit hooks
+   test for. */
+
+maxafl_shm_hdr_t *__maxafl_state_ptr;
+br_static_t *__maxafl_br_static_ptr;
+double *__maxafl_br_real_ptr;
+br_adapt_t *__maxafl_br_adapt_ptr;
+double *__maxafl_cmp_real_ptr;
+u32 *__maxafl_br_ptr_ptr;
+u32 *__maxafl_br_hit_ptr;
+u32 *__maxafl_cmp_ptr_ptr;
+u32 *__maxafl_cmp_hit_ptr;
+s16 *__maxafl_cmpvec_ptr;
+u8 *__maxafl_br_done_ptr;
+u8 *__maxafl_cmp_done_ptr;
+
+/* Bounds taken from the header, so a stale info file cannot make the hooks
+   write past the segment. The inline fast path (MAXAFL_INLINE) reads them
+   as well; __maxafl_mod_cnt stays 0 until the header has validated. */
+
+u32 __maxafl_br_cnt, __maxafl_cmp_cnt, __maxafl_mod_cnt;
+
 u32 __maxafl_exit_penalty;
 u32 *__maxafl_exit_penalty_ptr = &__maxafl_exit_penalty;
 u8 obj_mode_cur = 3;
@@ -91,6 +97,14 @@ FILE *output_fd;
 
 __thread u32 __afl_prev_loc;
 
+/* Test case for __AFL_FUZZ_TESTCASE_BUF / __AFL_FUZZ_TESTCASE_LEN: the SHM
+   channel when afl-fuzz provides one, stdin read into __afl_fuzz_alt
+   otherwise. */
+
+static u8 __afl_fuzz_alt[MAX_FILE];
+static u32 *__afl_fuzz_shm_len;
+u8 *__afl_fuzz_ptr = __afl_fuzz_alt;
+
 /* Running in persistent mode? */
 
 static u8 is_persistent;
@@ -100,15 +114,9 @@ static u8 is_persistent;
 static void __afl_map_shm(void)
 {
   u8 *id_str = getenv(SHM_ENV_VAR);
-  u8 *id_str_br_info = getenv(SHM_ENV_VAR_BR_INFO);
-  // u8 *id_str_br_info = 0;
-  u8 *id_str_br_ptr = getenv(SHM_ENV_VAR_BR_PTR);
-  u8 *id_str_br_hit = getenv(SHM_ENV_VAR_BR_HIT);
-  u8 *id_str_cmp_info = getenv(SHM_ENV_VAR_CMP_INFO);
-  u8 *id_str_cmp_ptr = getenv(SHM_ENV_VAR_CMP_PTR);
-  u8 *id_str_cmp_hit = getenv(SHM_ENV_VAR_CMP_HIT);
-  u8 *id_str_cmpvec = getenv(SHM_ENV_VAR_CMPVEC);
+  u8 *id_str_state = getenv(SHM_ENV_VAR_STATE);
   u8 *id_str_exit_penalty = getenv(SHM_ENV_VAR_EXIT_PENALTY);
+  u8 *id_str_input = getenv(SHM_ENV_VAR_INPUT);
 
   /* If we're running under AFL, attach to the appropriate region, replacing the
      early-stage __afl_area_initial region that is needed to allow some really
@@ -132,136 +140,50 @@ static void __afl_map_shm(void)
   // {
   //   fprintf(output_fd, "[ERR] Cannot get id_str from envvar\n");
   // }
-  if (id_str_br_info)
-  {
-    u32 shm_id = atoi(id_str_br_info);
-
-    __maxafl_br_info_ptr = shmat(shm_id, NULL, 0);
-
-    // fprintf(output_fd, "Ret value of shmat at id_str_br_info = %p\n", shmat(shm_id, NULL, 0));
-
-    // if (shmat(shm_id, NULL, 0) <= -1)
-    // {
-    //   fprintf(output_fd, "[ERR] ERRNO = %d", errno);
-    // }
-
-    if (__maxafl_br_info_ptr == (void *)-1)
-    {
-      // fprintf(output_fd, "[ERR] Failed to call shmat of id_str_br_info\n");
-      _exit(1);
-    }
-    // fprintf(output_fd, "[SUCC] Successed to call shmat of id_str_br_info, addr = %p\n", __maxafl_br_info_ptr);
-  }
-  // else
-  // {
-  //   fprintf(output_fd, "[ERR] Cannot get id_str_br_info from envvar\n");
-  // }
-  if (id_str_br_ptr)
-  {
-    u32 shm_id = atoi(id_str_br_ptr);
-
-    __maxafl_br_ptr_ptr = shmat(shm_id, NULL, 0);
-
-    // fprintf(output_fd, "Ret value of shmat at id_str_br_ptr = %p\n", shmat(shm_id, NULL, 0));
-
-    if (__maxafl_br_ptr_ptr == (void *)-1)
-    {
-      // fprintf(output_fd, "[ERR] Failed to call shmat of id_str_br_ptr\n");
-      _exit(1);
-    }
-    // fprintf(output_fd, "[SUCC] Successed to call shmat of id_str_br_ptr, addr = %p\n", __maxafl_br_ptr_ptr);
-  }
-  // else
-  // {
-  //   fprintf(output_fd, "[ERR] Cannot get id_str_br_ptr from envvar\n");
-  // }
-  if (id_str_br_hit)
-  {
-    u32 shm_id = atoi(id_str_br_hit);
-
-    __maxafl_br_hit_ptr = shmat(shm_id, NULL, 0);
-
-    // fprintf(output_fd, "Ret value of shmat at id_str_br_ptr = %p\n", shmat(shm_id, NULL, 0));
-
-    if (__maxafl_br_hit_ptr == (void *)-1)
-    {
-      // fprintf(output_fd, "[ERR] Failed to call shmat of id_str_br_ptr\n");
-      _exit(1);
-    }
-    // fprintf(output_fd, "[SUCC] Successed to call shmat of id_str_br_ptr, addr = %p\n", __maxafl_br_ptr_ptr);
-  }
-  // else
-  // {
-  //   fprintf(output_fd, "[ERR] Cannot get id_str_br_ptr from envvar\n");
-  // }
-  if (id_str_cmp_info)
+  if (id_str_state)
   {
-    u32 shm_id = atoi(id_str_cmp_info);
+    u32 shm_id = atoi(id_str_state);
+    maxafl_shm_hdr_t *hdr = shmat(shm_id, NULL, 0);
 
-    __maxafl_cmp_info_ptr = shmat(shm_id, NULL, 0);
-
-    if (__maxafl_cmp_info_ptr == (void *)-1)
+    if (hdr == (void *)-1)
     {
-      // fprintf(output_fd, "[ERR] Failed to call shmat of id_str_cmp_info\n");
       _exit(1);
     }
-    // fprintf(output_fd, "[SUCC] Successed to call shmat of id_str_cmp_info, addr = %p\n", __maxafl_cmp_info_ptr);
-  }
-  // else
-  // {
-  //   fprintf(output_fd, "[ERR] Cannot get id_str_cmp_info from envvar\n");
-  // }
-  if (id_str_cmp_ptr)
-  {
-    u32 shm_id = atoi(id_str_cmp_ptr);
 
-    __maxafl_cmp_ptr_ptr = shmat(shm_id, NULL, 0);
+    /* Only take the segment if we agree on its layout; otherwise run
+       uninstrumented and let afl-fuzz notice the missing ack. */
 
-    if (__maxafl_cmp_ptr_ptr == (void *)-1)
+    if (hdr->magic == MAXAFL_SHM_MAGIC && hdr->version == MAXAFL_SHM_VERSION)
     {
-      // fprintf(output_fd, "[ERR] Failed to call shmat of id_str_cmp_ptr\n");
-      _exit(1);
-    }
-    // fprintf(output_fd, "[SUCC] Successed to call shmat of id_str_cmp_ptr, addr = %p\n", __maxafl_cmp_ptr_ptr);
-  }
-  // else
-  // {
-  //   fprintf(output_fd, "[ERR] Cannot get id_str_cmp_ptr from envvar\n");
-  // }
-  if (id_str_cmp_hit)
-  {
-    u32 shm_id = atoi(id_str_cmp_hit);
+      /* Static data, adaptive weights and retired sites live in a
+         segment shared by every fork server of the run. */
 
-    __maxafl_cmp_hit_ptr = shmat(shm_id, NULL, 0);
+      u8 *shared = shmat(hdr->shared_id, NULL, 0);
 
-    if (__maxafl_cmp_hit_ptr == (void *)-1)
-    {
-      // fprintf(output_fd, "[ERR] Failed to call shmat of id_str_cmp_ptr\n");
-      _exit(1);
-    }
-    // fprintf(output_fd, "[SUCC] Successed to call shmat of id_str_cmp_ptr, addr = %p\n", __maxafl_cmp_ptr_ptr);
-  }
-  // else
-  // {
-  //   fprintf(output_fd, "[ERR] Cannot get id_str_cmp_ptr from envvar\n");
-  // }
-  if (id_str_cmpvec)
-  {
-    u32 shm_id = atoi(id_str_cmpvec);
-
-    __maxafl_cmpvec_ptr = shmat(shm_id, NULL, 0);
+      if (shared == (void *)-1)
+      {
+        _exit(1);
+      }
 
-    if (__maxafl_cmpvec_ptr == (void *)-1)
-    {
-      // fprintf(output_fd, "[ERR] Failed to call shmat of id_str_cmpvec\n");
-      _exit(1);
+      __maxafl_state_ptr = hdr;
+      __maxafl_br_real_ptr = MAXAFL_SHM_ARR(hdr, br_real_off);
+      __maxafl_cmp_real_ptr = MAXAFL_SHM_ARR(hdr, cmp_real_off);
+      __maxafl_br_hit_ptr = MAXAFL_SHM_ARR(hdr, br_hit_off);
+      __maxafl_cmp_hit_ptr = MAXAFL_SHM_ARR(hdr, cmp_hit_off);
+      __maxafl_br_static_ptr = MAXAFL_SHM_SHARED(hdr, shared, br_static_off);
+      __maxafl_br_adapt_ptr = MAXAFL_SHM_SHARED(hdr, shared, br_adapt_off);
+      __maxafl_br_ptr_ptr = MAXAFL_SHM_SHARED(hdr, shared, br_ptr_off);
+      __maxafl_cmp_ptr_ptr = MAXAFL_SHM_SHARED(hdr, shared, cmp_ptr_off);
+      __maxafl_cmpvec_ptr = MAXAFL_SHM_SHARED(hdr, shared, cmpvec_off);
+      __maxafl_br_done_ptr = MAXAFL_SHM_SHARED(hdr, shared, br_done_off);
+      __maxafl_cmp_done_ptr = MAXAFL_SHM_SHARED(hdr, shared, cmp_done_off);
+      __maxafl_br_cnt = hdr->br_cnt;
+      __maxafl_cmp_cnt = hdr->cmp_cnt;
+      __maxafl_mod_cnt = hdr->mod_cnt;
+      obj_mode_cur = hdr->obj_mode;
+      hdr->ack = MAXAFL_SHM_VERSION;
     }
-    // fprintf(output_fd, "[SUCC] Successed to call shmat of id_str_cmpvec, addr = %p\n", __maxafl_cmpvec_ptr);
   }
-  // else
-  // {
-  //   fprintf(output_fd, "[ERR] Cannot get id_str_cmpvec from envvar\n");
-  // }
   if (id_str_exit_penalty)
   {
     u32 shm_id = atoi(id_str_exit_penalty);
@@ -279,6 +201,19 @@ static void __afl_map_shm(void)
   // {
   //   fprintf(output_fd, "[ERR] Cannot get id_str_exit_penalty from envvar\n");
   // }
+  if (id_str_input)
+  {
+    u32 shm_id = atoi(id_str_input);
+    u32 *input = shmat(shm_id, NULL, 0);
+
+    if (input == (void *)-1)
+    {
+      _exit(1);
+    }
+
+    __afl_fuzz_shm_len = input;
+    __afl_fuzz_ptr = (u8 *)(input + 1);
+  }
 }
 
 /* Fork server logic. */
@@ -369,6 +304,28 @@ static void __afl_start_forkserver(void)
   }
 }
 
+/* Clear what the last iteration left in the state segment, the runtime
+   side of afl-fuzz's reset_branch_state(). Only entries on the hit lists
+   can have been touched; a list afl-fuzz has consumed has a count of 0. */
+
+static void __maxafl_reset_state(void)
+{
+  u32 i;
+
+  if (!__maxafl_state_ptr)
+    return;
+
+  for (i = 1; i < __maxafl_br_hit_ptr[0] && i <= __maxafl_br_cnt; i++)
+    __maxafl_br_real_ptr[__maxafl_br_hit_ptr[i]] = BR_NOHIT;
+
+  for (i = 1; i < __maxafl_cmp_hit_ptr[0] && i <= __maxafl_cmp_cnt; i++)
+    __maxafl_cmp_real_ptr[__maxafl_cmp_hit_ptr[i]] = BR_NOHIT;
+
+  __maxafl_br_hit_ptr[0] = 1;
+  __maxafl_cmp_hit_ptr[0] = 1;
+  *__maxafl_exit_penalty_ptr = 0;
+}
+
 /* A simplified persistent mode handler, used as explained in README.llvm. */
 
 int __afl_persistent_loop(unsigned int max_cnt)
@@ -390,6 +347,7 @@ int __afl_persistent_loop(unsigned int max_cnt)
       memset(__afl_area_ptr, 0, MAP_SIZE);
       __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
+      __maxafl_reset_state();
     }
 
     cycle_cnt = max_cnt;
@@ -407,6 +365,7 @@ int __afl_persistent_loop(unsigned int max_cnt)
 
       __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
+      __maxafl_reset_state();
 
       return 1;
     }
@@ -415,15 +374,33 @@ int __afl_persistent_loop(unsigned int max_cnt)
 
       /* When exiting __AFL_LOOP(), make sure that the subsequent code that
          follows the loop is not traced. We do that by pivoting back to the
-         dummy output region. */
+         dummy output region and switching the MaxAFL probes off. */
 
       __afl_area_ptr = __afl_area_initial;
+      __maxafl_mod_cnt = 0;
     }
   }
 
   return 0;
 }
 
+/* Length of the current test case, for __AFL_FUZZ_TESTCASE_LEN. Without
+   the SHM channel, this is where stdin gets read. */
+
+u32 __afl_fuzz_testcase_len(void)
+{
+  u32 len = 0;
+  s32 res;
+
+  if (__afl_fuzz_shm_len)
+    return *__afl_fuzz_shm_len;
+
+  while (len < MAX_FILE && (res = read(0, __afl_fuzz_alt + len, MAX_FILE - len)) > 0)
+    len += res;
+
+  return len;
+}
+
 /* This one can be called from user code when deferred forkserver mode
     is enabled. */
 
@@ -439,7 +416,6 @@ void __afl_manual_init(void)
     __afl_map_shm();
     __afl_start_forkserver();
     init_done = 1;
-    obj_mode_cur = *__maxafl_exit_penalty_ptr;
     *__maxafl_exit_penalty_ptr = 0;
   }
 }
@@ -510,17 +486,17 @@ void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop)
 
 void __maxafl_visit_etc(u32 moduleId, u32 id, s32 real)
 {
-  if (__maxafl_cmp_info_ptr == __maxafl_cmp_info)
+  if (!__maxafl_cmp_real_ptr || moduleId >= __maxafl_mod_cnt)
   {
     return;
   }
 
   // fprintf(output_fd, "[ETC]\tmoduleId : %d, id : %d, real : %d\n", moduleId, id, real);
 
-  // maxafl_info_t *cmp_info = &__maxafl_area_ptr[id];
-  cmp_info_t *cmp_info = __maxafl_cmp_info_ptr + __maxafl_cmp_ptr_ptr[moduleId] + id;
+  u32 cmp_id = __maxafl_cmp_ptr_ptr[moduleId] + id;
 
-  cmp_info->real = real;
+  if (cmp_id < __maxafl_cmp_cnt)
+    __maxafl_cmp_real_ptr[cmp_id] = real;
 
   return;
 }
@@ -543,66 +519,90 @@ void __maxafl_exit_internal_call(u32 penalty)
 
 void (*__maxafl_exit_internal_call_func)(u32) = &__maxafl_exit_internal_call;
 
+void __maxafl_eval_br(u32 moduleId, u32 br_id);
+
 void __maxafl_visit_br(u32 moduleId, u32 id)
 {
-  if (__maxafl_br_info_ptr == __maxafl_br_info)
+  if (!__maxafl_br_real_ptr || moduleId >= __maxafl_mod_cnt)
   {
     return;
   }
 
   u32 br_id = __maxafl_br_ptr_ptr[moduleId] + id;
-  br_info_t *br_info = __maxafl_br_info_ptr + br_id;
-  cmp_info_t *cmp_info = __maxafl_cmp_info_ptr + __maxafl_cmp_ptr_ptr[moduleId];
+
+  /* Retired by afl-fuzz: skip before touching the branch's state. */
+
+  if (br_id >= __maxafl_br_cnt || MAXAFL_BIT_IS_SET(__maxafl_br_done_ptr, br_id))
+  {
+    return;
+  }
+
+  double *br_real = __maxafl_br_real_ptr + br_id;
   // u32 *br_hit_cnt = __maxafl_br_hit_ptr;
   u32 *br_hit = __maxafl_br_hit_ptr;
-  s32 i, top = 0, left = 0, right = 0;
-  u16 leftMul, rightMul, leftMax, rightMax;
-  double stack[20];
-  s8 sign;
-  u8 binop_or, binop_and;
 
-  // fprintf(output_fd, "moduleId : %d, brId : %d, br_info : %p, calc : %d, sizeof(br_info_t) : %d, calc2 : %d\n", moduleId, id, br_info, __maxafl_br_ptr_ptr[moduleId] + id, sizeof(br_info_t), ((u64)br_info - (u64)__maxafl_br_info_ptr) / sizeof(br_info_t));
   // fprintf(output_fd, "moduleId : %d, brId : %d\n", moduleId, id);
-  // fprintf(output_fd, "moduleId : %d, brId : %d, left : %d, right : %d, hit : %d, real : %f, cmpSize : %d, cmpVec : %p\n", br_info->moduleId, br_info->brId, br_info->left, br_info->right, br_info->hit, br_info->real, br_info->cmpSize, br_info->cmpVec);
 
-  if (br_info->real == BR_SUCC || br_info->real == BR_FINISH)
+  if (*br_real == BR_SUCC || *br_real == BR_FINISH)
   {
     return;
   }
 
-  if (br_info->real == BR_NOHIT)
+  if (*br_real == BR_NOHIT)
   {
     // ! Something is wrong in this code. If i remove fprintf line, SIGSEGV is occured. But when i print it, it's fine.
-    br_hit[br_hit[0]++] = br_id;
+    if (br_hit[0] <= __maxafl_br_cnt)
+      br_hit[br_hit[0]++] = br_id;
   }
 
+  __maxafl_eval_br(moduleId, br_id);
+}
+
+void (*__maxafl_visit_br_func)(u32, u32) = &__maxafl_visit_br;
+
+/* Slow half of __maxafl_visit_br(): evaluate the compound predicate of a
+   branch that is still open and adapt its weights. Called directly by the
+   inline fast path, with br_id already checked against the segment. */
+
+void __maxafl_eval_br(u32 moduleId, u32 br_id)
+{
+  double *br_real = __maxafl_br_real_ptr + br_id;
+  br_static_t *br_static = __maxafl_br_static_ptr + br_id;
+  br_adapt_t *br_adapt = __maxafl_br_adapt_ptr + br_id;
+  double *cmp_real = __maxafl_cmp_real_ptr + __maxafl_cmp_ptr_ptr[moduleId];
+  s32 i, top = 0, left = 0, right = 0;
+  u16 leftMul, rightMul, leftMax, rightMax;
+  double stack[20];
+  s8 sign;
+  u8 binop_or, binop_and;
+
   switch (obj_mode_cur)
   {
   case OBJ_MODE_ORIGIN:
-    left = br_info->left;
-    right = br_info->right;
+    left = br_static->left;
+    right = br_static->right;
     break;
   case OBJ_MODE_ADP1:
     leftMax = MAX_MUL, rightMax = MAX_MUL;
-    leftMul = br_info->leftMul, rightMul = br_info->rightMul;
-    left = br_info->left * (1 + rightMul * 0.1);
-    right = br_info->right * (1 + leftMul * 0.1);
+    leftMul = br_adapt->leftMul, rightMul = br_adapt->rightMul;
+    left = br_static->left * (1 + rightMul * 0.1);
+    right = br_static->right * (1 + leftMul * 0.1);
     break;
   case OBJ_MODE_ADP2:
-    leftMax = br_info->left, rightMax = br_info->right;
-    leftMul = br_info->leftMul, rightMul = br_info->rightMul;
-    left = br_info->left - (leftMul - rightMul);
-    right = br_info->right - (rightMul - leftMul);
+    leftMax = br_static->left, rightMax = br_static->right;
+    leftMul = br_adapt->leftMul, rightMul = br_adapt->rightMul;
+    left = br_static->left - (leftMul - rightMul);
+    right = br_static->right - (rightMul - leftMul);
     break;
   }
 
   sign = (left >= right) ? 1 : 0;
 
-  for (i = br_info->cmpSize - 1; i >= 0; i--)
+  for (i = br_static->cmpSize - 1; i >= 0; i--)
   {
-    int cmpId = __maxafl_cmpvec_ptr[br_info->cmpVec + i * 3];
-    int cmpType = __maxafl_cmpvec_ptr[br_info->cmpVec + i * 3 + 1];
-    int cmpNo = __maxafl_cmpvec_ptr[br_info->cmpVec + i * 3 + 2] ^ sign;
+    int cmpId = __maxafl_cmpvec_ptr[br_static->cmpVec + i * 3];
+    int cmpType = __maxafl_cmpvec_ptr[br_static->cmpVec + i * 3 + 1];
+    int cmpNo = __maxafl_cmpvec_ptr[br_static->cmpVec + i * 3 + 2] ^ sign;
 
     binop_or = cmpNo ? BINOP_OR : BINOP_AND, binop_and = cmpNo ? BINOP_AND : BINOP_OR;
 
@@ -646,8 +646,8 @@ void __maxafl_visit_br(u32 moduleId, u32 id)
     //  ETC instructions(load ...)
     else if (cmpType == -1)
     {
-      // double real = -cmp_info[cmpId].real + 0.5;
-      s8 real = cmp_info[cmpId].real == 1 ? 1 : 0;
+      // double real = -cmp_real[cmpId] + 0.5;
+      s8 real = cmp_real[cmpId] == 1 ? 1 : 0;
 
       if (!(real ^ cmpNo))
       {
@@ -662,7 +662,7 @@ void __maxafl_visit_br(u32 moduleId, u32 id)
     else
     {
 
-      double real = cmp_info[cmpId].real;
+      double real = cmp_real[cmpId];
 
       if (cmpNo)
       {
@@ -679,36 +679,36 @@ void __maxafl_visit_br(u32 moduleId, u32 id)
   //   // assert(0);
   // }
 
-  br_info->real = stack[0];
+  *br_real = stack[0];
 
   //  left
-  if (br_info->real == BR_FALSE || br_info->real == BR_TRUE || br_info->left == 0 || br_info->right == 0)
+  if (*br_real == BR_FALSE || *br_real == BR_TRUE || br_static->left == 0 || br_static->right == 0)
   {
     return;
   }
-  if (signbit(br_info->real) && br_info->leftMul < leftMax)
+  if (signbit(*br_real) && br_adapt->leftMul < leftMax)
   {
-    br_info->leftHit++;
-    if (br_info->leftHit >= br_info->left * br_info->left)
+    br_adapt->leftHit++;
+    if (br_adapt->leftHit >= br_static->left * br_static->left)
     {
-      br_info->leftHit = 0;
-      br_info->leftMul++;
+      br_adapt->leftHit = 0;
+      br_adapt->leftMul++;
 #ifdef _MAXAFL_DEBUG
-      fprintf(output_fd, "[DBG]\tleftMul of brId : %d has been increased to %d!\n", br_info->brId, br_info->leftMul);
+      fprintf(output_fd, "[DBG]\tleftMul of brId : %d has been increased to %d!\n", br_id, br_adapt->leftMul);
 #endif
     }
   }
   //  right
-  // else if ((sign == -1 && br_info->real == BR_SUCC && br_info->rightMul < MAX_MUL) || (sign == 1 && br_info->real != BR_SUCC && br_info->rightMul < MAX_MUL))
-  else if (!signbit(br_info->real) && br_info->rightMul < rightMax)
+  // else if ((sign == -1 && *br_real == BR_SUCC && br_adapt->rightMul < MAX_MUL) || (sign == 1 && *br_real != BR_SUCC && br_adapt->rightMul < MAX_MUL))
+  else if (!signbit(*br_real) && br_adapt->rightMul < rightMax)
   {
-    br_info->rightHit++;
-    if (br_info->rightHit >= br_info->right * br_info->right)
+    br_adapt->rightHit++;
+    if (br_adapt->rightHit >= br_static->right * br_static->right)
     {
-      br_info->rightHit = 0;
-      br_info->rightMul++;
+      br_adapt->rightHit = 0;
+      br_adapt->rightMul++;
 #ifdef _MAXAFL_DEBUG
-      fprintf(output_fd, "[DBG]\trightMul of brId : %d has been increased to %d!\n", br_info->brId, br_info->rightMul);
+      fprintf(output_fd, "[DBG]\trightMul of brId : %d has been increased to %d!\n", br_id, br_adapt->rightMul);
 #endif
     }
   }
@@ -716,32 +716,36 @@ void __maxafl_visit_br(u32 moduleId, u32 id)
   return;
 }
 
-void (*__maxafl_visit_br_func)(u32, u32) = &__maxafl_visit_br;
-
 void __maxafl_visit_cmp_float(u32 moduleId, u32 id, u32 cmpType, u32 argType, u32 size, double arg1, double arg2)
 {
-  if (__maxafl_cmp_info_ptr == __maxafl_cmp_info)
+  if (!__maxafl_cmp_real_ptr || moduleId >= __maxafl_mod_cnt)
   {
     return;
   }
 
-  // maxafl_info_t *cmp_info = &__maxafl_area_ptr[id];
   u32 cmp_id = __maxafl_cmp_ptr_ptr[moduleId] + id;
-  cmp_info_t *cmp_info = __maxafl_cmp_info_ptr + cmp_id;
+
+  if (cmp_id >= __maxafl_cmp_cnt || MAXAFL_BIT_IS_SET(__maxafl_cmp_done_ptr, cmp_id))
+  {
+    return;
+  }
+
+  double *real = __maxafl_cmp_real_ptr + cmp_id;
   // u32 *cmp_hit_cnt = __maxafl_cmp_hit_ptr;
   u32 *cmp_hit = __maxafl_cmp_hit_ptr;
   double not = 1.0;
 
   // fprintf(output_fd, "ptr of cmp_hit : %p, cmp_hit[0] = %d\n", cmp_hit, cmp_hit[0]);
 
-  if (cmp_info->real == BR_SUCC)
+  if (*real == BR_SUCC)
   {
     return;
   }
 
-  if (cmp_info->real == BR_NOHIT)
+  if (*real == BR_NOHIT)
   {
-    cmp_hit[cmp_hit[0]++] = cmp_id;
+    if (cmp_hit[0] <= __maxafl_cmp_cnt)
+      cmp_hit[cmp_hit[0]++] = cmp_id;
   }
 
   switch (cmpType)
@@ -751,9 +755,9 @@ void __maxafl_visit_cmp_float(u32 moduleId, u32 id, u32 cmpType, u32 argType, u3
     not = 1.0;
   case FCMP_OEQ:
   case FCMP_UEQ:
-    cmp_info->real = arg1 > arg2 ? arg1 - arg2 : arg2 - arg1;
-    if (cmp_info->real == +0.0)
-      cmp_info->real = -0.0;
+    *real = arg1 > arg2 ? arg1 - arg2 : arg2 - arg1;
+    if (*real == +0.0)
+      *real = -0.0;
     break;
 
   case FCMP_OLE:
@@ -761,7 +765,7 @@ void __maxafl_visit_cmp_float(u32 moduleId, u32 id, u32 cmpType, u32 argType, u3
     not = -1.0;
   case FCMP_OGT:
   case FCMP_UGT:
-    cmp_info->real = arg2 - arg1;
+    *real = arg2 - arg1;
     break;
 
   case FCMP_OLT:
@@ -769,9 +773,9 @@ void __maxafl_visit_cmp_float(u32 moduleId, u32 id, u32 cmpType, u32 argType, u3
     not = -1.0;
   case FCMP_OGE:
   case FCMP_UGE:
-    cmp_info->real = arg2 - arg1;
-    if (cmp_info->real == +0.0)
-      cmp_info->real = -0.0;
+    *real = arg2 - arg1;
+    if (*real == +0.0)
+      *real = -0.0;
     break;
 
   default:
@@ -787,28 +791,34 @@ void __maxafl_visit_cmp_integer(u32 moduleId, u32 id, u32 cmpType, u32 argType,
 {
   double sreal, zreal;
 
-  if (__maxafl_cmp_info_ptr == __maxafl_cmp_info)
+  if (!__maxafl_cmp_real_ptr || moduleId >= __maxafl_mod_cnt)
   {
     return;
   }
 
-  // maxafl_info_t *cmp_info = &__maxafl_area_ptr[id];
   u32 cmp_id = __maxafl_cmp_ptr_ptr[moduleId] + id;
-  cmp_info_t *cmp_info = __maxafl_cmp_info_ptr + cmp_id;
+
+  if (cmp_id >= __maxafl_cmp_cnt || MAXAFL_BIT_IS_SET(__maxafl_cmp_done_ptr, cmp_id))
+  {
+    return;
+  }
+
+  double *real = __maxafl_cmp_real_ptr + cmp_id;
   // u32 *cmp_hit_cnt = __maxafl_cmp_hit_ptr;
   u32 *cmp_hit = __maxafl_cmp_hit_ptr;
   double not = 1.0;
 
   // fprintf(output_fd, "ptr of cmp_hit : %p, cmp_hit[0] = %d\n", cmp_hit, cmp_hit[0]);
 
-  if (cmp_info->real == BR_SUCC)
+  if (*real == BR_SUCC)
   {
     return;
   }
 
-  if (cmp_info->real == BR_NOHIT)
+  if (*real == BR_NOHIT)
   {
-    cmp_hit[cmp_hit[0]++] = cmp_id;
+    if (cmp_hit[0] <= __maxafl_cmp_cnt)
+      cmp_hit[cmp_hit[0]++] = cmp_id;
   }
 
   if (size == 32)
@@ -847,46 +857,134 @@ void __maxafl_visit_cmp_integer(u32 moduleId, u32 id, u32 cmpType, u32 argType,
   case ICMP_EQ:
     sreal = (double)sarg1 > (double)sarg2 ? (double)sarg1 - (double)sarg2 : (double)sarg2 - (double)sarg1;
     zreal = (double)zarg1 > (double)zarg2 ? (double)zarg1 - (double)zarg2 : (double)zarg2 - (double)zarg1;
-    cmp_info->real = (sreal > 0 ? sreal : -sreal) < (zreal > 0 ? zreal : -zreal) ? sreal : zreal;
-    if (cmp_info->real == +0.0)
-      cmp_info->real = -0.0;
+    *real = (sreal > 0 ? sreal : -sreal) < (zreal > 0 ? zreal : -zreal) ? sreal : zreal;
+    if (*real == +0.0)
+      *real = -0.0;
     break;
 
   case ICMP_ULE:
     not = -1.0;
   case ICMP_UGT:
-    cmp_info->real = ((double)zarg2 - (double)zarg1);
+    *real = ((double)zarg2 - (double)zarg1);
     break;
 
   case ICMP_SLE:
     not = -1.0;
   case ICMP_SGT:
-    cmp_info->real = ((double)sarg2 - (double)sarg1);
+    *real = ((double)sarg2 - (double)sarg1);
     break;
 
   case ICMP_ULT:
     not = -1.0;
   case ICMP_UGE:
-    cmp_info->real = ((double)zarg2 - (double)zarg1);
-    if (cmp_info->real == +0.0)
-      cmp_info->real = -0.0;
+    *real = ((double)zarg2 - (double)zarg1);
+    if (*real == +0.0)
+      *real = -0.0;
     break;
 
   case ICMP_SLT:
     not = -1.0;
   case ICMP_SGE:
-    cmp_info->real = ((double)sarg2 - (double)sarg1);
-    if (cmp_info->real == +0.0)
-      cmp_info->real = -0.0;
+    *real = ((double)sarg2 - (double)sarg1);
+    if (*real == +0.0)
+      *real = -0.0;
     break;
 
   default:
     break;
   }
 
-  cmp_info->real *= not;
+  *real *= not;
 
   return;
 }
 
-void (*__maxafl_visit_integer_func)(u32, u32, u32, u32, u32, s64, s64, u64, u64) = &__maxafl_visit_cmp_integer;
\ No newline at end of file
+void (*__maxafl_visit_integer_func)(u32, u32, u32, u32, u32, s64, s64, u64, u64) = &__maxafl_visit_cmp_integer;
+
+/* Specialized integer compare probes. For 8, 16 and 32-bit operands
+   maxafl-pass calls __maxafl_cmp_<pred>_<width>(moduleId, id, a, b) instead
+   of the generic probe above: no switch on predicate or size, and the
+   distance is computed in integers and rounded to double once. Operands
+   arrive widened to u32 and are cut back here; 64-bit and pointer compares
+   are cut to 32 bits by the pass, as the generic probe only evaluates
+   opsize (32) bits of them. The stored values, signed zeros included, match
+   __maxafl_visit_cmp_integer(). */
+
+static inline double *__maxafl_cmp_slot(u32 moduleId, u32 id)
+{
+  double *real;
+  u32 cmp_id;
+
+  if (!__maxafl_cmp_real_ptr || moduleId >= __maxafl_mod_cnt)
+    return NULL;
+
+  cmp_id = __maxafl_cmp_ptr_ptr[moduleId] + id;
+
+  if (cmp_id >= __maxafl_cmp_cnt || MAXAFL_BIT_IS_SET(__maxafl_cmp_done_ptr, cmp_id))
+    return NULL;
+
+  real = __maxafl_cmp_real_ptr + cmp_id;
+
+  if (*real == BR_SUCC)
+    return NULL;
+
+  if (*real == BR_NOHIT && __maxafl_cmp_hit_ptr[0] <= __maxafl_cmp_cnt)
+    __maxafl_cmp_hit_ptr[__maxafl_cmp_hit_ptr[0]++] = cmp_id;
+
+  return real;
+}
+
+/* |b - a| and b - a, without overflow for any operand type. */
+
+#define MAXAFL_CMP_ABS(_a, _b) \
+  ((_b) >= (_a) ? (u64)(_b) - (u64)(_a) : (u64)(_a) - (u64)(_b))
+
+#define MAXAFL_CMP_DIFF(_a, _b) \
+  ((_b) >= (_a) ? (double)((u64)(_b) - (u64)(_a)) : -(double)((u64)(_a) - (u64)(_b)))
+
+/* The "+0.0 becomes -0.0" and "not" steps of the generic probe. */
+
+static inline void __maxafl_cmp_store(double *real, double d, u8 zero_neg, u8 neg)
+{
+  if (zero_neg && d == 0)
+    d = -0.0;
+
+  *real = neg ? -d : d;
+}
+
+#define MAXAFL_CMP_EQ(_pred, _w, _p, _u, _s, _neg)                  \
+  void __maxafl_cmp_##_pred##_##_w(u32 moduleId, u32 id, _p a, _p b) \
+  {                                                                 \
+    double *real = __maxafl_cmp_slot(moduleId, id);                 \
+    u64 sd, zd;                                                     \
+    if (!real)                                                      \
+      return;                                                       \
+    sd = MAXAFL_CMP_ABS((_s)a, (_s)b);                              \
+    zd = MAXAFL_CMP_ABS((_u)a, (_u)b);                              \
+    __maxafl_cmp_store(real, (double)(sd < zd ? sd : zd), 1, _neg); \
+  }
+
+#define MAXAFL_CMP_ORD(_pred, _w, _p, _t, _zero_neg, _neg)          \
+  void __maxafl_cmp_##_pred##_##_w(u32 moduleId, u32 id, _p a, _p b) \
+  {                                                                 \
+    double *real = __maxafl_cmp_slot(moduleId, id);                 \
+    if (real)                                                       \
+      __maxafl_cmp_store(real, MAXAFL_CMP_DIFF((_t)a, (_t)b),       \
+                         _zero_neg, _neg);                          \
+  }
+
+#define MAXAFL_CMP_DEFS(_w, _p, _u, _s)   \
+  MAXAFL_CMP_EQ(eq, _w, _p, _u, _s, 0)    \
+  MAXAFL_CMP_EQ(ne, _w, _p, _u, _s, 1)    \
+  MAXAFL_CMP_ORD(ugt, _w, _p, _u, 0, 0)   \
+  MAXAFL_CMP_ORD(ule, _w, _p, _u, 0, 1)   \
+  MAXAFL_CMP_ORD(uge, _w, _p, _u, 1, 0)   \
+  MAXAFL_CMP_ORD(ult, _w, _p, _u, 1, 1)   \
+  MAXAFL_CMP_ORD(sgt, _w, _p, _s, 0, 0)   \
+  MAXAFL_CMP_ORD(sle, _w, _p, _s, 0, 1)   \
+  MAXAFL_CMP_ORD(sge, _w, _p, _s, 1, 0)   \
+  MAXAFL_CMP_ORD(slt, _w, _p, _s, 1, 1)
+
+MAXAFL_CMP_DEFS(8, u32, u8, s8)
+MAXAFL_CMP_DEFS(16, u32, u16, s16)
+MAXAFL_CMP_DEFS(32, u32, u32, s32)
@@ -5,6 +5,7 @@
 #include "../types.h"
 #include <streambuf>
 #include <iostream>
+#include <cstdlib>
 
 #define endl "\n"
 
@@ -15,9 +16,9 @@ namespace common
 // #define _MAXAFL_DEBUG
 #define _MAXAFL_RELEASE
 
-    // #ifdef _MAXAFL_DEBUG
-    llvm::raw_ostream &print = llvm::outs();
-    // #endif
+    // ! Diagnostics are only printed when MAXAFL_DEBUG is set
+    const bool debug = getenv("MAXAFL_DEBUG") != NULL;
+    llvm::raw_ostream &print = debug ? llvm::outs() : llvm::nulls();
 
     const std::string funcMapFileName = "funcMap.map";
 
@@ -1,6 +1,7 @@
 #include "llvm/Analysis/CallGraph.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils.h"
 
@@ -16,6 +17,11 @@
 
 #include "llvm/Pass.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/Config/llvm-config.h"
 
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
@@ -33,8 +39,19 @@
 #include <tuple>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
 
 #include "common.h"
+#include "../hash.h"
+#include "../maxafl-info.h"
 
 using namespace llvm;
 using namespace std;
@@ -133,35 +150,62 @@ namespace
     Type *Float32Ty;
     Type *Double64Ty;
     Type *Int8PtrTy;
+    Type *Int32PtrTy;
     Type *Int64PtrTy;
+    Type *DoublePtrTy;
 
     FunctionType *VisitCmpIntTy;
     FunctionType *VisitCmpFloatTy;
     FunctionType *VisitBrTy;
     FunctionType *VisitEtcTy;
-    FunctionType *EnterInternalTy;
-    FunctionType *ExitInternalTy;
 
     Constant *VisitCmpInt;
     Constant *VisitCmpFloat;
     Constant *VisitBr;
     Constant *VisitEtc;
-    Constant *EnterInternal;
-    Constant *ExitInternal;
 
     Function *VisitCmpIntFunc;
     Function *VisitCmpFloatFunc;
     Function *VisitBrFunc;
     Function *VisitEtcFunc;
-    Function *EnterInternalFunc;
-    Function *ExitInternalFunc;
 
     Constant *VisitCmpIntPtr;
     Constant *VisitCmpFloatPtr;
     Constant *VisitBrPtr;
     Constant *VisitEtcPtr;
-    Constant *EnterInternalPtr;
-    Constant *ExitInternalPtr;
+
+    // ! Inline fast path (MAXAFL_INLINE): probes are emitted as direct calls
+    // ! while the module is analyzed, then lowered in place by lowerFastPaths().
+    // ! Otherwise branch and compare calls are queued in guardCalls and
+    // ! wrapped in the retired-site test by guardProbes().
+    enum FastKind
+    {
+      FAST_CMP_INT,
+      FAST_CMP_FLOAT,
+      FAST_ETC,
+      FAST_BR
+    };
+
+    bool inlineFast;
+    bool ltoMode;
+    vector<pair<CallInst *, FastKind>> fastCalls;
+    vector<pair<CallInst *, FastKind>> guardCalls;
+
+    FunctionType *EvalBrTy;
+    Constant *EvalBr;
+
+    Constant *ModCntVar;
+    Constant *BrCntVar;
+    Constant *CmpCntVar;
+    Constant *BrRealVar;
+    Constant *CmpRealVar;
+    Constant *BrPtrVar;
+    Constant *CmpPtrVar;
+    Constant *BrHitVar;
+    Constant *CmpHitVar;
+    Constant *BrDoneVar;
+    Constant *CmpDoneVar;
+    Constant *ExitPenaltyVar;
 
     unsigned NoSanMetaId;
     MDTuple *NoneMetaNode;
@@ -174,9 +218,18 @@ namespace
     vector<BrInfo> brvec;
     vector<CmpInfo> cmpvec;
 
-    raw_fd_ostream *infoFile;
-    raw_fd_ostream *comInfoFile;
+    raw_ostream *infoFile;
+    raw_string_ostream *comInfoFile;
+    raw_string_ostream *comInfoBinFile;
     raw_fd_ostream *resultFile;
+    string moduleName;
+
+    // ! Build-time summary, printed per module when MAXAFL_STATS is set
+    bool statsMode;
+    std::chrono::steady_clock::time_point phaseStart;
+    vector<pair<const char *, double>> phaseTimes;
+    string comInfoBuf;
+    string comInfoBinBuf;
 
     map<string, pair<int, int>>
         funcMap;
@@ -185,6 +238,20 @@ namespace
 
     typedef pair<BasicBlock *, BasicBlock *> BackEdge;
 
+    // ! Per-function CFG in dense form. Blocks are numbered in layout order,
+    // ! successor lists are kept in CSR form (succ[succBegin[b]..succBegin[b+1]])
+    // ! with dropped marking the edges removed to break cycles, and order
+    // ! lists every block after all of its successors.
+    struct DenseCFG
+    {
+      vector<BasicBlock *> blocks;
+      DenseMap<BasicBlock *, unsigned> index;
+      vector<unsigned> succBegin;
+      vector<unsigned> succ;
+      BitVector dropped;
+      vector<unsigned> order;
+    };
+
     static std::string getSimpleNodeLabel(const BasicBlock *Node,
                                           const Function *)
     {
@@ -215,6 +282,11 @@ namespace
     MaxAFLPass() : ModulePass(ID) {}
     void initVariable(Module &M);
     void freeVariable(Module &M);
+    unsigned int loadFuncMap(map<string, pair<int, int>> &fMap, map<int, string> &mMap);
+    void saveFuncMap(unsigned int moduleCnt, map<string, pair<int, int>> &fMap, map<int, string> &mMap);
+    void mergeFuncMap();
+    void endPhase(const char *name);
+    void reportStats(size_t funcCnt);
     Value *castCmpArgType(IRBuilder<> &IRB, Value *V, CmpInst *inst, bool extType);
     int getNextId();
     void setValueNonSan(Value *v);
@@ -224,10 +296,26 @@ namespace
     void printInstWithTab(Instruction *inst, int tab, string prefix = "");
     bool visitBrInst(Module &M, Value *v, BrInfo &brinfo, bool no, int debugDepth);
     bool visitCmpInst(Module &M, Instruction *inst, CmpInfo &cmpinfo);
+    Constant *getCmpSpecial(Module &M, unsigned pred, unsigned width);
     bool visitEtcInst(Module &M, Instruction *inst, CmpInfo &cmpinfo);
     bool getIncomingAndBackEdge(Loop *L, BasicBlock *&Incoming, BasicBlock *&Backedge);
     void getBackedges(Loop *L, set<BackEdge> &backEdgeSet);
     void getLoopBB(Loop *L, set<BasicBlock *> &);
+    void buildCFG(Function &F, const set<BackEdge> &backEdgeSet, DenseCFG &G);
+    void buildLegacyCFG(Function &F, const set<BackEdge> &backEdgeSet, DenseCFG &G);
+    void computeMEIC(DenseCFG &G, vector<int> &meic, vector<int> &maxChild, vector<Instruction *> &internalCalls);
+    void saveInfoImage(raw_ostream &out);
+    CallInst *emitProbe(IRBuilder<> &IRB, FastKind kind, Constant *Func, Constant *FuncPtr, ArrayRef<Value *> Args);
+    Value *createLoad(IRBuilder<> &IRB, Type *Ty, Value *Ptr);
+    void createStore(IRBuilder<> &IRB, Value *V, Value *Ptr);
+    void emitPenalty(IRBuilder<> &IRB, Value *Delta, bool enter);
+    void keepPenaltyAcrossSetjmp(Function &F);
+    Value *emitSiteIndex(Instruction *&At, Value *mId, Value *id, Constant *PtrVar, Constant *CntVar);
+    void emitHitAppend(Instruction *At, Value *Real, Value *Idx, Constant *HitVar, Constant *CntVar);
+    void emitDoneCheck(Instruction *&At, Value *Idx, Constant *DoneVar);
+    Value *emitCmpDistance(IRBuilder<> &IRB, CallInst *CI, bool isInt);
+    void lowerFastPaths(Module &M);
+    void guardProbes(Module &M);
     bool runOnModule(Module &M) override;
     void getAnalysisUsage(AnalysisUsage &AU) const override;
   };
@@ -265,32 +353,149 @@ namespace
   };
 } // namespace
 
-void MaxAFLPass::initVariable(Module &M)
+// ! Shared build files (funcMap.map, infofile.*) are kept in MAXAFL_INFO_DIR
+// ! when it is set, so recursive builds agree on a single copy
+static string infoPath(const string &name)
+{
+  const char *dir = getenv("MAXAFL_INFO_DIR");
+
+  if (!dir || !*dir)
+    return name;
+  return string(dir) + "/" + name;
+}
+
+static int lockFile(const string &path, int flags)
+{
+  int fd = open(path.c_str(), flags | O_CREAT, 0644);
+
+  if (fd < 0)
+    report_fatal_error(Twine("maxafl-pass: unable to open '") + path + "'");
+
+  while (flock(fd, LOCK_EX) < 0)
+  {
+    if (errno != EINTR)
+      report_fatal_error(Twine("maxafl-pass: unable to lock '") + path + "'");
+  }
+
+  return fd;
+}
+
+// ! Append one module's records with a single write() under an exclusive
+// ! lock, so parallel compilations never interleave them. The whole-program
+// ! run owns the files and replaces them instead.
+static void writeInfoFile(const string &name, const string &data, bool append)
+{
+  string path = infoPath(name);
+  int fd = lockFile(path, O_WRONLY | (append ? O_APPEND : O_TRUNC));
+  const char *buf = data.data();
+  size_t left = data.size();
+
+  while (left)
+  {
+    ssize_t res = write(fd, buf, left);
+
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      report_fatal_error(Twine("maxafl-pass: short write to '") + path + "'");
+
+    buf += res;
+    left -= res;
+  }
+
+  close(fd);
+}
+
+unsigned int MaxAFLPass::loadFuncMap(map<string, pair<int, int>> &fMap, map<int, string> &mMap)
 {
   ifstream funcMapStream;
-  moduleId = 0;
+  unsigned int moduleCnt = 0;
 
-  funcMapStream.open(common::funcMapFileName);
+  funcMapStream.open(infoPath(common::funcMapFileName));
   if (funcMapStream.fail())
   {
     common::print << "no funcMap file" << endl;
+    return 0;
   }
-  else
+
+  string funcName, moduleName;
+  int funcModuleId, funcMEIC, moduleNum;
+
+  funcMapStream >> moduleCnt;
+  for (unsigned int i = 0; i < moduleCnt; i++)
   {
-    string funcName, moduleName;
-    int funcModuleId, funcMEIC, moduleNum;
+    if (!(funcMapStream >> moduleNum >> moduleName))
+      break;
+    mMap[moduleNum] = moduleName;
+  }
+  while (funcMapStream >> funcName >> funcModuleId >> funcMEIC)
+  {
+    fMap[funcName] = make_pair(funcModuleId, funcMEIC);
+  }
+  funcMapStream.close();
 
-    funcMapStream >> moduleId;
-    for (unsigned int i = 0; i < moduleId; i++)
-    {
-      funcMapStream >> moduleNum >> moduleName;
-      moduleMap[moduleNum] = moduleName;
-    }
-    while (funcMapStream >> funcName >> funcModuleId >> funcMEIC)
-    {
-      funcMap[funcName] = make_pair(funcModuleId, funcMEIC);
-    }
-    funcMapStream.close();
+  return moduleCnt;
+}
+
+// ! Write to a temporary file and rename() over funcMap.map, so a reader
+// ! never sees a half written map
+void MaxAFLPass::saveFuncMap(unsigned int moduleCnt, map<string, pair<int, int>> &fMap, map<int, string> &mMap)
+{
+  string path = infoPath(common::funcMapFileName);
+  string tmpPath = path + "." + to_string(getpid());
+  ofstream funcMapOStream;
+
+  funcMapOStream.open(tmpPath);
+  funcMapOStream << moduleCnt << endl;
+  for (map<int, string>::iterator iter = mMap.begin(); iter != mMap.end(); iter++)
+  {
+    funcMapOStream << iter->first << "\t" << iter->second << endl;
+  }
+  for (map<string, pair<int, int>>::iterator iter = fMap.begin(); iter != fMap.end(); iter++)
+  {
+    funcMapOStream << iter->first << "\t" << iter->second.first << "\t" << iter->second.second << endl;
+  }
+  funcMapOStream.close();
+
+  if (funcMapOStream.fail() || rename(tmpPath.c_str(), path.c_str()) < 0)
+    report_fatal_error(Twine("maxafl-pass: unable to update '") + path + "'");
+}
+
+// ! Other compilations may have registered modules and functions since
+// ! initVariable; fold ours into the current map instead of overwriting it
+void MaxAFLPass::mergeFuncMap()
+{
+  map<string, pair<int, int>> curFuncMap;
+  map<int, string> curModuleMap;
+  int lockFd = lockFile(infoPath(common::funcMapFileName + ".lock"), O_RDWR);
+  unsigned int moduleCnt = loadFuncMap(curFuncMap, curModuleMap);
+
+  for (auto &iter : funcMap)
+  {
+    if (iter.second.first == (int)moduleId)
+      curFuncMap[iter.first] = iter.second;
+  }
+  curModuleMap[moduleId] = moduleMap[moduleId];
+
+  saveFuncMap(max(moduleCnt, moduleId + 1), curFuncMap, curModuleMap);
+  close(lockFd);
+}
+
+void MaxAFLPass::initVariable(Module &M)
+{
+  int lockFd = -1;
+
+  // ! MAXAFL_LTO runs the pass once on the linked program: every callee is
+  // ! in this module, so there is a single module and no funcMap to share
+  ltoMode = getenv("MAXAFL_LTO") != NULL;
+  moduleId = 0;
+
+  // ! Module ids index dense tables in afl-fuzz and the runtime, so they are
+  // ! handed out sequentially; the id is reserved under the lock right away
+  if (!ltoMode)
+  {
+    lockFd = lockFile(infoPath(common::funcMapFileName + ".lock"), O_RDWR);
+    moduleId = loadFuncMap(funcMap, moduleMap);
   }
 
   common::print << "ModueId : " << moduleId << endl;
@@ -308,7 +513,9 @@ void MaxAFLPass::initVariable(Module &M)
   Float32Ty = Type::getFloatTy(C);
   Double64Ty = Type::getDoubleTy(C);
   Int8PtrTy = PointerType::getUnqual(Int8Ty);
+  Int32PtrTy = PointerType::getUnqual(Int32Ty);
   Int64PtrTy = PointerType::getUnqual(Int64Ty);
+  DoublePtrTy = PointerType::getUnqual(Double64Ty);
 
   NoSanMetaId = C.getMDKindID("nosanitize");
   NoneMetaNode = MDNode::get(C, None);
@@ -360,63 +567,136 @@ void MaxAFLPass::initVariable(Module &M)
     VisitEtcFunc->addAttribute(~0U, Attribute::ReadNone);
   }
 
-  Type *EnterInternalArgs[1] = {Int32Ty};
-  EnterInternalTy = FunctionType::get(Int32Ty, EnterInternalArgs, false);
-  EnterInternal = M.getOrInsertFunction("__maxafl_enter_internal_call", EnterInternalTy);
-  EnterInternalFunc = dyn_cast<Function>(EnterInternal);
-  if (EnterInternalFunc)
-  {
-    EnterInternalFunc->addAttribute(~0U, Attribute::NoUnwind);
-    EnterInternalFunc->addAttribute(~0U, Attribute::ReadNone);
-  }
-
-  Type *ExitInternalArgs[1] = {Int32Ty};
-  ExitInternalTy = FunctionType::get(Int32Ty, ExitInternalArgs, false);
-  ExitInternal = M.getOrInsertFunction("__maxafl_exit_internal_call", ExitInternalTy);
-  ExitInternalFunc = dyn_cast<Function>(ExitInternal);
-  if (ExitInternalFunc)
-  {
-    ExitInternalFunc->addAttribute(~0U, Attribute::NoUnwind);
-    ExitInternalFunc->addAttribute(~0U, Attribute::ReadNone);
-  }
-
   VisitCmpIntPtr = M.getOrInsertGlobal("__maxafl_visit_integer_func", PointerType::get(VisitCmpIntTy, 0));
   VisitCmpFloatPtr = M.getOrInsertGlobal("__maxafl_visit_float_func", PointerType::get(VisitCmpFloatTy, 0));
   VisitBrPtr = M.getOrInsertGlobal("__maxafl_visit_br_func", PointerType::get(VisitBrTy, 0));
   VisitEtcPtr = M.getOrInsertGlobal("__maxafl_visit_etc_func", PointerType::get(VisitEtcTy, 0));
-  EnterInternalPtr = M.getOrInsertGlobal("__maxafl_enter_internal_call_func", PointerType::get(EnterInternalTy, 0));
-  ExitInternalPtr = M.getOrInsertGlobal("__maxafl_exit_internal_call_func", PointerType::get(ExitInternalTy, 0));
+
+  // ! Internal call penalties are added to and removed from this word inline
+  ExitPenaltyVar = M.getOrInsertGlobal("__maxafl_exit_penalty_ptr", Int32PtrTy);
+
+  // ! Every branch and compare site tests its retired bit before the probe,
+  // ! so the bounds and bitmap globals are needed in both lowerings
+  ModCntVar = M.getOrInsertGlobal("__maxafl_mod_cnt", Int32Ty);
+  BrCntVar = M.getOrInsertGlobal("__maxafl_br_cnt", Int32Ty);
+  CmpCntVar = M.getOrInsertGlobal("__maxafl_cmp_cnt", Int32Ty);
+  BrPtrVar = M.getOrInsertGlobal("__maxafl_br_ptr_ptr", Int32PtrTy);
+  CmpPtrVar = M.getOrInsertGlobal("__maxafl_cmp_ptr_ptr", Int32PtrTy);
+  BrDoneVar = M.getOrInsertGlobal("__maxafl_br_done_ptr", Int8PtrTy);
+  CmpDoneVar = M.getOrInsertGlobal("__maxafl_cmp_done_ptr", Int8PtrTy);
+
+  inlineFast = getenv("MAXAFL_INLINE") != NULL;
+  if (inlineFast)
+  {
+    Type *EvalBrArgs[2] = {Int32Ty, Int32Ty};
+    EvalBrTy = FunctionType::get(VoidTy, EvalBrArgs, false);
+    EvalBr = M.getOrInsertFunction("__maxafl_eval_br", EvalBrTy);
+    if (Function *EvalBrFunc = dyn_cast<Function>(EvalBr))
+    {
+      EvalBrFunc->addAttribute(~0U, Attribute::NoUnwind);
+    }
+
+    BrRealVar = M.getOrInsertGlobal("__maxafl_br_real_ptr", DoublePtrTy);
+    CmpRealVar = M.getOrInsertGlobal("__maxafl_cmp_real_ptr", DoublePtrTy);
+    BrHitVar = M.getOrInsertGlobal("__maxafl_br_hit_ptr", Int32PtrTy);
+    CmpHitVar = M.getOrInsertGlobal("__maxafl_cmp_hit_ptr", Int32PtrTy);
+  }
 
   std::error_code EC, EC2;
   string filename = M.getName().str();
   common::print << "filename " << filename << endl;
   filename = filename.substr(filename.rfind("/") + 1, filename.rfind(".") - filename.rfind("/") - 1);
   common::print << "original file name : " << filename << endl;
-  string fileName = filename + ".info";
-  common::print << "Info file name : " << fileName << endl;
-  infoFile = new raw_fd_ostream(fileName, EC);
+  moduleName = filename;
+
+  // ! Per-module <name>.info and <name>_opt.ll are debug artifacts only
+  resultFile = nullptr;
+  if (common::debug)
+  {
+    string fileName = filename + ".info";
+    common::print << "Info file name : " << fileName << endl;
+    infoFile = new raw_fd_ostream(fileName, EC);
 
-  string filename2 = M.getName().str();
-  filename2 = filename2.substr(filename2.rfind("/") + 1, filename2.rfind(".") - filename2.rfind("/") - 1);
-  string fileName2 = filename2 + "_opt.ll";
-  common::print << "IR file name : " << fileName2 << endl;
-  resultFile = new raw_fd_ostream(fileName2, EC);
+    string fileName2 = filename + "_opt.ll";
+    common::print << "IR file name : " << fileName2 << endl;
+    resultFile = new raw_fd_ostream(fileName2, EC);
+  }
+  else
+  {
+    infoFile = new raw_null_ostream();
+  }
 
-  string filename3 = "infofile.info";
-  comInfoFile = new raw_fd_ostream(filename3, EC, (llvm::sys::fs::OpenFlags)2);
+  comInfoFile = new raw_string_ostream(comInfoBuf);
+  comInfoBinFile = new raw_string_ostream(comInfoBinBuf);
 
   moduleMap[moduleId] = filename;
+  if (!ltoMode)
+  {
+    saveFuncMap(moduleId + 1, funcMap, moduleMap);
+    close(lockFd);
+  }
+
+  statsMode = getenv("MAXAFL_STATS") != NULL;
+  phaseTimes.clear();
+  phaseStart = std::chrono::steady_clock::now();
 
   return;
 }
 
-void MaxAFLPass::freeVariable(Module &M)
+void MaxAFLPass::endPhase(const char *name)
+{
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+  if (statsMode)
+  {
+    double ms = std::chrono::duration<double, std::milli>(now - phaseStart).count();
+    auto iter = phaseTimes.begin();
+
+    // ! Per-function phases add up under one name
+    while (iter != phaseTimes.end() && strcmp(iter->first, name))
+      iter++;
+    if (iter == phaseTimes.end())
+      phaseTimes.push_back(make_pair(name, ms));
+    else
+      iter->second += ms;
+  }
+  phaseStart = now;
+}
+
+void MaxAFLPass::reportStats(size_t funcCnt)
 {
-  infoFile->close();
-  resultFile->close();
-  comInfoFile->close();
+  size_t compound = 0;
+  int meicMin = INT_MAX, meicMax = 0;
+
+  if (!statsMode)
+    return;
+
+  for (auto &brinfo : brvec)
+  {
+    if (brinfo.cmpvec.size() > 1)
+      compound++;
+    meicMin = min(meicMin, min(brinfo.left, brinfo.right));
+    meicMax = max(meicMax, max(brinfo.left, brinfo.right));
+  }
+  if (brvec.empty())
+    meicMin = 0;
 
-  delete infoFile, resultFile, comInfoFile;
+  errs() << "[maxafl] " << moduleName << " (module " << moduleId << "): "
+         << funcCnt << " funcs, " << brvec.size() << " br (" << compound << " compound), "
+         << cmpvec.size() << " cmp, MEIC " << meicMin << ".." << meicMax << ", ms:";
+  for (auto &phase : phaseTimes)
+  {
+    errs() << " " << phase.first << " " << format("%.1f", phase.second);
+  }
+  errs() << "\n";
+}
+
+void MaxAFLPass::freeVariable(Module &M)
+{
+  delete infoFile;
+  delete resultFile;
+  delete comInfoFile;
+  delete comInfoBinFile;
 
   return;
 }
@@ -499,6 +779,10 @@ int MaxAFLPass::getCmpId(Module &M, Instruction *ins)
 
 void MaxAFLPass::printInstWithTab(Instruction *inst, int tab, string prefix)
 {
+  // ! Printing an instruction numbers its whole function, skip it outright
+  if (!common::debug)
+    return;
+
   // #ifdef _MAXAFL_DEBUG
   common::print << "[DBG]\t";
   for (int i = 0; i < tab; i++)
@@ -668,6 +952,22 @@ bool MaxAFLPass::visitBrInst(Module &M, Value *v, BrInfo &brinfo, bool no, int d
   return res;
 }
 
+// ! __maxafl_cmp_<pred>_<width>(moduleId, id, a, b) for widths 8, 16 and 32,
+// ! operands are passed as i32
+Constant *MaxAFLPass::getCmpSpecial(Module &M, unsigned pred, unsigned width)
+{
+  Type *CmpSpecialArgs[4] = {Int32Ty, Int32Ty, Int32Ty, Int32Ty};
+  string name = "__maxafl_cmp_" + CmpInst::getPredicateName((CmpInst::Predicate)pred).str() + "_" + to_string(width);
+
+  Constant *CmpSpecial = M.getOrInsertFunction(name, FunctionType::get(VoidTy, CmpSpecialArgs, false));
+  if (Function *CmpSpecialFunc = dyn_cast<Function>(CmpSpecial))
+  {
+    CmpSpecialFunc->addAttribute(~0U, Attribute::NoUnwind);
+  }
+
+  return CmpSpecial;
+}
+
 bool MaxAFLPass::visitCmpInst(Module &M, Instruction *inst, CmpInfo &cmpinfo)
 {
   // ! Insert __maxafl_visit_cmp runtime function at cmp instructions
@@ -679,6 +979,49 @@ bool MaxAFLPass::visitCmpInst(Module &M, Instruction *inst, CmpInfo &cmpinfo)
   Value *OpSArg[2];
   Value *OpZArg[2];
 
+  cmpid = getCmpId(M, inst);
+  cmptype = cmpInst->getPredicate();
+  opsize = 32;
+
+  mId = ConstantInt::get(M.getContext(), APInt(32, moduleId, false));
+  cmpId = ConstantInt::get(M.getContext(), APInt(32, cmpid, false));
+
+  // ! Plain 8/16/32/64-bit integer compares call the runtime entry point for
+  // ! their predicate and width directly. The generic probe evaluates only
+  // ! the low opsize (32) bits, so 64-bit and pointer operands are cut to
+  // ! 32 bits and take the _32 entry points. The inlined fast path lowers
+  // ! the generic probe instead, so it keeps using that.
+  Type *OpType = cmpInst->getOperand(0)->getType();
+  unsigned width = OpType->isPointerTy() ? 64 : OpType->isIntegerTy() ? OpType->getIntegerBitWidth() : 0;
+
+  if (!inlineFast && cmpInst->isIntPredicate() && (width == 8 || width == 16 || width == 32 || width == 64))
+  {
+    width = min(width, (unsigned)opsize);
+    Value *Arg[2];
+
+    for (int i = 0; i < 2; i++)
+    {
+      Arg[i] = cmpInst->getOperand(i);
+      if (Arg[i]->getType()->isPointerTy())
+      {
+        Arg[i] = IRB.CreatePtrToInt(Arg[i], Int64Ty);
+      }
+      Arg[i] = IRB.CreateZExtOrTrunc(Arg[i], Int32Ty);
+    }
+
+    CallInst *ProxyCall = IRB.CreateCall(getCmpSpecial(M, cmptype, width), {mId, cmpId, Arg[0], Arg[1]});
+    setInsNonSan(ProxyCall);
+    guardCalls.push_back(make_pair(ProxyCall, FAST_CMP_INT));
+
+    cmpinfo.moduleId = moduleId;
+    cmpinfo.id = cmpid;
+    cmpinfo.cmpType = cmptype;
+
+    cmpvec.push_back(cmpinfo);
+
+    return true;
+  }
+
   OpSArg[0] = cmpInst->getOperand(0);
   OpSArg[1] = cmpInst->getOperand(1);
   OpSArg[0] = castCmpArgType(IRB, OpSArg[0], cmpInst, true);
@@ -688,13 +1031,8 @@ bool MaxAFLPass::visitCmpInst(Module &M, Instruction *inst, CmpInfo &cmpinfo)
   OpZArg[0] = castCmpArgType(IRB, OpZArg[0], cmpInst, false);
   OpZArg[1] = castCmpArgType(IRB, OpZArg[1], cmpInst, false);
 
-  cmpid = getCmpId(M, inst);
-  cmptype = cmpInst->getPredicate();
   argtype = OpSArg[0]->getType()->getTypeID();
-  opsize = 32;
 
-  mId = ConstantInt::get(M.getContext(), APInt(32, moduleId, false));
-  cmpId = ConstantInt::get(M.getContext(), APInt(32, cmpid, false));
   cmpType = ConstantInt::get(M.getContext(), APInt(32, cmptype, false));
   argType = ConstantInt::get(M.getContext(), APInt(32, argtype, false));
   opSize = ConstantInt::get(M.getContext(), APInt(32, opsize, false));
@@ -704,18 +1042,14 @@ bool MaxAFLPass::visitCmpInst(Module &M, Instruction *inst, CmpInfo &cmpinfo)
     // CallInst *ProxyCall = IRB.CreateCall(VisitCmpIntFunc, {mId, cmpId, cmpType, argType, opSize, OpSArg[0], OpSArg[1], OpZArg[0], OpZArg[1]});
     // setInsNonSan(ProxyCall);
 
-    auto VisitCmpIntF = IRB.CreateLoad(VisitCmpIntPtr);
-    CallInst *ProxyCall = IRB.CreateCall(VisitCmpIntF, {mId, cmpId, cmpType, argType, opSize, OpSArg[0], OpSArg[1], OpZArg[0], OpZArg[1]});
-    setInsNonSan(ProxyCall);
+    emitProbe(IRB, FAST_CMP_INT, VisitCmpInt, VisitCmpIntPtr, {mId, cmpId, cmpType, argType, opSize, OpSArg[0], OpSArg[1], OpZArg[0], OpZArg[1]});
   }
   else
   {
     // CallInst *ProxyCall = IRB.CreateCall(VisitCmpFloatFunc, {mId, cmpId, cmpType, argType, opSize, OpSArg[0], OpSArg[1]});
     // setInsNonSan(ProxyCall);
 
-    auto VisitCmpFloatF = IRB.CreateLoad(VisitCmpFloatPtr);
-    CallInst *ProxyCall = IRB.CreateCall(VisitCmpFloatF, {mId, cmpId, cmpType, argType, opSize, OpSArg[0], OpSArg[1]});
-    setInsNonSan(ProxyCall);
+    emitProbe(IRB, FAST_CMP_FLOAT, VisitCmpFloat, VisitCmpFloatPtr, {mId, cmpId, cmpType, argType, opSize, OpSArg[0], OpSArg[1]});
   }
 
   cmpinfo.moduleId = moduleId;
@@ -749,9 +1083,7 @@ bool MaxAFLPass::visitEtcInst(Module &M, Instruction *inst, CmpInfo &cmpinfo)
   cmpId = ConstantInt::get(M.getContext(), APInt(32, cmpid, false));
 
   auto CastedRealVal = CastInst::CreateIntegerCast(inst, Int32Ty, 0, "", insert);
-  auto VisitEtcF = IRB.CreateLoad(VisitEtcPtr);
-  CallInst *ProxyCall = IRB.CreateCall(VisitEtcF, {mId, cmpId, CastedRealVal});
-  setInsNonSan(ProxyCall);
+  emitProbe(IRB, FAST_ETC, VisitEtc, VisitEtcPtr, {mId, cmpId, CastedRealVal});
 
   cmpinfo.moduleId = moduleId;
   cmpinfo.id = cmpid;
@@ -762,123 +1094,832 @@ bool MaxAFLPass::visitEtcInst(Module &M, Instruction *inst, CmpInfo &cmpinfo)
   return true;
 }
 
-bool MaxAFLPass::getIncomingAndBackEdge(Loop *L, BasicBlock *&Incoming, BasicBlock *&Backedge)
+// ! Append this module's record to the binary info image (see maxafl-info.h)
+void MaxAFLPass::saveInfoImage(raw_ostream &out)
 {
-  BasicBlock *H = L->getHeader();
+  maxafl_info_rec_t rec;
+  u32 vecCnt = 0;
 
-  Incoming = nullptr;
-  Backedge = nullptr;
-  pred_iterator PI = pred_begin(H);
-  assert(PI != pred_end(H) && "Loop must have at least one backedge!");
-  Backedge = *PI++;
-  if (PI == pred_end(H))
-    return false; // dead loop
-  Incoming = *PI++;
-  if (PI != pred_end(H))
-    return false; // multiple backedges?
+  for (auto &brinfo : brvec)
+    vecCnt += brinfo.cmpvec.size();
 
-  if (L->contains(Incoming))
+  vector<char> payload(MAXAFL_INFO_PAYLOAD(cmpvec.size(), brvec.size(), vecCnt), 0);
+  maxafl_info_cmp_t *cmps = (maxafl_info_cmp_t *)payload.data();
+  maxafl_info_br_t *brs = (maxafl_info_br_t *)(cmps + cmpvec.size());
+  s16 *vec = (s16 *)(brs + brvec.size());
+
+  for (auto &cmpinfo : cmpvec)
   {
-    if (L->contains(Backedge))
-      return false;
-    std::swap(Incoming, Backedge);
+    cmps->id = cmpinfo.id;
+    cmps->cmpType = cmpinfo.cmpType;
+    cmps++;
+  }
+  for (auto &brinfo : brvec)
+  {
+    brs->id = brinfo.id;
+    brs->left = brinfo.left;
+    brs->right = brinfo.right;
+    brs->cmpSize = brinfo.cmpvec.size();
+    brs++;
+    for (auto &cmp : brinfo.cmpvec)
+    {
+      *vec++ = cmp.id;
+      *vec++ = cmp.cmpType;
+      *vec++ = cmp.no;
+    }
   }
-  else if (!L->contains(Backedge))
-    return false;
 
-  assert(Incoming && Backedge && "expected non-null incoming and backedges");
-  return true;
+  rec.magic = MAXAFL_INFO_MAGIC;
+  rec.version = MAXAFL_INFO_VERSION;
+  rec.module_id = moduleId;
+  rec.cmp_cnt = cmpvec.size();
+  rec.br_cnt = brvec.size();
+  rec.vec_cnt = vecCnt;
+  rec.payload_len = payload.size();
+  rec.checksum = hash32(payload.data(), payload.size(), MAXAFL_INFO_MAGIC);
+
+  out.write((const char *)&rec, sizeof(rec));
+  out.write(payload.data(), payload.size());
 }
 
-void MaxAFLPass::getBackedges(Loop *L, set<BackEdge> &backEdgeSet)
+// ! Emit one runtime probe: an indirect call through the __maxafl_*_func
+// ! pointer (queued for guardProbes() unless it is an etc site), or in
+// ! inline mode a direct call queued for lowerFastPaths()
+CallInst *MaxAFLPass::emitProbe(IRBuilder<> &IRB, FastKind kind, Constant *Func, Constant *FuncPtr, ArrayRef<Value *> Args)
 {
-  BasicBlock *header = L->getHeader();
+  CallInst *ProxyCall;
 
-  BasicBlock *incoming, *backedge;
-  if (getIncomingAndBackEdge(L, incoming, backedge) == false)
+  if (inlineFast)
   {
-    common::print << "[WARN]\tCannot get backedges from loop!" << endl;
+    ProxyCall = IRB.CreateCall(Func, Args);
+    fastCalls.push_back(make_pair(ProxyCall, kind));
+  }
+  else
+  {
+    auto ProxyF = IRB.CreateLoad(FuncPtr);
+    ProxyCall = IRB.CreateCall(ProxyF, Args);
+    if (kind != FAST_ETC)
+    {
+      guardCalls.push_back(make_pair(ProxyCall, kind));
+    }
   }
+  setInsNonSan(ProxyCall);
 
-  backEdgeSet.insert(BackEdge(header, backedge));
+  return ProxyCall;
+}
 
-  vector<Loop *> subLoops = L->getSubLoops();
-  // common::print << "Subloop size : " << subLoops.size() << endl;
-  // common::print << "End : " << subLoops.end() - subLoops.begin() << ", Same? : " << (subLoops.begin() == subLoops.end()) << endl;
-  // for (vector<Loop *>::iterator iter = subLoops.begin(); iter != subLoops.end(); iter++)
-  // {
-  //   getBackedges(*iter, backEdgeSet);
-  // }
+Value *MaxAFLPass::createLoad(IRBuilder<> &IRB, Type *Ty, Value *Ptr)
+{
+  LoadInst *Load = IRB.CreateLoad(Ty, Ptr);
+  setInsNonSan(Load);
+  return Load;
+}
 
-  // for (int i = 0; i < subLoops.size(); i++)
-  // {
-  //   auto subLoop = subLoops[i];
-  //   common::print << "[DBG]\t SubLoop : " << subLoop << endl;
-  // }
+void MaxAFLPass::createStore(IRBuilder<> &IRB, Value *V, Value *Ptr)
+{
+  setInsNonSan(IRB.CreateStore(V, Ptr));
+}
 
-  for (auto subLoop : subLoops)
-  {
-    getBackedges(subLoop, backEdgeSet);
-  }
+// ! Add (enter) or remove (exit) an internal call's penalty. Two loads and a
+// ! store on a word afl-fuzz clears before every exec; no runtime call.
+void MaxAFLPass::emitPenalty(IRBuilder<> &IRB, Value *Delta, bool enter)
+{
+  Value *Penalty = createLoad(IRB, Int32PtrTy, ExitPenaltyVar);
+  Value *Cur = createLoad(IRB, Int32Ty, Penalty);
+
+  createStore(IRB, enter ? IRB.CreateAdd(Cur, Delta) : IRB.CreateSub(Cur, Delta), Penalty);
 }
 
-void MaxAFLPass::getLoopBB(Loop *L, set<BasicBlock *> &loopBBSet)
+// ! A longjmp() out of internal calls skips their exit updates. Snapshot the
+// ! penalty before every returns_twice call (setjmp and friends) and put it
+// ! back after it, so landing there again restores the value that was right
+// ! for this frame. The snapshot is never written after the call, so it
+// ! survives the longjmp.
+void MaxAFLPass::keepPenaltyAcrossSetjmp(Function &F)
 {
-  SmallVector<BasicBlock *, 4> latchBlocks;
+  vector<CallInst *> calls;
 
-  latchBlocks.clear();
-  L->getLoopLatches(latchBlocks);
-  for (auto latchBlock : latchBlocks)
+  for (auto &BB : F)
   {
-    loopBBSet.insert(latchBlock);
+    for (auto &I : BB)
+    {
+      CallInst *CI = dyn_cast<CallInst>(&I);
+      if (CI && CI->hasFnAttr(Attribute::ReturnsTwice) && CI->getNextNode())
+      {
+        calls.push_back(CI);
+      }
+    }
   }
 
-  vector<Loop *> subLoops = L->getSubLoops();
-  common::print << "Subloop size2 : " << subLoops.size() << endl;
-  common::print << "End2 : " << subLoops.end() - subLoops.begin() << ", Same? : " << (subLoops.begin() == subLoops.end()) << endl;
-  for (auto subLoop : subLoops)
+  for (CallInst *CI : calls)
   {
-    getLoopBB(subLoop, loopBBSet);
+    IRBuilder<> IRB(CI);
+    Value *Saved = createLoad(IRB, Int32Ty, createLoad(IRB, Int32PtrTy, ExitPenaltyVar));
+
+    IRB.SetInsertPoint(CI->getNextNode());
+    createStore(IRB, Saved, createLoad(IRB, Int32PtrTy, ExitPenaltyVar));
   }
-  // Loop::getIncomingAndBackEdge
 }
 
-bool MaxAFLPass::runOnModule(Module &M)
+// ! The bounds checks every runtime hook starts with. On return At is the
+// ! terminator of a block that only runs for a valid site, and the site's
+// ! index into the state arrays is returned.
+Value *MaxAFLPass::emitSiteIndex(Instruction *&At, Value *mId, Value *id, Constant *PtrVar, Constant *CntVar)
 {
-  // ! Initialize variables.
-  initVariable(M);
+  IRBuilder<> IRB(At);
 
-  // ####################################################################
-  //              Phase 0 : Delete dead code
-  // ####################################################################
+  // __maxafl_mod_cnt stays 0 until the runtime has validated the segment
+  Value *ModOk = IRB.CreateICmpULT(mId, createLoad(IRB, Int32Ty, ModCntVar));
+  At = SplitBlockAndInsertIfThen(ModOk, At, false);
 
-  // TargetTransformInfoWrapperPass *TTI = getAnalysisIfAvailable<TargetTransformInfoWrapperPass>();
-  // for (auto &F : M)
-  // {
-  //   TargetTransformInfo &tti = TTI->getTTI(F);
-  //   for (auto &BB : F)
-  //   {
-  //     BB.print(common::print);
-  //     common::print << endl;
-  //     simplifyCFG(&BB, tti);
-  //     common::print << "AFTER : \n";
-  //     BB.print(common::print);
-  //     common::print << endl;
-  //     // SimplifyInstructionsInBlock(&BB);
-  //   }
-  // }
+  IRB.SetInsertPoint(At);
+  Value *Table = createLoad(IRB, Int32PtrTy, PtrVar);
+  Value *Base = createLoad(IRB, Int32Ty, IRB.CreateInBoundsGEP(Int32Ty, Table, mId));
+  Value *Idx = IRB.CreateAdd(Base, id);
+  Value *IdxOk = IRB.CreateICmpULT(Idx, createLoad(IRB, Int32Ty, CntVar));
+  At = SplitBlockAndInsertIfThen(IdxOk, At, false);
 
-  // FunctionPass *dcePass = createDeadCodeEliminationPass();
-  // for (auto &F : M)
-  // {
-  //   if (F.getBasicBlockList().size() == 0)
-  //   {
-  //     continue;
-  //   }
-  //   F.print(common::print);
-  //   dcePass->runOnFunction(F);
-  //   common::print << "AFTER :\n";
-  //   F.print(common::print);
+  return Idx;
+}
+
+// ! Skip a site afl-fuzz has retired: its bit in the br_done / cmp_done
+// ! bitmap is tested before any of the site's state is loaded or the hook
+// ! is called. On return At only runs for a site that is still open.
+void MaxAFLPass::emitDoneCheck(Instruction *&At, Value *Idx, Constant *DoneVar)
+{
+  IRBuilder<> IRB(At);
+  Value *Map = createLoad(IRB, Int8PtrTy, DoneVar);
+  Value *Byte = createLoad(IRB, Int8Ty, IRB.CreateInBoundsGEP(Int8Ty, Map, IRB.CreateZExt(IRB.CreateLShr(Idx, 3), Int64Ty)));
+  Value *Bit = IRB.CreateShl(ConstantInt::get(Int8Ty, 1), IRB.CreateTrunc(IRB.CreateAnd(Idx, 7), Int8Ty));
+  Value *Open = IRB.CreateICmpEQ(IRB.CreateAnd(Byte, Bit), ConstantInt::get(Int8Ty, 0));
+  At = SplitBlockAndInsertIfThen(Open, At, false);
+}
+
+// ! Append Idx to a hit list the first time the site is reached, i.e. while
+// ! its real value is still BR_NOHIT. Code inserted before At afterwards
+// ! runs whether or not the append happened.
+void MaxAFLPass::emitHitAppend(Instruction *At, Value *Real, Value *Idx, Constant *HitVar, Constant *CntVar)
+{
+  IRBuilder<> IRB(At);
+  Value *NoHit = IRB.CreateFCmpOEQ(Real, ConstantFP::get(Double64Ty, BR_NOHIT));
+  Instruction *Then = SplitBlockAndInsertIfThen(NoHit, At, false);
+
+  IRB.SetInsertPoint(Then);
+  Value *List = createLoad(IRB, Int32PtrTy, HitVar);
+  Value *Cnt = createLoad(IRB, Int32Ty, List);
+  Value *Room = IRB.CreateICmpULE(Cnt, createLoad(IRB, Int32Ty, CntVar));
+  Then = SplitBlockAndInsertIfThen(Room, Then, false);
+
+  IRB.SetInsertPoint(Then);
+  createStore(IRB, Idx, IRB.CreateInBoundsGEP(Int32Ty, List, IRB.CreateZExt(Cnt, Int64Ty)));
+  createStore(IRB, IRB.CreateAdd(Cnt, ConstantInt::get(Int32Ty, 1)), List);
+}
+
+// ! Distance __maxafl_visit_cmp_integer() / __maxafl_visit_cmp_float() would
+// ! store for the probe CI, computed in IR. The predicate and operand size
+// ! are constants, so only the arithmetic of one case is emitted. Returns
+// ! nullptr for predicates the runtime leaves untouched.
+Value *MaxAFLPass::emitCmpDistance(IRBuilder<> &IRB, CallInst *CI, bool isInt)
+{
+  unsigned pred = cast<ConstantInt>(CI->getArgOperand(2))->getZExtValue();
+  bool neg = false, noZero = false;
+  Value *D;
+
+  auto absDiff = [&](Value *X, Value *Y) -> Value * {
+    return IRB.CreateSelect(IRB.CreateFCmpOGT(X, Y), IRB.CreateFSub(X, Y), IRB.CreateFSub(Y, X));
+  };
+
+  if (isInt)
+  {
+    unsigned size = cast<ConstantInt>(CI->getArgOperand(4))->getZExtValue();
+    Value *S[2], *Z[2];
+
+    for (int i = 0; i < 2; i++)
+    {
+      Value *SArg = CI->getArgOperand(5 + i), *ZArg = CI->getArgOperand(7 + i);
+      if (size == 8 || size == 16 || size == 32)
+      {
+        SArg = IRB.CreateTrunc(SArg, IntegerType::get(CI->getContext(), size));
+        ZArg = IRB.CreateTrunc(ZArg, IntegerType::get(CI->getContext(), size));
+      }
+      S[i] = IRB.CreateSIToFP(SArg, Double64Ty);
+      Z[i] = IRB.CreateUIToFP(ZArg, Double64Ty);
+    }
+
+    switch (pred)
+    {
+    case CmpInst::ICMP_NE:
+      neg = true;
+    case CmpInst::ICMP_EQ:
+    {
+      Value *SD = absDiff(S[0], S[1]), *ZD = absDiff(Z[0], Z[1]);
+      D = IRB.CreateSelect(IRB.CreateFCmpOLT(SD, ZD), SD, ZD);
+      noZero = true;
+      break;
+    }
+    case CmpInst::ICMP_ULE:
+      neg = true;
+    case CmpInst::ICMP_UGT:
+      D = IRB.CreateFSub(Z[1], Z[0]);
+      break;
+    case CmpInst::ICMP_SLE:
+      neg = true;
+    case CmpInst::ICMP_SGT:
+      D = IRB.CreateFSub(S[1], S[0]);
+      break;
+    case CmpInst::ICMP_ULT:
+      neg = true;
+    case CmpInst::ICMP_UGE:
+      D = IRB.CreateFSub(Z[1], Z[0]);
+      noZero = true;
+      break;
+    case CmpInst::ICMP_SLT:
+      neg = true;
+    case CmpInst::ICMP_SGE:
+      D = IRB.CreateFSub(S[1], S[0]);
+      noZero = true;
+      break;
+    default:
+      return nullptr;
+    }
+  }
+  else
+  {
+    Value *F1 = CI->getArgOperand(5), *F2 = CI->getArgOperand(6);
+
+    // The float hook does not negate, so neither does this.
+    switch (pred)
+    {
+    case CmpInst::FCMP_ONE:
+    case CmpInst::FCMP_UNE:
+    case CmpInst::FCMP_OEQ:
+    case CmpInst::FCMP_UEQ:
+      D = absDiff(F1, F2);
+      noZero = true;
+      break;
+    case CmpInst::FCMP_OLE:
+    case CmpInst::FCMP_ULE:
+    case CmpInst::FCMP_OGT:
+    case CmpInst::FCMP_UGT:
+      D = IRB.CreateFSub(F2, F1);
+      break;
+    case CmpInst::FCMP_OLT:
+    case CmpInst::FCMP_ULT:
+    case CmpInst::FCMP_OGE:
+    case CmpInst::FCMP_UGE:
+      D = IRB.CreateFSub(F2, F1);
+      noZero = true;
+      break;
+    default:
+      return nullptr;
+    }
+  }
+
+  if (noZero)
+  {
+    Value *IsZero = IRB.CreateFCmpOEQ(D, ConstantFP::get(Double64Ty, 0.0));
+    D = IRB.CreateSelect(IsZero, ConstantFP::get(Double64Ty, -0.0), D);
+  }
+  if (neg)
+  {
+    D = IRB.CreateFMul(D, ConstantFP::get(Double64Ty, -1.0));
+  }
+
+  return D;
+}
+
+// ! Replace the direct calls queued by emitProbe() with the fast path of the
+// ! runtime hooks: bounds checks, the retired-site bit, the BR_SUCC /
+// ! BR_FINISH early exit, the hit-list append and the distance store. Only a
+// ! branch that is still open calls into __maxafl_eval_br() for its compound
+// ! predicate.
+void MaxAFLPass::lowerFastPaths(Module &M)
+{
+  for (auto &probe : fastCalls)
+  {
+    CallInst *CI = probe.first;
+    Instruction *At = CI;
+    Value *mId = CI->getArgOperand(0);
+
+    switch (probe.second)
+    {
+    case FAST_ETC:
+    {
+      Value *Idx = emitSiteIndex(At, mId, CI->getArgOperand(1), CmpPtrVar, CmpCntVar);
+      IRBuilder<> IRB(At);
+      Value *RealP = IRB.CreateInBoundsGEP(Double64Ty, createLoad(IRB, DoublePtrTy, CmpRealVar), IRB.CreateZExt(Idx, Int64Ty));
+
+      createStore(IRB, IRB.CreateSIToFP(CI->getArgOperand(2), Double64Ty), RealP);
+      break;
+    }
+
+    case FAST_CMP_INT:
+    case FAST_CMP_FLOAT:
+    {
+      Value *Idx = emitSiteIndex(At, mId, CI->getArgOperand(1), CmpPtrVar, CmpCntVar);
+      emitDoneCheck(At, Idx, CmpDoneVar);
+      IRBuilder<> IRB(At);
+      Value *RealP = IRB.CreateInBoundsGEP(Double64Ty, createLoad(IRB, DoublePtrTy, CmpRealVar), IRB.CreateZExt(Idx, Int64Ty));
+      Value *Real = createLoad(IRB, Double64Ty, RealP);
+
+      At = SplitBlockAndInsertIfThen(IRB.CreateFCmpUNE(Real, ConstantFP::get(Double64Ty, BR_SUCC)), At, false);
+      emitHitAppend(At, Real, Idx, CmpHitVar, CmpCntVar);
+
+      IRB.SetInsertPoint(At);
+      if (Value *D = emitCmpDistance(IRB, CI, probe.second == FAST_CMP_INT))
+      {
+        createStore(IRB, D, RealP);
+      }
+      break;
+    }
+
+    case FAST_BR:
+    {
+      Value *Idx = emitSiteIndex(At, mId, CI->getArgOperand(1), BrPtrVar, BrCntVar);
+      emitDoneCheck(At, Idx, BrDoneVar);
+      IRBuilder<> IRB(At);
+      Value *RealP = IRB.CreateInBoundsGEP(Double64Ty, createLoad(IRB, DoublePtrTy, BrRealVar), IRB.CreateZExt(Idx, Int64Ty));
+      Value *Real = createLoad(IRB, Double64Ty, RealP);
+      Value *Open = IRB.CreateAnd(IRB.CreateFCmpUNE(Real, ConstantFP::get(Double64Ty, BR_SUCC)),
+                                  IRB.CreateFCmpUNE(Real, ConstantFP::get(Double64Ty, BR_FINISH)));
+
+      At = SplitBlockAndInsertIfThen(Open, At, false);
+      emitHitAppend(At, Real, Idx, BrHitVar, BrCntVar);
+
+      IRB.SetInsertPoint(At);
+      setInsNonSan(IRB.CreateCall(EvalBrTy, EvalBr, {mId, Idx}));
+      break;
+    }
+    }
+
+    CI->eraseFromParent();
+  }
+
+  fastCalls.clear();
+}
+
+// ! Default lowering: move every queued branch / compare call behind the
+// ! bounds checks and the retired-site bit, so a site afl-fuzz has retired
+// ! costs a few loads and a not-taken branch instead of the call. The hook
+// ! repeats the checks itself, which keeps both lowerings interchangeable.
+void MaxAFLPass::guardProbes(Module &M)
+{
+  for (auto &probe : guardCalls)
+  {
+    CallInst *CI = probe.first;
+    Instruction *At = CI;
+    bool isBr = probe.second == FAST_BR;
+    Value *Idx = emitSiteIndex(At, CI->getArgOperand(0), CI->getArgOperand(1),
+                               isBr ? BrPtrVar : CmpPtrVar, isBr ? BrCntVar : CmpCntVar);
+
+    emitDoneCheck(At, Idx, isBr ? BrDoneVar : CmpDoneVar);
+
+    // ! The function pointer load only feeds this call, so it moves too
+    LoadInst *ProxyF = dyn_cast<LoadInst>(CI->getCalledValue());
+    if (ProxyF && ProxyF->hasOneUse())
+    {
+      ProxyF->moveBefore(At);
+    }
+    CI->moveBefore(At);
+  }
+
+  guardCalls.clear();
+}
+
+bool MaxAFLPass::getIncomingAndBackEdge(Loop *L, BasicBlock *&Incoming, BasicBlock *&Backedge)
+{
+  BasicBlock *H = L->getHeader();
+
+  Incoming = nullptr;
+  Backedge = nullptr;
+  pred_iterator PI = pred_begin(H);
+  assert(PI != pred_end(H) && "Loop must have at least one backedge!");
+  Backedge = *PI++;
+  if (PI == pred_end(H))
+    return false; // dead loop
+  Incoming = *PI++;
+  if (PI != pred_end(H))
+    return false; // multiple backedges?
+
+  if (L->contains(Incoming))
+  {
+    if (L->contains(Backedge))
+      return false;
+    std::swap(Incoming, Backedge);
+  }
+  else if (!L->contains(Backedge))
+    return false;
+
+  assert(Incoming && Backedge && "expected non-null incoming and backedges");
+  return true;
+}
+
+void MaxAFLPass::getBackedges(Loop *L, set<BackEdge> &backEdgeSet)
+{
+  BasicBlock *header = L->getHeader();
+
+  BasicBlock *incoming, *backedge;
+  if (getIncomingAndBackEdge(L, incoming, backedge) == false)
+  {
+    common::print << "[WARN]\tCannot get backedges from loop!" << endl;
+  }
+
+  backEdgeSet.insert(BackEdge(header, backedge));
+
+  vector<Loop *> subLoops = L->getSubLoops();
+  // common::print << "Subloop size : " << subLoops.size() << endl;
+  // common::print << "End : " << subLoops.end() - subLoops.begin() << ", Same? : " << (subLoops.begin() == subLoops.end()) << endl;
+  // for (vector<Loop *>::iterator iter = subLoops.begin(); iter != subLoops.end(); iter++)
+  // {
+  //   getBackedges(*iter, backEdgeSet);
+  // }
+
+  // for (int i = 0; i < subLoops.size(); i++)
+  // {
+  //   auto subLoop = subLoops[i];
+  //   common::print << "[DBG]\t SubLoop : " << subLoop << endl;
+  // }
+
+  for (auto subLoop : subLoops)
+  {
+    getBackedges(subLoop, backEdgeSet);
+  }
+}
+
+void MaxAFLPass::getLoopBB(Loop *L, set<BasicBlock *> &loopBBSet)
+{
+  SmallVector<BasicBlock *, 4> latchBlocks;
+
+  latchBlocks.clear();
+  L->getLoopLatches(latchBlocks);
+  for (auto latchBlock : latchBlocks)
+  {
+    loopBBSet.insert(latchBlock);
+  }
+
+  vector<Loop *> subLoops = L->getSubLoops();
+  common::print << "Subloop size2 : " << subLoops.size() << endl;
+  common::print << "End2 : " << subLoops.end() - subLoops.begin() << ", Same? : " << (subLoops.begin() == subLoops.end()) << endl;
+  for (auto subLoop : subLoops)
+  {
+    getLoopBB(subLoop, loopBBSet);
+  }
+  // Loop::getIncomingAndBackEdge
+}
+
+// ! Dense CFG: blocks in layout order, successors (minus the loop back
+// ! edges) sorted and deduplicated in CSR form. Remaining cycles are broken
+// ! by dropping every edge that reaches a block still on the DFS stack,
+// ! which is what the boost engine does starting from the entry block.
+// ! Unreachable blocks are visited afterwards so that dead cycles cannot
+// ! break the ordering.
+void MaxAFLPass::buildCFG(Function &F, const set<BackEdge> &backEdgeSet, DenseCFG &G)
+{
+  unsigned n = 0;
+
+  G.blocks.clear();
+  G.index.clear();
+  for (auto &BB : F)
+  {
+    G.index[&BB] = n++;
+    G.blocks.push_back(&BB);
+  }
+
+  G.succBegin.assign(1, 0);
+  G.succ.clear();
+  for (unsigned b = 0; b < n; b++)
+  {
+    BasicBlock *BB = G.blocks[b];
+    unsigned first = G.succ.size();
+
+    for (BasicBlock *succ : successors(BB))
+    {
+      if (backEdgeSet.count(BackEdge(succ, BB)) == 0)
+      {
+        G.succ.push_back(G.index[succ]);
+      }
+    }
+    std::sort(G.succ.begin() + first, G.succ.end());
+    G.succ.erase(std::unique(G.succ.begin() + first, G.succ.end()), G.succ.end());
+    G.succBegin.push_back(G.succ.size());
+  }
+
+  BitVector onStack(n), done(n);
+  vector<pair<unsigned, unsigned>> stk;
+
+  G.dropped.clear();
+  G.dropped.resize(G.succ.size());
+  G.order.clear();
+
+  for (unsigned root = 0; root < n; root++)
+  {
+    if (done[root])
+    {
+      continue;
+    }
+
+    stk.push_back(make_pair(root, G.succBegin[root]));
+    onStack.set(root);
+
+    while (!stk.empty())
+    {
+      unsigned cur = stk.back().first;
+      unsigned e = stk.back().second;
+      bool pushed = false;
+
+      for (; e < G.succBegin[cur + 1]; e++)
+      {
+        unsigned succ = G.succ[e];
+
+        if (onStack[succ])
+        {
+          G.dropped.set(e);
+        }
+        else if (!done[succ])
+        {
+          stk.back().second = e + 1;
+          stk.push_back(make_pair(succ, G.succBegin[succ]));
+          onStack.set(succ);
+          pushed = true;
+          break;
+        }
+      }
+
+      if (!pushed)
+      {
+        onStack.reset(cur);
+        done.set(cur);
+        G.order.push_back(cur);
+        stk.pop_back();
+      }
+    }
+  }
+}
+
+// ! The original boost based construction, kept as the reference for
+// ! MAXAFL_CFG_ENGINE=legacy and =check
+void MaxAFLPass::buildLegacyCFG(Function &F, const set<BackEdge> &backEdgeSet, DenseCFG &G)
+{
+  typedef adjacency_list<vecS, vecS, bidirectionalS> Graph;
+  typedef Graph::vertex_descriptor Vertex;
+  typedef std::vector<Vertex> Container;
+  typedef map<MyBasicBlock, int> BBIdMap;
+  typedef map<int, MyBasicBlock> IdBBMap;
+
+  // ! Get all BasicBlocks in Function F and make map for graph id and BB
+  Graph cfG;
+  BBIdMap bbIdMap;
+  IdBBMap idBBMap;
+  int bbid = 0;
+  for (auto &BB : F)
+  {
+    MyBasicBlock mBB(&BB);
+    bbid = add_vertex(cfG);
+    bbIdMap[mBB] = bbid;
+    idBBMap[bbid] = mBB;
+  }
+
+  typedef set<BasicBlock *> PredSet;
+  PredSet predSet;
+  for (auto &BB : F)
+  {
+    // ! Get all parent BasicBlocks and remove duplicate
+    pred_iterator PI = pred_begin(&BB), E = pred_end(&BB);
+
+    if (PI == E)
+    {
+      continue;
+    }
+
+    predSet.clear();
+    for (auto iter = PI; iter != E; iter++)
+    {
+      BasicBlock *pred = *iter;
+      predSet.insert(pred);
+    }
+
+    // ! Add edges to graph without edge in loop block
+    for (auto iter : predSet)
+    {
+      // if (loopBBSet.count(iter) <= 0 || getSimpleNodeNumber(&BB, &F) > getSimpleNodeNumber(iter, &F))
+      // {
+      //   if (lookup_edge(bbIdMap[&BB], bbIdMap[iter], cfG).second == false)
+      //   {
+      //     add_edge(bbIdMap[&BB], bbIdMap[iter], cfG);
+      //   }
+      // }
+      if (backEdgeSet.count(BackEdge(&BB, iter)) == 0)
+      {
+        if (lookup_edge(bbIdMap[&BB], bbIdMap[iter], cfG).second == false)
+        {
+          add_edge(bbIdMap[&BB], bbIdMap[iter], cfG);
+        }
+      }
+      else
+      {
+        common::print << "Ignore backedge..." << endl;
+      }
+    }
+  }
+
+  for (auto vd : make_iterator_range(vertices(cfG)))
+  {
+    if (out_degree(vd, cfG) == 0)
+    {
+      common::print << "\tVertex Name" << getSimpleNodeLabel(idBBMap[vd].ptr, &F) << "Out-degree : " << out_degree(vd, cfG) << ", \tIn-degree : " << in_degree(vd, cfG) << endl;
+    }
+  }
+
+  // ! Remove cycles in CFG using DFS-like algorithm.
+  BasicBlock &entryBB = F.getEntryBlock();
+  stack<Vertex> stk;
+  Vertex cur;
+  set<Vertex> visited;
+  set<Vertex> finished;
+  stk.push(bbIdMap[&entryBB]);
+  while (!stk.empty())
+  {
+    set<Vertex> removed;
+
+    cur = stk.top();
+
+    if (visited.count(cur) == 0)
+    {
+      visited.insert(cur);
+    }
+
+    Graph::in_edge_iterator begin, end;
+    for (tie(begin, end) = in_edges(cur, cfG); begin != end; begin++)
+    {
+      Vertex src = source(*begin, cfG);
+      if (visited.count(src) > 0)
+      {
+        removed.insert(src);
+      }
+      else if (finished.count(src) == 0)
+      {
+        stk.push(src);
+        break;
+      }
+    }
+    for (auto src : removed)
+    {
+      remove_edge(src, cur, cfG);
+    }
+    if (cur == stk.top())
+    {
+      visited.erase(cur);
+      finished.insert(cur);
+      stk.pop();
+    }
+  }
+
+  if (F.hasName() && F.getName() == "aout_32_final_link")
+  {
+    common::print << "graphviz" << endl;
+    ofstream ofs;
+    ofs.open("aout_32_final_link.dot", ofstream::out);
+    // write_graphviz(ofs, cfG);
+    // write_graphviz(ofs, cfG);
+    ofs.close();
+  }
+
+  // ! Execute topological sort in CFG to get order of BasicBlocks
+  Container topo_cfG;
+  topological_sort(cfG, std::back_inserter(topo_cfG));
+
+  // ! Convert to the dense form, vertices were added in layout order
+  G.blocks.clear();
+  G.index.clear();
+  G.succBegin.assign(1, 0);
+  G.succ.clear();
+  G.order.clear();
+  for (unsigned b = 0; b < num_vertices(cfG); b++)
+  {
+    Graph::in_edge_iterator begin, end;
+
+    G.blocks.push_back(idBBMap[b].ptr);
+    G.index[idBBMap[b].ptr] = b;
+    for (tie(begin, end) = in_edges(b, cfG); begin != end; begin++)
+    {
+      G.succ.push_back(source(*begin, cfG));
+    }
+    G.succBegin.push_back(G.succ.size());
+  }
+  G.dropped.clear();
+  G.dropped.resize(G.succ.size());
+  for (Container::reverse_iterator jj = topo_cfG.rbegin(); jj != topo_cfG.rend(); jj++)
+  {
+    G.order.push_back(*jj);
+  }
+}
+
+// ! MEIC of a block: its own instructions, the MEIC of every internal
+// ! function it calls and the largest MEIC among its successors
+void MaxAFLPass::computeMEIC(DenseCFG &G, vector<int> &meic, vector<int> &maxChild, vector<Instruction *> &internalCalls)
+{
+  unsigned n = G.blocks.size();
+
+  meic.assign(n, 0);
+  maxChild.assign(n, 0);
+  internalCalls.assign(n, nullptr);
+
+  for (unsigned b : G.order)
+  {
+    bool isExitNode = false;
+    BasicBlock *BB = G.blocks[b];
+    Instruction *internalCall = nullptr;
+
+    meic[b] = BB->getInstList().size();
+
+    // ! Add MEIC of called function
+    for (auto &inst : *BB)
+    {
+      if (isa<CallInst>(inst))
+      {
+        CallInst &callInst = (CallInst &)inst;
+        Function *calledFunc = callInst.getCalledFunction();
+        if (calledFunc == NULL)
+        {
+          continue;
+        }
+        if (!calledFunc->hasName() || calledFunc->getName().empty())
+        {
+          common::print << "called to no-named function!" << endl;
+        }
+        else
+        {
+          string funcName = calledFunc->getName().str();
+          if (funcMap.count(funcName) > 0)
+          {
+            internalCall = &inst;
+
+            moduleDep.insert(funcMap[funcName].first);
+            meic[b] += funcMap[funcName].second;
+            if (funcName == "ErrFatal")
+            {
+              common::print << "[DBG]\tThis is Exit Node" << endl;
+              isExitNode = true;
+            }
+          }
+        }
+      }
+    }
+
+    if (!isExitNode)
+    {
+      // ! Select greater MEIC of child of current BasicBlock
+      int maxInstCnt = 0;
+      for (unsigned e = G.succBegin[b]; e < G.succBegin[b + 1]; e++)
+      {
+        if (!G.dropped[e])
+        {
+          maxInstCnt = max(maxInstCnt, meic[G.succ[e]]);
+        }
+      }
+      meic[b] += maxInstCnt;
+      maxChild[b] = maxInstCnt;
+      internalCalls[b] = internalCall;
+    }
+  }
+}
+
+bool MaxAFLPass::runOnModule(Module &M)
+{
+  // ! Initialize variables.
+  initVariable(M);
+
+  // ####################################################################
+  //              Phase 0 : Delete dead code
+  // ####################################################################
+
+  // TargetTransformInfoWrapperPass *TTI = getAnalysisIfAvailable<TargetTransformInfoWrapperPass>();
+  // for (auto &F : M)
+  // {
+  //   TargetTransformInfo &tti = TTI->getTTI(F);
+  //   for (auto &BB : F)
+  //   {
+  //     BB.print(common::print);
+  //     common::print << endl;
+  //     simplifyCFG(&BB, tti);
+  //     common::print << "AFTER : \n";
+  //     BB.print(common::print);
+  //     common::print << endl;
+  //     // SimplifyInstructionsInBlock(&BB);
+  //   }
+  // }
+
+  // FunctionPass *dcePass = createDeadCodeEliminationPass();
+  // for (auto &F : M)
+  // {
+  //   if (F.getBasicBlockList().size() == 0)
+  //   {
+  //     continue;
+  //   }
+  //   F.print(common::print);
+  //   dcePass->runOnFunction(F);
+  //   common::print << "AFTER :\n";
+  //   F.print(common::print);
   // }
 
   // ####################################################################
@@ -1025,32 +2066,35 @@ bool MaxAFLPass::runOnModule(Module &M)
   }
   common::print << endl;
 
+  endPhase("callgraph");
+
   // ####################################################################
   //              Phase 2 : Analyze each CFG of funciton.
   // ####################################################################
 
-  typedef Graph::vertex_descriptor Vertex;
-  typedef std::vector<Vertex> Container;
-  typedef map<MyBasicBlock, int> BBIdMap;
-  typedef map<int, MyBasicBlock> IdBBMap;
-
-  map<Function *, std::tuple<Graph, Container, BBIdMap, IdBBMap, set<BasicBlock *>>> cfGMap;
+  // ! Functions are analyzed and instrumented one at a time, callees first,
+  // ! so only the CFG of the current function is alive.
   set<Function *> userFuncSet;
+  DenseCFG cfg, legacyCfg;
+  vector<int> meic, maxChild, legacyMeic, legacyMaxChild;
+  vector<Instruction *> internalCalls, legacyInternalCalls;
+  const char *engine = getenv("MAXAFL_CFG_ENGINE");
+  bool useLegacy = engine && !strcmp(engine, "legacy");
+  bool checkEngine = engine && !strcmp(engine, "check");
 
-  for (auto &F : M)
+  for (Container::reverse_iterator ii = topo_callG.rbegin(); ii != topo_callG.rend(); ii++)
   {
-    // ! Skip special function that has only declaration
-    if (F.isDeclaration())
-      continue;
+    Function *F = idPtrMap[*ii];
 
-    // if (F.hasName())
-    // {
-    //   common::print << "Function Name : " << F.getName() << endl;
-    // }
+    // ! Skip the external node and functions that have only declaration
+    if (F == nullptr || F->isDeclaration())
+    {
+      continue;
+    }
 
-    userFuncSet.insert(&F);
+    userFuncSet.insert(F);
 
-    LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+    LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>(*F).getLoopInfo();
 
     // ! Get Loop Backedges in Function F
     set<BackEdge> backEdgeSet;
@@ -1074,269 +2118,81 @@ bool MaxAFLPass::runOnModule(Module &M)
       BasicBlock *loopBB = iter->getSingleSuccessor();
       if (loopBB != nullptr)
       {
-        // Metadata *MDs[] = {ConstantAsMetadata::get(ConstantInt::get(Type::getInt32Ty(M.getContext()), 1))};
         loopBB->getInstList().begin()->setMetadata(LoopCmpMetaId, MDNode::get(M.getContext(), MDs));
       }
-      // common::print << "[DBG] LoopBBSet : " << getSimpleNodeLabel(iter, &F) << endl;
     }
 
-    // ! Get all BasicBlocks in Function F and make map for graph id and BB
-    Graph cfG;
-    BBIdMap bbIdMap;
-    IdBBMap idBBMap;
-    int bbid = 0;
-    for (auto &BB : F)
+    if (useLegacy)
     {
-      MyBasicBlock mBB(&BB);
-      bbid = add_vertex(cfG);
-      bbIdMap[mBB] = bbid;
-      idBBMap[bbid] = mBB;
+      buildLegacyCFG(*F, backEdgeSet, cfg);
     }
-
-    typedef set<BasicBlock *> PredSet;
-    PredSet predSet;
-    for (auto &BB : F)
+    else
     {
-      // ! Get all parent BasicBlocks and remove duplicate
-      pred_iterator PI = pred_begin(&BB), E = pred_end(&BB);
+      buildCFG(*F, backEdgeSet, cfg);
+    }
+    endPhase("cfg");
 
-      if (PI == E)
-      {
-        continue;
-      }
+    // ####################################################################
+    //              Phase 3 : Calculate MEIC
+    // ####################################################################
 
-      predSet.clear();
-      for (auto iter = PI; iter != E; iter++)
-      {
-        BasicBlock *pred = *iter;
-        predSet.insert(pred);
-      }
+    computeMEIC(cfg, meic, maxChild, internalCalls);
 
-      // ! Add edges to graph without edge in loop block
-      for (auto iter : predSet)
+    // ! MAXAFL_CFG_ENGINE=check also runs the boost engine and requires
+    // ! both to agree on every block
+    if (checkEngine)
+    {
+      endPhase("meic+inst");
+      buildLegacyCFG(*F, backEdgeSet, legacyCfg);
+      computeMEIC(legacyCfg, legacyMeic, legacyMaxChild, legacyInternalCalls);
+      for (unsigned b = 0; b < meic.size(); b++)
       {
-        // if (loopBBSet.count(iter) <= 0 || getSimpleNodeNumber(&BB, &F) > getSimpleNodeNumber(iter, &F))
-        // {
-        //   if (lookup_edge(bbIdMap[&BB], bbIdMap[iter], cfG).second == false)
-        //   {
-        //     add_edge(bbIdMap[&BB], bbIdMap[iter], cfG);
-        //   }
-        // }
-        if (backEdgeSet.count(BackEdge(&BB, iter)) == 0)
-        {
-          if (lookup_edge(bbIdMap[&BB], bbIdMap[iter], cfG).second == false)
-          {
-            add_edge(bbIdMap[&BB], bbIdMap[iter], cfG);
-          }
-        }
-        else
+        if (meic[b] != legacyMeic[b] || maxChild[b] != legacyMaxChild[b])
         {
-          common::print << "Ignore backedge..." << endl;
+          errs() << "[maxafl] " << F->getName() << ": block " << b << " MEIC " << meic[b]
+                 << " (legacy " << legacyMeic[b] << ")\n";
+          report_fatal_error("maxafl-pass: dense and legacy CFG engines disagree");
         }
       }
+      endPhase("cfg-legacy");
     }
 
-    for (auto vd : make_iterator_range(vertices(cfG)))
+    // ! Report entry into and exit from internal calls with the MEIC of the
+    // ! remaining path as penalty
+    for (unsigned b : cfg.order)
     {
-      if (out_degree(vd, cfG) == 0)
-      {
-        common::print << "\tVertex Name" << getSimpleNodeLabel(idBBMap[vd].ptr, &F) << "Out-degree : " << out_degree(vd, cfG) << ", \tIn-degree : " << in_degree(vd, cfG) << endl;
-      }
-    }
+      Instruction *internalCall = internalCalls[b];
 
-    // ! Remove cycles in CFG using DFS-like algorithm.
-    BasicBlock &entryBB = F.getEntryBlock();
-    stack<Vertex> stk;
-    Vertex cur;
-    set<Vertex> visited;
-    set<Vertex> finished;
-    stk.push(bbIdMap[&entryBB]);
-    while (!stk.empty())
-    {
-      set<Vertex> removed;
-
-      cur = stk.top();
-
-      if (visited.count(cur) == 0)
+      if (internalCall == nullptr)
       {
-        visited.insert(cur);
+        continue;
       }
 
-      Graph::in_edge_iterator begin, end;
-      for (tie(begin, end) = in_edges(cur, cfG); begin != end; begin++)
+      IRBuilder<> IRB(internalCall);
+      if (!internalCall->getNextNode())
       {
-        Vertex src = source(*begin, cfG);
-        if (visited.count(src) > 0)
-        {
-          removed.insert(src);
-        }
-        else if (finished.count(src) == 0)
-        {
-          stk.push(src);
-          break;
-        }
-      }
-      for (auto src : removed)
-      {
-        remove_edge(src, cur, cfG);
+        common::print << "[ERR] internal Call is tail of the BB" << endl;
       }
-      if (cur == stk.top())
-      {
-        visited.erase(cur);
-        finished.insert(cur);
-        stk.pop();
-      }
-    }
 
-    if (F.hasName() && F.getName() == "aout_32_final_link")
-    {
-      common::print << "graphviz" << endl;
-      ofstream ofs;
-      ofs.open("aout_32_final_link.dot", ofstream::out);
-      // write_graphviz(ofs, cfG);
-      // write_graphviz(ofs, cfG);
-      ofs.close();
-    }
+      IRBuilder<> IRB2(internalCall->getNextNode());
+      Value *penalty;
 
-    // ! Execute topological sort in CFG to get order of BasicBlocks
-    Container topo_cfG;
-    topological_sort(cfG, std::back_inserter(topo_cfG));
-
-    // ! Save CFG information of function as tuple
-    cfGMap[&F] = std::tuple<Graph, Container, BBIdMap, IdBBMap, set<BasicBlock *>>(cfG, topo_cfG, bbIdMap, idBBMap, loopBBSet);
-  }
-
-  // ####################################################################
-  //              Phase 3 : Calculate MEIC
-  // ####################################################################
+      penalty = ConstantInt::get(M.getContext(), APInt(32, maxChild[b], false));
 
-  // ! Iterate Function
-  for (Container::reverse_iterator ii = topo_callG.rbegin(); ii != topo_callG.rend(); ii++)
-  {
-    Function *F = idPtrMap[*ii];
-
-    // ! Skip special case that has no funciton
-    if (userFuncSet.count(F) == 0)
-    {
-      continue;
+      emitPenalty(IRB, penalty, true);
+      emitPenalty(IRB2, penalty, false);
     }
 
-    // ! Load saved CFG information of the function
-    Graph &cfG = std::get<0>(cfGMap[F]);
-    Container &topo_cfG = std::get<1>(cfGMap[F]);
-    BBIdMap &bbIdMap = std::get<2>(cfGMap[F]);
-    IdBBMap &idBBMap = std::get<3>(cfGMap[F]);
-    // set<BasicBlock *> &loopBBSet = std::get<4>(cfGMap[F]);
-
-    // ! Iterate CallGraph reversely and calculate MEIC of function
-    for (Container::reverse_iterator jj = topo_cfG.rbegin(); jj != topo_cfG.rend(); jj++)
-    {
-      bool isExitNode = false;
-      MyBasicBlock &mBB = idBBMap[*jj];
-      mBB.instCnt = mBB.ptr->getInstList().size();
-
-      Instruction *internalCall = nullptr;
-
-      // ! Add MEIC of called function
-      for (auto &inst : *(mBB.ptr))
-      {
-        if (isa<CallInst>(inst))
-        {
-          CallInst &callInst = (CallInst &)inst;
-          Function *calledFunc = callInst.getCalledFunction();
-          if (calledFunc == NULL)
-          {
-            continue;
-          }
-          if (!calledFunc->hasName() || calledFunc->getName().empty())
-          {
-            common::print << "called to no-named function!" << endl;
-          }
-          else
-          {
-            string funcName = calledFunc->getName().str();
-            if (funcMap.count(funcName) > 0)
-            {
-              internalCall = &inst;
-
-              moduleDep.insert(funcMap[funcName].first);
-              mBB.instCnt += funcMap[funcName].second;
-              if (funcName == "ErrFatal")
-              {
-                common::print << "[DBG]\tThis is Exit Node" << endl;
-                isExitNode = true;
-                // mBB.instCnt -= 1000;
-              }
-            }
-          }
-        }
-      }
-
-      if (!isExitNode)
-      {
-        // ! Iterate all BasicBlock of current function and select greater MEIC of child of current BasicBlock
-        Graph::in_edge_iterator begin, end;
-        int maxInstCnt = 0;
-        for (tie(begin, end) = in_edges(*jj, cfG); begin != end; begin++)
-        {
-          MyBasicBlock childmBB = idBBMap[source(*begin, cfG)];
-          maxInstCnt = max(maxInstCnt, childmBB.instCnt);
-        }
-        mBB.instCnt += maxInstCnt;
-
-        if (internalCall != nullptr)
-        {
-          IRBuilder<> IRB(internalCall);
-          if (!internalCall->getNextNode())
-          {
-            common::print << "[ERR] internal Call is tail of the BB" << endl;
-          }
-
-          IRBuilder<> IRB2(internalCall->getNextNode());
-          Value *penalty;
-          CallInst *ProxyCall;
-
-          penalty = ConstantInt::get(M.getContext(), APInt(32, maxInstCnt, false));
-
-          auto EnterInternalF = IRB.CreateLoad(EnterInternalPtr);
-          ProxyCall = IRB.CreateCall(EnterInternalF, {penalty});
-          setInsNonSan(ProxyCall);
-
-          auto ExitnternalF = IRB2.CreateLoad(ExitInternalPtr);
-          ProxyCall = IRB2.CreateCall(ExitnternalF, {penalty});
-          setInsNonSan(ProxyCall);
-
-          // common::print << "[DBG] Internal Call Analysis routine has been inserted!!" << endl;
-        }
-      }
-
-      // // Loop Compare BasicBlock의 경우 In Loop BB의 InstCnt를 재계산.
-      // // ! Recalculate MEIC of Loop BasicBlock
-      // if (mBB.ptr->getInstList().begin()->getMetadata(LoopCmpMetaId) != NULL)
-      // {
-      //   BranchInst *bInst = (BranchInst *)mBB.ptr->getTerminator();
-      //   if (bInst->getNumSuccessors() == 2)
-      //   {
-      //     MyBasicBlock mInSucc(bInst->getSuccessor(0));
-      //     MyBasicBlock mOutSucc(bInst->getSuccessor(1));
-      //     MyBasicBlock &mInBB = idBBMap[bbIdMap[mInSucc]];
-      //     MyBasicBlock &mOutBB = idBBMap[bbIdMap[mOutSucc]];
-
-      //     mInBB.instCnt += mOutBB.instCnt;
-      //   }
-      // }
-    }
+    keepPenaltyAcrossSetjmp(*F);
 
     // ####################################################################
     //              Phase 4 : Instrument at CMP and BR instructions
     // ####################################################################
 
     // ! Iterate all BasicBlocks in this function and analyze BR instructions.
-    Graph::vertex_iterator bb, ee;
-    for (tie(bb, ee) = vertices(cfG); bb != ee; bb++)
+    for (unsigned b = 0; b < cfg.blocks.size(); b++)
     {
-      auto &mBB = idBBMap[*bb];
-      BasicBlock &BB = *(mBB.ptr);
+      BasicBlock &BB = *cfg.blocks[b];
 
       // Value *mId = ConstantInt::get(M.getContext(), APInt(32, moduleId, false)), *cmpId = nullptr, *cmpType = nullptr, *argType = nullptr, *opSize = nullptr;
       if (!isa<BranchInst>(BB.getTerminator()))
@@ -1358,17 +2214,13 @@ bool MaxAFLPass::runOnModule(Module &M)
       }
 
       BasicBlock *leftSucc = bInst->getSuccessor(0);
-      MyBasicBlock mLeftSucc(leftSucc);
-      MyBasicBlock &mLeftBB = idBBMap[bbIdMap[mLeftSucc]];
-      int left = mLeftBB.instCnt;
+      int left = meic[cfg.index[leftSucc]];
 
       BasicBlock *rightSucc = bInst->getSuccessor(1);
-      MyBasicBlock mRightSucc(rightSucc);
-      MyBasicBlock &mRightBB = idBBMap[bbIdMap[mRightSucc]];
-      int right = mRightBB.instCnt;
+      int right = meic[cfg.index[rightSucc]];
 
       // * Calculate Loop back MEIC as 0
-      if (mBB.ptr->getInstList().begin()->getMetadata(LoopBBMetaId) != NULL && bInst->getNumSuccessors() == 2)
+      if (BB.getInstList().begin()->getMetadata(LoopBBMetaId) != NULL && bInst->getNumSuccessors() == 2)
       {
         if (getSimpleNodeNumber(leftSucc, F) > getSimpleNodeNumber(rightSucc, F))
         {
@@ -1408,9 +2260,7 @@ bool MaxAFLPass::runOnModule(Module &M)
       mId = ConstantInt::get(M.getContext(), APInt(32, moduleId, false));
       brId = ConstantInt::get(M.getContext(), APInt(32, brCnt - 1, false));
 
-      auto VisitBrF = IRB.CreateLoad(VisitBrPtr);
-      CallInst *ProxyCall = IRB.CreateCall(VisitBrF, {mId, brId});
-      setInsNonSan(ProxyCall);
+      emitProbe(IRB, FAST_BR, VisitBr, VisitBrPtr, {mId, brId});
     }
 
     // for (auto brinfo : brvec)
@@ -1519,15 +2369,16 @@ bool MaxAFLPass::runOnModule(Module &M)
     // }
     // }
 
-    MyBasicBlock &mBB = idBBMap[bbIdMap[&(F->getEntryBlock())]];
+    // ! The entry block is block 0 in layout order
     if (!F->hasName() || F->getName().empty())
     {
-      funcMap["NoNameFunc"] = make_pair(moduleId, mBB.instCnt);
+      funcMap["NoNameFunc"] = make_pair(moduleId, meic[0]);
     }
     else
     {
-      funcMap[F->getName().str()] = make_pair(moduleId, mBB.instCnt);
+      funcMap[F->getName().str()] = make_pair(moduleId, meic[0]);
     }
+    endPhase("meic+inst");
   }
 
   // *comInfoFile << "BEGINCMPINFO" << endl;
@@ -1544,23 +2395,37 @@ bool MaxAFLPass::runOnModule(Module &M)
     brinfo.save(*infoFile);
     brinfo.save(*comInfoFile);
   }
+  saveInfoImage(*comInfoBinFile);
+
+  writeInfoFile("infofile.info", comInfoFile->str(), !ltoMode);
+  writeInfoFile(MAXAFL_INFO_BIN_NAME, comInfoBinFile->str(), !ltoMode);
 
   // ! Save module information at funcMap.map
-  ofstream funcMapOStream;
-  funcMapOStream.open(common::funcMapFileName);
-  funcMapOStream << moduleId + 1 << endl;
-  for (map<int, string>::iterator iter = moduleMap.begin(); iter != moduleMap.end(); iter++)
+  if (!ltoMode)
   {
-    funcMapOStream << iter->first << "\t" << iter->second << endl;
+    mergeFuncMap();
   }
-  for (map<string, pair<int, int>>::iterator iter = funcMap.begin(); iter != funcMap.end(); iter++)
+  endPhase("emit");
+
+  if (inlineFast)
   {
-    funcMapOStream << iter->first << "\t" << iter->second.first << "\t" << iter->second.second << endl;
+    lowerFastPaths(M);
+    endPhase("inline");
+  }
+  else
+  {
+    guardProbes(M);
+    endPhase("guard");
   }
-  funcMapOStream.close();
 
   // ! Save optimized LLVM IR file
-  M.print(*resultFile, NULL);
+  if (resultFile)
+  {
+    M.print(*resultFile, NULL);
+    endPhase("print");
+  }
+
+  reportStats(userFuncSet.size());
 
   // ! Free some variables that have used
   freeVariable(M);
@@ -1591,6 +2456,11 @@ static RegisterPass<MaxAFLPass> X("maxafl_pass", "MaxAFLPass", false,
 static void registerMaxAFLPass(const PassManagerBuilder &,
                                legacy::PassManagerBase &PM)
 {
+  // ! With MAXAFL_LTO the objects stay bitcode and afl-clang-fast runs
+  // ! "opt -lowerswitch -maxafl_pass" once on the llvm-linked program
+  if (getenv("MAXAFL_LTO"))
+    return;
+
   // PM.add(new SimplifyCFGPass());
   PM.add(createLowerSwitchPass());
   PM.add(new MaxAFLPass());
@@ -1606,4 +2476,4 @@ static RegisterStandardPasses RegisterMaxAFLPass(
 //     PassManagerBuilder::EP_ModuleOptimizerEarly, registerMaxAFLPass);
 
 static RegisterStandardPasses RegisterMaxAFLPass0(
-    PassManagerBuilder::EP_EnabledOnOptLevel0, registerMaxAFLPass);
\ No newline at end of file
+    PassManagerBuilder::EP_EnabledOnOptLevel0, registerMaxAFLPass);
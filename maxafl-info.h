@@ -0,0 +1,62 @@
+/*
+   MaxAFL - binary info image
+   --------------------------
+
+   Layout of infofile.bin, the binary counterpart of infofile.info written
+   by maxafl-pass. Every instrumented module appends one record:
+
+     maxafl_info_rec_t                      header
+     maxafl_info_cmp_t[cmp_cnt]             cmp sites
+     maxafl_info_br_t[br_cnt]               branch sites
+     s16[vec_cnt * 3]                       (cmpId, cmpType, no) triples
+     zero padding up to payload_len         (multiple of 8)
+
+   The triples are stored exactly the way afl-fuzz lays out the cmpvec
+   segment, so loading a record is a handful of memcpy() calls. checksum
+   is hash32() of the payload (everything after the header) seeded with
+   MAXAFL_INFO_MAGIC.
+
+   The text file keeps being written alongside as a human-readable export.
+*/
+
+#ifndef _HAVE_MAXAFL_INFO_H
+#define _HAVE_MAXAFL_INFO_H
+
+#include "types.h"
+
+#define MAXAFL_INFO_MAGIC 0x4946584d /* "MXFI" */
+#define MAXAFL_INFO_VERSION 1
+
+#define MAXAFL_INFO_BIN_NAME "infofile.bin"
+
+typedef struct maxafl_info_rec
+{
+  u32 magic;
+  u32 version;
+  u32 module_id;
+  u32 cmp_cnt;
+  u32 br_cnt;
+  u32 vec_cnt;
+  u32 checksum;
+  u32 payload_len;
+} maxafl_info_rec_t;
+
+typedef struct maxafl_info_cmp
+{
+  s32 id;
+  s32 cmpType;
+} maxafl_info_cmp_t;
+
+typedef struct maxafl_info_br
+{
+  s32 id;
+  s32 left;
+  s32 right;
+  u32 cmpSize;
+} maxafl_info_br_t;
+
+#define MAXAFL_INFO_PAYLOAD(_c, _b, _v)                                   \
+  (((_c) * sizeof(maxafl_info_cmp_t) + (_b) * sizeof(maxafl_info_br_t) + \
+    (_v) * 3 * sizeof(s16) + 7) & ~7UL)
+
+#endif /* ! _HAVE_MAXAFL_INFO_H */
@@ -154,29 +154,94 @@ typedef struct maxafl_info
   double range;
 } maxafl_info_t;
 
-typedef struct cmp_info
+/* MaxAFL state segment (SHM_ENV_VAR_STATE). A versioned header followed by
+   dense arrays sized to the counts of the loaded info file. From version 6
+   on, the arrays are split in two: the per-exec ones (br_real, cmp_real and
+   the hit lists) follow the header, with offsets relative to the start of
+   the segment; everything else lives in a second segment, shared_id, that
+   every fork server of a run attaches, with offsets relative to its start.
+   Gradient workers therefore see one set of adaptive multipliers and one
+   set of retired sites. The hit lists hold a count in
+   slot 0 and room for every site once, i.e. br_cnt + 1 / cmp_cnt + 1
+   entries. The runtime stores MAXAFL_SHM_VERSION in ack once it has
+   accepted the layout. obj_mode is the only fuzzer-to-runtime setting
+   and is fixed for the whole run. From version 5 on, a runtime in
+   persistent mode clears its own per-exec state between iterations.
+
+   br_done / cmp_done hold one bit per site. afl-fuzz sets a site's bit
+   once it can no longer change the objective, and the probes test it
+   before doing any other work. cmp_users is afl-fuzz bookkeeping for
+   that and is never read by the runtime. */
+
+#define MAXAFL_SHM_MAGIC 0x4641584d /* "MXAF" */
+#define MAXAFL_SHM_VERSION 6
+
+typedef struct maxafl_shm_hdr
 {
-  u32 moduleId;
-  u32 cmpId;
-  u32 cmpType;
-  double real;
-} cmp_info_t;
-
-typedef struct br_info
+  u32 magic;
+  u32 version;
+  u32 ack;
+  u32 br_cnt;
+  u32 cmp_cnt;
+  u32 mod_cnt;
+  u32 vec_cnt;
+  u32 obj_mode; /* OBJ_MODE_* the runtime adapts branch weights for */
+  s32 shared_id; /* shm id of the shared segment                   */
+  u32 pad;
+  u64 size;        /* of this segment                               */
+  u64 shared_size; /* of the shared segment                         */
+  u64 br_real_off;   /* double[br_cnt], rewritten every exec        */
+  u64 cmp_real_off;  /* double[cmp_cnt], rewritten every exec       */
+  u64 br_hit_off;    /* u32[br_cnt + 1], branches hit this exec     */
+  u64 cmp_hit_off;   /* u32[cmp_cnt + 1], cmps hit this exec        */
+  u64 br_static_off; /* br_static_t[br_cnt], read-only after setup */
+  u64 br_adapt_off;  /* br_adapt_t[br_cnt], adaptive multipliers    */
+  u64 br_ptr_off;    /* u32[mod_cnt], first branch of each module   */
+  u64 cmp_ptr_off;   /* u32[mod_cnt], first cmp of each module      */
+  u64 cmpvec_off;    /* s16[vec_cnt * 3], branch condition programs */
+  u64 br_done_off;   /* u8[(br_cnt + 7) / 8], retired branches      */
+  u64 cmp_done_off;  /* u8[(cmp_cnt + 7) / 8], retired cmps         */
+  u64 cmp_users_off; /* u32[cmp_cnt], open branches using each cmp  */
+} maxafl_shm_hdr_t;
+
+#define MAXAFL_SHM_ARR(_hdr, _off) ((void *)((u8 *)(_hdr) + (_hdr)->_off))
+#define MAXAFL_SHM_SHARED(_hdr, _base, _off) \
+  ((void *)((u8 *)(_base) + (_hdr)->_off))
+#define MAXAFL_ALIGN64(_x) (((_x) + 63) & ~(u64)63)
+
+#define MAXAFL_BIT_IS_SET(_map, _i) ((_map)[(_i) >> 3] & (1 << ((_i) & 7)))
+#define MAXAFL_BIT_SET(_map, _i) ((_map)[(_i) >> 3] |= (1 << ((_i) & 7)))
+
+typedef struct br_static
 {
-  u32 moduleId;
-  u32 brId;
   u32 left;
   u32 right;
+  u32 cmpSize;
+  u32 cmpVec;
+} br_static_t;
+
+typedef struct br_adapt
+{
   u32 leftHit;
   u32 rightHit;
   u16 leftMul;
   u16 rightMul;
-  s8 hit;
-  double real;
-  u32 cmpSize;
-  u32 cmpVec;
-} br_info_t;
+} br_adapt_t;
+
+/* Cold per-site metadata, only kept by afl-fuzz. */
+
+typedef struct br_meta
+{
+  u32 moduleId;
+  u32 brId;
+} br_meta_t;
+
+typedef struct cmp_meta
+{
+  u32 moduleId;
+  u32 cmpId;
+  u32 cmpType;
+} cmp_meta_t;
 
 // #define BR_PASS_FAIL 0
 #define BR_CHANGED 1